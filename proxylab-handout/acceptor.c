@@ -0,0 +1,219 @@
+/*
+ * listening sockets and accept loops for proxy.c
+ *
+ * With the defaults one thread accepts on one socket, as the proxy
+ * always did. With conf.acceptors > 1 each acceptor thread opens a
+ * socket of its own on the same port with SO_REUSEPORT, so the
+ * kernel hashes new connections across the sockets and the acceptors
+ * no longer contend for one accept queue.
+ *
+ * With conf.acceptor_pin each acceptor is pinned to a CPU, acceptor
+ * i on the i-th CPU it may run on. The thread it starts for a
+ * connection inherits that affinity, so the connection is served on
+ * the core whose socket took it. The socket is then marked with
+ * SO_INCOMING_CPU, so the kernel hands it the connections whose
+ * packets arrive on that CPU.
+ *
+ * With conf.numa the acceptors are dealt out over the NUMA nodes,
+ * and each is bound to its node's CPUs and memory (affinity.c),
+ * again inherited by its connection threads; with acceptor_pin as
+ * well each is pinned to one CPU of its node. A connection is then
+ * served, and the objects it fills are allocated, on the node whose
+ * acceptor took it.
+ *
+ * With conf.numa and more than one acceptor, a classic BPF program is
+ * attached to the SO_REUSEPORT group so the kernel hands a connection
+ * to an acceptor of the node whose CPU received its packets, the one
+ * pinned to that very CPU if there is one. This does not depend on
+ * acceptor_pin. CPUs the program does not know, and workers, whose
+ * groups span processes, fall back to the kernel's hash.
+ *
+ * With conf.workers every worker process runs its own acceptors on
+ * the port, so SO_REUSEPORT is used for one acceptor as well.
+ *
+ * Connections over conf.max_conns are refused here (admit.c), before
+ * a thread is started for them. fn must call admit_conn_end().
+ */
+
+#include <linux/filter.h>
+#include "csapp.h"
+#include "config.h"
+#include "affinity.h"
+#include "admit.h"
+#include "acceptor.h"
+
+typedef struct ACCEPTOR {
+    int id;
+    int listenfd;
+    int node;                /* bound to this node, -1 if not bound */
+    int cpu;                 /* pinned to this CPU, -1 if not pinned */
+    conn_fn fn;
+    unsigned long accepted;  /* only written by the acceptor */
+} ACCEPTOR;
+
+static ACCEPTOR acceptors[MAX_ACCEPTORS];
+static int nacceptors;
+static int steered;          /* connections go to their node's acceptor */
+
+/* accept connections on one socket and hand each to a new thread */
+static void *accept_loop(void *varptr) {
+    ACCEPTOR *acc = varptr;
+    struct sockaddr_in client_addr;
+    socklen_t client_length;
+    pthread_t thread_id;
+    pthread_attr_t attr;
+    int *connfdp, connfd, rc;
+
+    if (acc->node >= 0 && (rc = node_bind(acc->node))) {
+        fprintf(stderr, "acceptor %d: cannot bind to node %d: %s\n",
+                acc->id, acc->node, strerror(rc));
+        acc->node = -1;
+    }
+    if (acc->cpu >= 0 && (rc = cpu_pin(acc->cpu))) {
+        fprintf(stderr, "acceptor %d: cannot pin to cpu %d: %s\n",
+                acc->id, acc->cpu, strerror(rc));
+        acc->cpu = -1;
+    }
+#ifdef SO_INCOMING_CPU
+    if (acc->cpu >= 0) {
+        setsockopt(acc->listenfd, SOL_SOCKET, SO_INCOMING_CPU, &acc->cpu,
+                   sizeof(acc->cpu));
+    }
+#endif
+    /* connection threads keep their big buffers in bufpool.c */
+    pthread_attr_init(&attr);
+    if (conf.thread_stack_kb > 0 &&
+        (rc = pthread_attr_setstacksize(&attr, conf.thread_stack_kb * 1024 <
+                                        PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN :
+                                        conf.thread_stack_kb * 1024))) {
+        fprintf(stderr, "acceptor %d: cannot set stack size: %s\n",
+                acc->id, strerror(rc));
+    }
+    while (1) {
+        client_length = sizeof(client_addr);
+        connfd = Accept(acc->listenfd, (SA *) &client_addr, &client_length);
+        acc->accepted++;
+        if (!admit_conn()) {
+            admit_reject(connfd);
+            Close(connfd);
+            continue;
+        }
+        connfdp = Malloc(sizeof(int));
+        *connfdp = connfd;
+        Pthread_create(&thread_id, &attr, acc->fn, connfdp);
+    }
+    return NULL;
+}
+
+/*
+ * steer each connection to an acceptor of the node of the CPU it
+ * arrived on: the program loads that CPU and returns the index of
+ * its acceptor in the reuseport group, the order the sockets were
+ * opened in. returns 0, or -1 if the program cannot be attached.
+ */
+static int steer_by_node(void) {
+    struct sock_filter *code = Malloc((2 * CPU_MAX + 2) *
+                                      sizeof(struct sock_filter));
+    struct sock_fprog prog;
+    int next[NODE_MAX] = {0}, count[NODE_MAX] = {0};
+    int cpu, node, i, k, n = 0, rc;
+
+    for (i = 0; i < nacceptors; i++) {
+        if (acceptors[i].node >= 0) {
+            count[acceptors[i].node]++;
+        }
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                             SKF_AD_OFF + SKF_AD_CPU);
+    for (cpu = 0; cpu < CPU_MAX; cpu++) {
+        if ((node = node_of_cpu(cpu)) < 0 || count[node] == 0) {
+            continue;
+        }
+        /* the acceptor pinned to cpu, else the node's in turn */
+        for (i = 0; i < nacceptors && acceptors[i].cpu != cpu; i++)
+            ;
+        if (i == nacceptors) {
+            k = next[node]++ % count[node];
+            for (i = 0; acceptors[i].node != node || k-- > 0; i++)
+                ;
+        }
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                 cpu, 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    /* past the last socket: the kernel hashes instead */
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+    prog.len = n;
+    prog.filter = code;
+    rc = setsockopt(acceptors[0].listenfd, SOL_SOCKET,
+                    SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+    Free(code);
+    return rc;
+}
+
+/*
+ * listen on port and run fn for every connection, with the number
+ * of acceptors from conf. never returns; exits if it cannot listen.
+ */
+void acceptor_run(int port, conn_fn fn) {
+    pthread_t tid;
+    int i;
+
+    nacceptors = conf.acceptors;
+    if (nacceptors > MAX_ACCEPTORS) {
+        fprintf(stderr, "acceptors: using %d, the most allowed\n",
+                MAX_ACCEPTORS);
+        nacceptors = MAX_ACCEPTORS;
+    }
+    for (i = 0; i < nacceptors; i++) {
+        acceptors[i].id = i;
+        acceptors[i].fn = fn;
+        if (conf.numa) {
+            acceptors[i].node = i % node_count();
+            acceptors[i].cpu = conf.acceptor_pin ?
+                node_nth_cpu(acceptors[i].node, i / node_count()) : -1;
+        }
+        else {
+            acceptors[i].node = -1;
+            acceptors[i].cpu = conf.acceptor_pin ? cpu_nth(i) : -1;
+        }
+        /* workers each open the port as well */
+        acceptors[i].listenfd = nacceptors == 1 && !conf.workers ?
+                                open_listenfd(port) :
+                                open_listenfd_reuseport(port);
+        if (acceptors[i].listenfd < 0) {
+            fprintf(stderr, "Error: open_listenfd: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    if (conf.numa && nacceptors > 1 && !conf.workers) {
+        if (steer_by_node() < 0) {
+            fprintf(stderr, "acceptors: cannot steer by node: %s\n",
+                    strerror(errno));
+        }
+        else {
+            steered = 1;
+        }
+    }
+    for (i = 1; i < nacceptors; i++) {
+        Pthread_create(&tid, NULL, accept_loop, &acceptors[i]);
+    }
+    accept_loop(&acceptors[0]);
+}
+
+/* print how many connections each acceptor took */
+void acceptor_report(FILE *fp) {
+    int i;
+
+    fprintf(fp, "acceptors%s:", steered ? " (steered by node)" : "");
+    for (i = 0; i < nacceptors; i++) {
+        fprintf(fp, " %lu", acceptors[i].accepted);
+        if (acceptors[i].node >= 0) {
+            fprintf(fp, "@node%d", acceptors[i].node);
+        }
+        if (acceptors[i].cpu >= 0) {
+            fprintf(fp, "@cpu%d", acceptors[i].cpu);
+        }
+    }
+    fprintf(fp, "\n");
+}
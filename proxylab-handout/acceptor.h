@@ -0,0 +1,17 @@
+/*
+ * listening sockets and accept loops for proxy.c
+ */
+
+#ifndef __ACCEPTOR_H__
+#define __ACCEPTOR_H__
+
+/* most acceptors that may be configured */
+#define MAX_ACCEPTORS 256
+
+/* runs in a new thread for each connection, gets a malloc'd int fd */
+typedef void *(*conn_fn)(void *connfdp);
+
+void acceptor_run(int port, conn_fn fn);
+void acceptor_report(FILE *fp);
+
+#endif /* __ACCEPTOR_H__ */
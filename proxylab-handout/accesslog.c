@@ -0,0 +1,275 @@
+/*
+ * asynchronous access log for proxy.c
+ *
+ * A request fills in a thread-local record as it goes (method, uri,
+ * status, bytes sent, cache result) and at the end formats it as one
+ * line of text:
+ *
+ *   <unix time.ms> <client ip> <method> <uri> <status> <bytes> <us> <result>
+ *
+ * The line goes into a byte ring owned by the thread; a writer thread
+ * drains every ring each conf.log_flush_ms into one large buffer and
+ * writes it to conf.access_log in as few write() calls as it can.
+ * Workers never wait on the writer or on the disk: when their ring
+ * is full the record is dropped and counted. Each ring has a single
+ * producer and a single consumer, so the two sides only share the
+ * head and tail counters. Rings are reused by later threads the same
+ * way as the stats.c slots.
+ *
+ * Past conf.log_max_bytes the file is rotated to access_log.1, the
+ * older ones shift up to access_log.<log_keep>.
+ */
+
+#include "csapp.h"
+#include "config.h"
+#include "accesslog.h"
+
+typedef struct ALOG_RING {
+    char buf[ALOG_RING_SIZE];
+    unsigned long head;          /* bytes appended, set by the owner */
+    unsigned long tail;          /* bytes taken, set by the writer */
+    struct ALOG_RING *next;      /* list of every ring, only grows */
+    struct ALOG_RING *next_free;
+} __attribute__((aligned(64))) ALOG_RING;
+
+static ALOG_RING *rings, *free_rings;
+static sem_t rings_mutex;
+static pthread_key_t ring_key;
+static __thread ALOG_RING *self;
+
+/* the request the calling thread is working on */
+static __thread struct {
+    int active;
+    char ip[INET6_ADDRSTRLEN];
+    char method[16];
+    char uri[ALOG_URI_LEN];
+    int status;
+    unsigned long bytes;
+    char *result;
+} cur;
+
+static int log_fd = -1;
+static unsigned long log_size;
+
+/* counters: dropped by any worker, the others by the writer only */
+static unsigned long dropped_cnt, written_bytes, write_cnt, rotate_cnt;
+
+/* give the ring of an exiting thread back */
+static void ring_put(void *varptr) {
+    ALOG_RING *ring = varptr;
+
+    P(&rings_mutex);
+    ring->next_free = free_rings;
+    free_rings = ring;
+    V(&rings_mutex);
+}
+
+/* the ring of the calling thread, taken on its first record */
+static ALOG_RING *alog_self() {
+    ALOG_RING *ring;
+
+    if (self) {
+        return self;
+    }
+    P(&rings_mutex);
+    if ((ring = free_rings) != NULL) {
+        free_rings = ring->next_free;
+    }
+    else {
+        /* the writer walks the list without the mutex */
+        ring = Calloc(1, sizeof(ALOG_RING));
+        ring->next = rings;
+        __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    }
+    V(&rings_mutex);
+    pthread_setspecific(ring_key, ring);
+    self = ring;
+    return ring;
+}
+
+/* append a record to the ring of the calling thread, or drop it */
+static void ring_append(char *rec, int len) {
+    ALOG_RING *ring = alog_self();
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    int off = head % ALOG_RING_SIZE, n;
+
+    if (head - tail + len > ALOG_RING_SIZE) {
+        __sync_fetch_and_add(&dropped_cnt, 1);
+        return;
+    }
+    n = ALOG_RING_SIZE - off < len ? ALOG_RING_SIZE - off : len;
+    memcpy(ring->buf + off, rec, n);
+    memcpy(ring->buf, rec + n, len - n);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+/* start a record for a request from the client at ip */
+void alog_request(char *ip, char *method, char *uri) {
+    if (log_fd < 0) {
+        return;
+    }
+    cur.active = 1;
+    snprintf(cur.ip, sizeof(cur.ip), "%s", ip);
+    snprintf(cur.method, sizeof(cur.method), "%s", method);
+    snprintf(cur.uri, ALOG_URI_LEN, "%s", uri);
+    cur.status = 0;
+    cur.bytes = 0;
+    cur.result = "-";
+}
+
+/* the status code sent to the client */
+void alog_status(int status) {
+    cur.status = status;
+}
+
+/* bytes sent to the client, added up */
+void alog_bytes(unsigned long n) {
+    cur.bytes += n;
+}
+
+/* how the request was answered: hit, miss, error... */
+void alog_result(char *result) {
+    cur.result = result;
+}
+
+/* finish the record of the request, which took us */
+void alog_end(unsigned long us) {
+    char rec[ALOG_URI_LEN + 256];
+    struct timeval tv;
+    int len;
+
+    if (!cur.active) {
+        return;
+    }
+    cur.active = 0;
+    gettimeofday(&tv, NULL);
+    len = snprintf(rec, sizeof(rec), "%ld.%03ld %s %s %s %d %lu %lu %s\n",
+                   (long)tv.tv_sec, (long)tv.tv_usec / 1000, cur.ip,
+                   cur.method, cur.uri, cur.status, cur.bytes, us,
+                   cur.result);
+    ring_append(rec, len);
+}
+
+/* rename access_log.k to access_log.k+1 and reopen a fresh file */
+static void log_rotate() {
+    char from[MAXLINE], to[MAXLINE];
+    int k;
+
+    close(log_fd);
+    for (k = conf.log_keep - 1; k >= 1; k--) {
+        snprintf(from, MAXLINE, "%s.%d", conf.access_log, k);
+        snprintf(to, MAXLINE, "%s.%d", conf.access_log, k + 1);
+        rename(from, to);
+    }
+    if (conf.log_keep > 0) {
+        snprintf(to, MAXLINE, "%s.1", conf.access_log);
+        rename(conf.access_log, to);
+    }
+    else {
+        unlink(conf.access_log);
+    }
+    if ((log_fd = open(conf.access_log, O_WRONLY | O_CREAT | O_APPEND,
+                       0644)) < 0) {
+        fprintf(stderr, "access log %s: %s\n", conf.access_log,
+                strerror(errno));
+        return;
+    }
+    log_size = 0;
+    rotate_cnt++;
+}
+
+/* write a batch out, rotating the file once it is large enough */
+static void log_write(char *buf, int n) {
+    if (log_fd < 0 || n == 0) {
+        return;
+    }
+    if (rio_writen(log_fd, buf, n) < 0) {
+        fprintf(stderr, "access log %s: %s\n", conf.access_log,
+                strerror(errno));
+        return;
+    }
+    written_bytes += n;
+    write_cnt++;
+    if ((log_size += n) >= conf.log_max_bytes) {
+        log_rotate();
+    }
+}
+
+/* move what is waiting in ring to batch, writing whenever it fills */
+static int ring_take(ALOG_RING *ring, char *batch, int n) {
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = ring->tail;
+    int off, len;
+
+    while (tail < head) {
+        if (n == ALOG_BATCH_SIZE) {
+            log_write(batch, n);
+            n = 0;
+        }
+        off = tail % ALOG_RING_SIZE;
+        len = head - tail;
+        if (len > ALOG_RING_SIZE - off) {
+            len = ALOG_RING_SIZE - off;
+        }
+        if (len > ALOG_BATCH_SIZE - n) {
+            len = ALOG_BATCH_SIZE - n;
+        }
+        memcpy(batch + n, ring->buf + off, len);
+        n += len;
+        tail += len;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+/* drain every ring to the log file until the process exits */
+static void *alog_thread(void *vargp) {
+    char *batch = Malloc(ALOG_BATCH_SIZE);
+    ALOG_RING *ring;
+    int n;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        usleep(conf.log_flush_ms * 1000);
+        n = 0;
+        for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring;
+             ring = ring->next) {
+            n = ring_take(ring, batch, n);
+        }
+        log_write(batch, n);
+    }
+    return NULL;
+}
+
+/* open conf.access_log and start the writer, if there is a log */
+void alog_init(void) {
+    pthread_t tid;
+    struct stat st;
+    int rc;
+
+    Sem_init(&rings_mutex, 0, 1);
+    if ((rc = pthread_key_create(&ring_key, ring_put))) {
+        posix_error(rc, "pthread_key_create error");
+    }
+    if (conf.access_log == NULL) {
+        return;
+    }
+    if ((log_fd = open(conf.access_log, O_WRONLY | O_CREAT | O_APPEND,
+                       0644)) < 0) {
+        fprintf(stderr, "access log %s: %s\n", conf.access_log,
+                strerror(errno));
+        exit(1);
+    }
+    if (fstat(log_fd, &st) == 0) {
+        log_size = st.st_size;
+    }
+    Pthread_create(&tid, NULL, alog_thread, NULL);
+}
+
+/* print the access log counters */
+void alog_report(FILE *fp) {
+    fprintf(fp, "accesslog: %lu bytes in %lu writes, %lu rotations, "
+            "%lu records dropped\n", written_bytes, write_cnt, rotate_cnt,
+            dropped_cnt);
+}
@@ -0,0 +1,25 @@
+/*
+ * asynchronous access log for proxy.c
+ */
+
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+/* bytes of log records a thread may have waiting for the writer */
+#define ALOG_RING_SIZE 16384
+
+/* bytes the writer gathers before a write() */
+#define ALOG_BATCH_SIZE (256 * 1024)
+
+/* bytes of the uri kept in a record */
+#define ALOG_URI_LEN 1024
+
+void alog_init(void);
+void alog_request(char *ip, char *method, char *uri);
+void alog_status(int status);
+void alog_bytes(unsigned long n);
+void alog_result(char *result);
+void alog_end(unsigned long us);
+void alog_report(FILE *fp);
+
+#endif /* __ACCESSLOG_H__ */
@@ -0,0 +1,127 @@
+/*
+ * admission control and load shedding for proxy.c
+ *
+ * Two limits keep an overloaded proxy answering quickly instead of
+ * spawning threads until memory runs out:
+ *
+ *   conf.max_conns     connections with a thread. The acceptor answers
+ *                      any connection over it with a canned 503 and
+ *                      closes it without starting a thread.
+ *   conf.max_inflight  requests past the cache lookup. A hit is
+ *                      admitted up to the limit, a miss only up to
+ *                      conf.shed_miss_pct of it, so under overload
+ *                      misses are shed first and hits, which cost no
+ *                      origin work, are still served.
+ *
+ * A shed request gets the same 503 before any upstream work is done.
+ * 0 disables a limit. The counts are plain atomics; sheds are counted
+ * in stats.c.
+ */
+
+#include "csapp.h"
+#include "config.h"
+#include "stats.h"
+#include "admit.h"
+
+static const char *reject_resp =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 20\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n\r\n"
+    "The proxy is busy.\r\n";
+
+static long conns;            /* connections with a thread */
+static long inflight;         /* admitted requests not yet done */
+static unsigned long last_shed_us;
+
+static void shed(int counter) {
+    stats_add(counter, 1);
+    __atomic_store_n(&last_shed_us, stats_now_us(), __ATOMIC_RELAXED);
+}
+
+/*
+ * take a connection slot for a new connection
+ * returns 1 if it may get a thread, 0 if it is to be rejected
+ */
+int admit_conn(void) {
+    if (__atomic_add_fetch(&conns, 1, __ATOMIC_RELAXED) > conf.max_conns &&
+        conf.max_conns > 0) {
+        __atomic_sub_fetch(&conns, 1, __ATOMIC_RELAXED);
+        shed(STAT_SHED_CONNS);
+        return 0;
+    }
+    return 1;
+}
+
+/* give back the slot of admit_conn() when the connection is closed */
+void admit_conn_end(void) {
+    __atomic_sub_fetch(&conns, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * admit a request whose cache lookup found a block (hit) or not
+ * returns 1 if it may go on, then admit_request_end() must follow;
+ * 0 if it is to be answered with admit_reject()
+ */
+int admit_request(int hit) {
+    long limit = conf.max_inflight;
+
+    if (!hit) {
+        limit = limit * conf.shed_miss_pct / 100;
+        if (limit < 1) {
+            limit = 1;
+        }
+    }
+    if (__atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED) > limit &&
+        conf.max_inflight > 0) {
+        __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+        shed(hit ? STAT_SHED_HITS : STAT_SHED_MISSES);
+        return 0;
+    }
+    return 1;
+}
+
+void admit_request_end(void) {
+    __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * send the 503 to fd without ever blocking on it
+ * returns the bytes sent, -1 if none could be
+ */
+int admit_reject(int fd) {
+    return send(fd, reject_resp, strlen(reject_resp),
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* tell whether anything was shed in the last ADMIT_ACTIVE_MS */
+int admit_shedding(void) {
+    unsigned long last = __atomic_load_n(&last_shed_us, __ATOMIC_RELAXED);
+
+    return last && stats_now_us() - last < ADMIT_ACTIVE_MS * 1000UL;
+}
+
+/* the gauges, in the text format of stats_format() */
+int admit_format(char *buf, int size) {
+    int len = snprintf(buf, size,
+                       "proxy_connections %ld\n"
+                       "proxy_inflight_requests %ld\n"
+                       "proxy_shedding %d\n",
+                       __atomic_load_n(&conns, __ATOMIC_RELAXED),
+                       __atomic_load_n(&inflight, __ATOMIC_RELAXED),
+                       admit_shedding());
+
+    return len < size ? len : size - 1;
+}
+
+/* print the load and what was shed */
+void admit_report(FILE *fp) {
+    fprintf(fp, "admit: %ld connections, %ld requests in flight, shed "
+            "%lu connections, %lu misses, %lu hits%s\n",
+            __atomic_load_n(&conns, __ATOMIC_RELAXED),
+            __atomic_load_n(&inflight, __ATOMIC_RELAXED),
+            stats_counter(STAT_SHED_CONNS), stats_counter(STAT_SHED_MISSES),
+            stats_counter(STAT_SHED_HITS),
+            admit_shedding() ? ", shedding now" : "");
+}
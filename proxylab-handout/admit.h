@@ -0,0 +1,20 @@
+/*
+ * admission control and load shedding for proxy.c
+ */
+
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+/* shedding is reported as active this long after the last shed */
+#define ADMIT_ACTIVE_MS 1000
+
+int  admit_conn(void);
+void admit_conn_end(void);
+int  admit_request(int hit);
+void admit_request_end(void);
+int  admit_reject(int fd);
+int  admit_shedding(void);
+int  admit_format(char *buf, int size);
+void admit_report(FILE *fp);
+
+#endif /* __ADMIT_H__ */
@@ -0,0 +1,274 @@
+/*
+ * CPU and NUMA placement of threads
+ *
+ * The nodes and their CPUs are read from /sys/devices/system/node
+ * once by node_init(). A thread bound to a node only runs on that
+ * node's CPUs and prefers that node's memory (set_mempolicy), so
+ * the cache chunks it fills are allocated locally even when it
+ * allocates before it first runs there. A kernel without NUMA shows
+ * up as a single node holding every CPU.
+ *
+ * node_report() prints, per node, how the kernel's numastat counters
+ * moved since node_init() and how many of the proxy's own pages live
+ * there (/proc/self/numa_maps). numastat counts allocations of the
+ * whole host, so other_node and numa_miss are an indication of remote
+ * placement, not a count of remote accesses; use perf for the latter.
+ *
+ * Kept apart from csapp.h, whose gai_error() clashes with the GNU
+ * declarations that cpu_set_t and pthread_setaffinity_np() need.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "affinity.h"
+
+/* from linux/mempolicy.h */
+#define NODE_MPOL_PREFERRED 1
+
+#define NODE_DIR "/sys/devices/system/node"
+
+/* the numastat counters that are reported */
+static char *node_stat_names[] = {
+    "numa_hit", "numa_miss", "numa_foreign", "local_node", "other_node"
+};
+#define NODE_NSTATS (sizeof(node_stat_names) / sizeof(char *))
+
+typedef struct NODE {
+    int id;                   /* number of the node in sysfs */
+    cpu_set_t cpus;           /* its CPUs we are allowed to run on */
+    cpu_set_t home;           /* all of its CPUs, where its packets land */
+    int ncpus;
+    unsigned long base[NODE_NSTATS];  /* numastat at node_init() */
+} NODE;
+
+static NODE nodes[NODE_MAX];
+static int nnodes;
+
+/* the n-th CPU this process may run on, wrapping around; -1 if unknown */
+int cpu_nth(int n) {
+    cpu_set_t set;
+    int cpu, cnt;
+
+    if (n < 0 || sched_getaffinity(0, sizeof(set), &set) < 0 ||
+        (cnt = CPU_COUNT(&set)) == 0) {
+        return -1;
+    }
+    n %= cnt;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set) && n-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/*
+ * pin the calling thread to cpu; threads it creates later inherit it
+ * returns 0, or an error number
+ */
+int cpu_pin(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* parse a sysfs cpu list such as "0-3,8-11" into set */
+static void parse_cpulist(char *list, cpu_set_t *set) {
+    char *p = list;
+    long lo, hi;
+
+    CPU_ZERO(set);
+    while (*p) {
+        lo = strtol(p, &p, 10);
+        hi = lo;
+        if (*p == '-') {
+            hi = strtol(p + 1, &p, 10);
+        }
+        for (; lo <= hi && lo < CPU_SETSIZE; lo++) {
+            CPU_SET(lo, set);
+        }
+        if (*p != ',') {
+            break;
+        }
+        p++;
+    }
+}
+
+/* read the numastat counters of node id into stat, -1 if there are none */
+static int read_numastat(int id, unsigned long *stat) {
+    char path[128], name[64];
+    unsigned long val;
+    unsigned i;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), NODE_DIR "/node%d/numastat", id);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    while (fscanf(fp, "%63s %lu", name, &val) == 2) {
+        for (i = 0; i < NODE_NSTATS; i++) {
+            if (!strcmp(name, node_stat_names[i])) {
+                stat[i] = val;
+            }
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* find the nodes and their CPUs; call before any thread is bound */
+void node_init(void) {
+    char path[128], list[4096];
+    cpu_set_t allowed;
+    FILE *fp;
+    int id;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        CPU_ZERO(&allowed);
+    }
+    nnodes = 0;
+    for (id = 0; id < NODE_MAX; id++) {
+        snprintf(path, sizeof(path), NODE_DIR "/node%d/cpulist", id);
+        if ((fp = fopen(path, "r")) == NULL) {
+            continue;
+        }
+        if (fgets(list, sizeof(list), fp) != NULL) {
+            nodes[nnodes].id = id;
+            parse_cpulist(list, &nodes[nnodes].cpus);
+            nodes[nnodes].home = nodes[nnodes].cpus;
+            CPU_AND(&nodes[nnodes].cpus, &nodes[nnodes].cpus, &allowed);
+            nodes[nnodes].ncpus = CPU_COUNT(&nodes[nnodes].cpus);
+            /* memory-only nodes have no CPU to bind a thread to */
+            if (nodes[nnodes].ncpus > 0) {
+                read_numastat(id, nodes[nnodes].base);
+                nnodes++;
+            }
+        }
+        fclose(fp);
+    }
+    if (nnodes == 0) {
+        nodes[0].id = -1;
+        nodes[0].cpus = allowed;
+        nodes[0].home = allowed;
+        nodes[0].ncpus = CPU_COUNT(&allowed);
+        nnodes = 1;
+    }
+}
+
+int node_count(void) {
+    return nnodes;
+}
+
+/* the node (an index below node_count()) cpu is on, -1 if unknown */
+int node_of_cpu(int cpu) {
+    int node;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+    for (node = 0; node < nnodes; node++) {
+        if (CPU_ISSET(cpu, &nodes[node].home)) {
+            return node;
+        }
+    }
+    return -1;
+}
+
+/* the n-th CPU of node, wrapping around; -1 if unknown */
+int node_nth_cpu(int node, int n) {
+    int cpu;
+
+    if (node < 0 || node >= nnodes || nodes[node].ncpus == 0 || n < 0) {
+        return -1;
+    }
+    n %= nodes[node].ncpus;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &nodes[node].cpus) && n-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/*
+ * run the calling thread on the CPUs of node (an index below
+ * node_count()) and allocate its memory there when possible.
+ * threads it creates later inherit both.
+ * returns 0, or an error number
+ */
+int node_bind(int node) {
+    unsigned long mask[NODE_MAX / (8 * sizeof(unsigned long))];
+    int rc;
+
+    if (node < 0 || node >= nnodes) {
+        return EINVAL;
+    }
+    if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                     &nodes[node].cpus))) {
+        return rc;
+    }
+    if (nodes[node].id < 0) {
+        return 0;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[nodes[node].id / (8 * sizeof(unsigned long))] |=
+        1UL << (nodes[node].id % (8 * sizeof(unsigned long)));
+    /* a kernel without NUMA support refuses, which costs nothing */
+    syscall(SYS_set_mempolicy, NODE_MPOL_PREFERRED, mask, NODE_MAX + 1);
+    return 0;
+}
+
+/* pages of this process on each node, from /proc/self/numa_maps */
+static void node_pages(unsigned long *pages) {
+    char line[4096], *p;
+    unsigned long n;
+    int id;
+    FILE *fp;
+
+    memset(pages, 0, NODE_MAX * sizeof(unsigned long));
+    if ((fp = fopen("/proc/self/numa_maps", "r")) == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        for (p = strstr(line, " N"); p; p = strstr(p + 1, " N")) {
+            if (sscanf(p, " N%d=%lu", &id, &n) == 2 &&
+                id >= 0 && id < NODE_MAX) {
+                pages[id] += n;
+            }
+        }
+    }
+    fclose(fp);
+}
+
+/* print per node the numastat deltas and the pages the proxy has there */
+void node_report(FILE *fp) {
+    unsigned long stat[NODE_NSTATS], pages[NODE_MAX];
+    unsigned i;
+    int n;
+
+    node_pages(pages);
+    for (n = 0; n < nnodes; n++) {
+        fprintf(fp, "numa: node%d %d cpus", nodes[n].id < 0 ? 0 : nodes[n].id,
+                nodes[n].ncpus);
+        memcpy(stat, nodes[n].base, sizeof(stat));
+        if (nodes[n].id < 0 || read_numastat(nodes[n].id, stat) < 0) {
+            fprintf(fp, ", no numastat\n");
+            continue;
+        }
+        fprintf(fp, ", %lu proxy pages", pages[nodes[n].id]);
+        for (i = 0; i < NODE_NSTATS; i++) {
+            fprintf(fp, ", %s +%lu", node_stat_names[i],
+                    stat[i] - nodes[n].base[i]);
+        }
+        fprintf(fp, "\n");
+    }
+}
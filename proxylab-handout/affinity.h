@@ -0,0 +1,26 @@
+/*
+ * CPU and NUMA placement of threads
+ */
+
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <stdio.h>
+
+/* most NUMA nodes that are looked for */
+#define NODE_MAX 64
+
+/* CPUs past this are not looked up by node_of_cpu() callers */
+#define CPU_MAX 1024
+
+int  cpu_nth(int n);
+int  cpu_pin(int cpu);
+
+void node_init(void);
+int  node_count(void);
+int  node_nth_cpu(int node, int n);
+int  node_of_cpu(int cpu);
+int  node_bind(int node);
+void node_report(FILE *fp);
+
+#endif /* __AFFINITY_H__ */
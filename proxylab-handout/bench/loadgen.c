@@ -0,0 +1,291 @@
+/*
+ * loadgen - load generator for the proxy
+ *
+ * Sends GET http://<origin>/obj/<id> through the proxy, with ids drawn
+ * from a Zipf distribution over -n objects, for -t seconds, then
+ * prints requests/s, the hit ratio and latency percentiles.
+ *
+ * Closed loop (the default): -c connections each send a request as
+ * soon as the previous one finished. Open loop (-r rate): requests
+ * are due at a fixed total rate spread over the -c workers, and
+ * latency is counted from the time a request was due rather than
+ * the time it was sent, so a stalled proxy shows up in the tail
+ * instead of silently lowering the offered load.
+ *
+ * The hit ratio is 1 - origin requests / proxy requests, read from
+ * the /stats counter of bench/origin before and after the run.
+ *
+ * usage: loadgen [-x proxy_port] [-o origin_port] [-n objects]
+ *                [-s zipf_s] [-c conns] [-t seconds] [-r rate]
+ *                [-w warmup_seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static int proxy_port = 15213, origin_port = 18080;
+static int nobj = 10000, conns = 16, seconds = 10, warmup = 2;
+static double zipf_s = 0.9, rate;
+static double *cdf;
+static volatile int running = 1, measuring;
+
+typedef struct {
+    int id;
+    unsigned long long seed;
+    double *lat;             /* latencies in us of measured requests */
+    long n, cap;
+    long errors;
+    unsigned long bytes;
+} Worker;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double unit(unsigned long long *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return (*x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* an object id from the Zipf cdf */
+static int zipf_pick(unsigned long long *seed) {
+    double u = unit(seed) * cdf[nobj - 1];
+    int lo = 0, hi = nobj - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cdf[mid] < u) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int connect_local(int port) {
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * send the request req to port and read the whole response, keeping
+ * up to body_max bytes of it in body when body is not NULL
+ * returns the bytes received, or -1 if it failed or was not a 200
+ */
+static long request(int port, char *req, char *body, int body_max) {
+    static __thread char buf[65536];
+    char first[12];
+    long total = 0, r;
+    int fd, len = strlen(req);
+
+    if ((fd = connect_local(port)) < 0) {
+        return -1;
+    }
+    if (write(fd, req, len) != len) {
+        close(fd);
+        return -1;
+    }
+    while ((r = read(fd, buf, sizeof(buf))) > 0) {
+        if (total < (long)sizeof(first)) {
+            memcpy(first + total, buf, r < (long)sizeof(first) - total ?
+                   r : (long)sizeof(first) - total);
+        }
+        if (body && total < body_max) {
+            memcpy(body + total, buf,
+                   r < body_max - total ? r : body_max - total);
+        }
+        total += r;
+    }
+    close(fd);
+    /* "HTTP/1.x 200" */
+    if (r < 0 || total < (long)sizeof(first) ||
+        strncmp(first + 9, "200", 3)) {
+        return -1;
+    }
+    return total;
+}
+
+/* objects the origin has served so far, -1 if it cannot be asked */
+static long origin_requests() {
+    char body[4096], *p;
+    long n = request(origin_port, "GET /stats HTTP/1.0\r\n\r\n", body,
+                     sizeof(body) - 1);
+
+    if (n < 0) {
+        return -1;
+    }
+    body[n < (long)sizeof(body) - 1 ? n : (long)sizeof(body) - 1] = '\0';
+    if ((p = strstr(body, "requests ")) == NULL) {
+        return -1;
+    }
+    return atol(p + 9);
+}
+
+static void record(Worker *w, double us, long bytes) {
+    if (!measuring) {
+        return;
+    }
+    if (bytes < 0) {
+        w->errors++;
+        return;
+    }
+    if (w->n == w->cap) {
+        w->cap = w->cap ? w->cap * 2 : 4096;
+        w->lat = realloc(w->lat, w->cap * sizeof(double));
+    }
+    w->lat[w->n++] = us;
+    w->bytes += bytes;
+}
+
+static void *worker(void *arg) {
+    Worker *w = arg;
+    char req[256];
+    double due, start, gap = rate > 0 ? conns * 1e6 / rate : 0;
+    long bytes;
+
+    due = now_us() + (rate > 0 ? w->id * 1e6 / rate : 0);
+    while (running) {
+        if (rate > 0) {
+            start = now_us();
+            if (due > start) {
+                usleep((useconds_t)(due - start));
+            }
+        }
+        else {
+            due = now_us();
+        }
+        snprintf(req, sizeof(req), "GET http://localhost:%d/obj/%d "
+                 "HTTP/1.0\r\nHost: localhost:%d\r\n\r\n", origin_port,
+                 zipf_pick(&w->seed), origin_port);
+        bytes = request(proxy_port, req, NULL, 0);
+        record(w, now_us() - due, bytes);
+        due += gap;
+    }
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(double *)a, y = *(double *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    Worker *workers;
+    pthread_t *tids;
+    double *all, sum = 0, elapsed, t0;
+    long n = 0, errors = 0, o0, o1, k;
+    unsigned long bytes = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "x:o:n:s:c:t:r:w:")) != -1) {
+        switch (opt) {
+        case 'x': proxy_port = atoi(optarg); break;
+        case 'o': origin_port = atoi(optarg); break;
+        case 'n': nobj = atoi(optarg); break;
+        case 's': zipf_s = atof(optarg); break;
+        case 'c': conns = atoi(optarg); break;
+        case 't': seconds = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-x proxy_port] [-o origin_port] "
+                    "[-n objects] [-s zipf_s] [-c conns] [-t seconds] "
+                    "[-r rate] [-w warmup_seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nobj < 1 || conns < 1 || seconds < 1) {
+        fprintf(stderr, "objects, conns and seconds must be positive\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    cdf = malloc(nobj * sizeof(double));
+    for (i = 0; i < nobj; i++) {
+        sum += 1.0 / pow(i + 1, zipf_s);
+        cdf[i] = sum;
+    }
+
+    workers = calloc(conns, sizeof(Worker));
+    tids = malloc(conns * sizeof(pthread_t));
+    for (i = 0; i < conns; i++) {
+        workers[i].id = i;
+        workers[i].seed = 15213 + i * 0x9E3779B97F4A7C15ULL;
+        pthread_create(&tids[i], NULL, worker, &workers[i]);
+    }
+    sleep(warmup);
+    o0 = origin_requests();
+    t0 = now_us();
+    measuring = 1;
+    sleep(seconds);
+    measuring = 0;
+    elapsed = (now_us() - t0) / 1e6;
+    o1 = origin_requests();
+    running = 0;
+    for (i = 0; i < conns; i++) {
+        pthread_join(tids[i], NULL);
+        n += workers[i].n;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+    }
+
+    all = malloc((n ? n : 1) * sizeof(double));
+    for (i = 0, k = 0; i < conns; i++) {
+        memcpy(all + k, workers[i].lat, workers[i].n * sizeof(double));
+        k += workers[i].n;
+    }
+    qsort(all, n, sizeof(double), cmp_double);
+
+    printf("%s loop, %d conns, %d objects, zipf s=%.2f, %ds\n",
+           rate > 0 ? "open" : "closed", conns, nobj, zipf_s, seconds);
+    if (rate > 0) {
+        printf("offered   %.0f req/s\n", rate);
+    }
+    printf("requests  %ld ok, %ld errors\n", n, errors);
+    printf("rate      %.0f req/s, %.1f MB/s\n", n / elapsed,
+           bytes / elapsed / 1e6);
+    if (o0 >= 0 && o1 >= 0 && n + errors > 0) {
+        printf("hit ratio %.2f%% (%ld origin requests)\n",
+               100.0 * (1 - (double)(o1 - o0) / (n + errors)), o1 - o0);
+    }
+    else {
+        printf("hit ratio unknown (origin /stats not reachable)\n");
+    }
+    if (n > 0) {
+        printf("latency   p50 %.0fus  p99 %.0fus  p999 %.0fus  max %.0fus\n",
+               all[(long)(0.5 * (n - 1))], all[(long)(0.99 * (n - 1))],
+               all[(long)(0.999 * (n - 1))], all[n - 1]);
+    }
+    return errors > 0 && n == 0;
+}
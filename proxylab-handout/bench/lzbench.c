@@ -0,0 +1,271 @@
+/*
+ * lzbench - trade-off of the compressed cache tier
+ *
+ * Compresses a corpus the way cache.c does (each CACHE_CHUNK_SIZE
+ * chunk on its own, kept only if it saves compress_min_pct), then
+ * replays a Zipf distributed request stream through an LRU of a few
+ * byte budgets, once charging objects their raw size and once their
+ * stored size. It prints the hit ratio of both, and the CPU time
+ * compression costs per miss and decompression per hit.
+ *
+ * usage: lzbench [-n objects] [-r requests] [-s zipf_s] [-p min_pct]
+ *                [file ...]
+ * with files, each file is one object; otherwise a synthetic mix of
+ * html, json and incompressible binary objects is generated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include "../lz.h"
+
+#define CHUNK 16384   /* CACHE_CHUNK_SIZE */
+
+typedef struct {
+    char *data;
+    long size;         /* raw bytes */
+    long stored;       /* bytes after chunk compression */
+    double comp_ns;    /* time to compress it once */
+    double decomp_ns;  /* time to decompress it once */
+} Obj;
+
+typedef struct {
+    int prev, next;
+    int in;
+} Node;
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const char *words[] = {
+    "the", "proxy", "cache", "object", "request", "header", "server",
+    "client", "content", "length", "value", "thread", "block", "list",
+    "return", "data", "http", "index", "class", "div", "span", "item",
+    "price", "user", "name", "title", "description", "image", "link"
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+/* fill buf with size bytes of html, json or random bytes */
+static void synth(char *buf, long size, int kind) {
+    long n = 0;
+    int i = 0;
+
+    while (n < size) {
+        char tmp[256];
+        int len;
+        if (kind == 0) {
+            len = snprintf(tmp, sizeof(tmp),
+                           "<div class=\"%s\"><span>%s %s</span></div>\n",
+                           words[rand() % NWORDS], words[rand() % NWORDS],
+                           words[rand() % NWORDS]);
+        }
+        else if (kind == 1) {
+            len = snprintf(tmp, sizeof(tmp),
+                           "{\"id\":%d,\"%s\":\"%s\",\"%s\":%d},",
+                           i++, words[rand() % NWORDS],
+                           words[rand() % NWORDS], words[rand() % NWORDS],
+                           rand() % 1000);
+        }
+        else {
+            for (len = 0; len < 64; len++) {
+                tmp[len] = rand();
+            }
+        }
+        if (len > size - n) {
+            len = size - n;
+        }
+        memcpy(buf + n, tmp, len);
+        n += len;
+    }
+}
+
+/* compress and decompress an object chunk by chunk, timing both */
+static void measure(Obj *o, int min_pct) {
+    static char comp[CHUNK], back[CHUNK];
+    long off;
+    int len, cap, n, rep, reps = 3;
+    double t;
+
+    o->stored = 0;
+    o->comp_ns = o->decomp_ns = 0;
+    for (off = 0; off < o->size; off += len) {
+        len = o->size - off < CHUNK ? o->size - off : CHUNK;
+        cap = len - len * min_pct / 100;
+        t = now_ns();
+        for (rep = 0; rep < reps; rep++) {
+            n = lz_compress(o->data + off, len, comp, cap);
+        }
+        o->comp_ns += (now_ns() - t) / reps;
+        if (n <= 0) {
+            o->stored += len;
+            continue;
+        }
+        o->stored += n;
+        t = now_ns();
+        for (rep = 0; rep < reps; rep++) {
+            if (lz_decompress(comp, n, back, CHUNK) != len ||
+                memcmp(back, o->data + off, len)) {
+                fprintf(stderr, "round trip failed\n");
+                exit(1);
+            }
+        }
+        o->decomp_ns += (now_ns() - t) / reps;
+    }
+}
+
+/* replay reqs through an LRU of budget bytes, sizes raw or stored */
+static double simulate(Obj *objs, int n, int *reqs, int nreq, long budget,
+                       int compressed, double *cpu_ns) {
+    Node *node = calloc(n + 1, sizeof(Node));
+    int head = n, i, id, hits = 0;
+    long used = 0, sz;
+
+    node[head].prev = node[head].next = head;
+    *cpu_ns = 0;
+    for (i = 0; i < nreq; i++) {
+        id = reqs[i];
+        sz = compressed ? objs[id].stored : objs[id].size;
+        if (node[id].in) {
+            hits++;
+            node[node[id].prev].next = node[id].next;
+            node[node[id].next].prev = node[id].prev;
+            if (compressed) {
+                *cpu_ns += objs[id].decomp_ns;
+            }
+        }
+        else {
+            if (sz > budget) {
+                continue;
+            }
+            if (compressed) {
+                *cpu_ns += objs[id].comp_ns;
+            }
+            while (used + sz > budget) {
+                int victim = node[head].prev;
+                node[node[victim].prev].next = head;
+                node[head].prev = node[victim].prev;
+                node[victim].in = 0;
+                used -= compressed ? objs[victim].stored : objs[victim].size;
+            }
+            node[id].in = 1;
+            used += sz;
+        }
+        node[id].next = node[head].next;
+        node[id].prev = head;
+        node[node[head].next].prev = id;
+        node[head].next = id;
+    }
+    free(node);
+    return (double)hits / nreq;
+}
+
+/* draw nreq object ids from a Zipf(s) distribution over n objects */
+static int *zipf_stream(int n, int nreq, double s) {
+    double *cdf = malloc(n * sizeof(double)), sum = 0, u;
+    int *reqs = malloc(nreq * sizeof(int)), i, lo, hi, mid;
+
+    for (i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, s);
+        cdf[i] = sum;
+    }
+    for (i = 0; i < nreq; i++) {
+        u = (double)rand() / RAND_MAX * sum;
+        lo = 0;
+        hi = n - 1;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        reqs[i] = lo;
+    }
+    free(cdf);
+    return reqs;
+}
+
+int main(int argc, char **argv) {
+    static long budgets[] = {256L << 10, 1L << 20, 4L << 20, 16L << 20};
+    int nobj = 400, nreq = 200000, min_pct = 10, opt, i;
+    double s = 0.9, raw_hit, comp_hit, cpu_ns, dummy;
+    long raw_total = 0, stored_total = 0;
+    double comp_total = 0, decomp_total = 0;
+    Obj *objs;
+    int *reqs;
+
+    while ((opt = getopt(argc, argv, "n:r:s:p:")) != -1) {
+        switch (opt) {
+        case 'n': nobj = atoi(optarg); break;
+        case 'r': nreq = atoi(optarg); break;
+        case 's': s = atof(optarg); break;
+        case 'p': min_pct = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n objects] [-r requests] "
+                    "[-s zipf_s] [-p min_pct] [file ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    srand(15213);
+    if (optind < argc) {
+        nobj = argc - optind;
+    }
+    objs = calloc(nobj, sizeof(Obj));
+    for (i = 0; i < nobj; i++) {
+        if (optind < argc) {
+            FILE *fp = fopen(argv[optind + i], "rb");
+            if (fp == NULL) {
+                perror(argv[optind + i]);
+                return 1;
+            }
+            fseek(fp, 0, SEEK_END);
+            objs[i].size = ftell(fp);
+            rewind(fp);
+            objs[i].data = malloc(objs[i].size + 1);
+            if (fread(objs[i].data, 1, objs[i].size, fp) !=
+                (size_t)objs[i].size) {
+                perror(argv[optind + i]);
+                return 1;
+            }
+            fclose(fp);
+        }
+        else {
+            /* log-uniform sizes from 1KB to 256KB, 30% binary */
+            objs[i].size = (long)(1024 * pow(256, (double)rand() / RAND_MAX));
+            objs[i].data = malloc(objs[i].size);
+            synth(objs[i].data, objs[i].size,
+                  rand() % 10 < 3 ? 2 : rand() % 2);
+        }
+        measure(&objs[i], min_pct);
+        raw_total += objs[i].size;
+        stored_total += objs[i].stored;
+        comp_total += objs[i].comp_ns;
+        decomp_total += objs[i].decomp_ns;
+    }
+
+    printf("corpus: %d objects, %ld bytes raw, %ld stored (%.1f%%)\n",
+           nobj, raw_total, stored_total, 100.0 * stored_total / raw_total);
+    printf("codec: compress %.0f MB/s, decompress %.0f MB/s "
+           "(of raw bytes)\n", raw_total / (comp_total / 1e3),
+           raw_total / (decomp_total / 1e3));
+    reqs = zipf_stream(nobj, nreq, s);
+    printf("\n%d requests, zipf s=%.2f\n", nreq, s);
+    printf("%10s %10s %10s %8s %14s\n", "budget", "hit raw", "hit lz",
+           "gain", "cpu us/req");
+    for (i = 0; i < (int)(sizeof(budgets) / sizeof(budgets[0])); i++) {
+        raw_hit = simulate(objs, nobj, reqs, nreq, budgets[i], 0, &dummy);
+        comp_hit = simulate(objs, nobj, reqs, nreq, budgets[i], 1, &cpu_ns);
+        printf("%9ldK %9.2f%% %9.2f%% %+7.2f%% %14.2f\n", budgets[i] >> 10,
+               100 * raw_hit, 100 * comp_hit, 100 * (comp_hit - raw_hit),
+               cpu_ns / nreq / 1e3);
+    }
+    return 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * origin - multi-threaded origin stub for benchmarking the proxy
+ *
+ * Serves GET /obj/<id> with a body whose size is drawn from a
+ * distribution seeded by <id>, so the same uri always gets the same
+ * bytes and can be cached. Every response may be delayed to stand
+ * in for a slow backend. A query string overrides both for one uri:
+ * /obj/7?size=100000&delay=50. GET /stats returns how many object
+ * requests were served, which is what reaches the origin through
+ * the proxy.
+ *
+ * usage: origin [-p port] [-t threads] [-z sizes] [-d delay_ms]
+ *               [-j jitter_ms] [-m max_age]
+ * sizes is fixed:N, uniform:MIN:MAX or pareto:MIN:ALPHA (bytes,
+ * capped at 8MB); the default is pareto:1024:1.2, a heavy tail of
+ * mostly small objects.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_SIZE (8L << 20)
+#define REQ_MAX 8192
+
+static enum { FIXED, UNIFORM, PARETO } dist = PARETO;
+static double dist_a = 1024, dist_b = 1.2;
+static int delay_ms, jitter_ms, max_age = 60;
+static unsigned long served;
+static char *payload;
+
+/* a uniform number in [0,1) from a 64-bit seed */
+static double unit(unsigned long long *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return (*x >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* the body size of object id */
+static long object_size(long id) {
+    unsigned long long seed = id * 0x9E3779B97F4A7C15ULL + 1;
+    double u = unit(&seed), size;
+
+    if (dist == FIXED) {
+        size = dist_a;
+    }
+    else if (dist == UNIFORM) {
+        size = dist_a + u * (dist_b - dist_a);
+    }
+    else {
+        size = dist_a / pow(1 - u, 1 / dist_b);
+    }
+    return size > MAX_SIZE ? MAX_SIZE : (long)size;
+}
+
+static int write_all(int fd, char *buf, long n) {
+    long w;
+
+    while (n > 0) {
+        if ((w = write(fd, buf, n)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/* read up to the end of the request head */
+static int read_head(int fd, char *buf) {
+    int n = 0, r;
+
+    while (n < REQ_MAX - 1) {
+        if ((r = read(fd, buf + n, REQ_MAX - 1 - n)) <= 0) {
+            return -1;
+        }
+        n += r;
+        buf[n] = '\0';
+        if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) {
+            return n;
+        }
+    }
+    return -1;
+}
+
+static void serve(int fd) {
+    char req[REQ_MAX], head[512], *q;
+    long id, size;
+    int delay = delay_ms, len;
+    unsigned long long seed;
+
+    if (read_head(fd, req) < 0) {
+        return;
+    }
+    if (!strncmp(req, "GET /stats ", 11)) {
+        len = snprintf(head, sizeof(head), "requests %lu\n",
+                       __atomic_load_n(&served, __ATOMIC_RELAXED));
+        snprintf(req, REQ_MAX, "HTTP/1.0 200 OK\r\nContent-Type: text/plain"
+                 "\r\nContent-Length: %d\r\nCache-Control: no-store\r\n\r\n"
+                 "%s", len, head);
+        write_all(fd, req, strlen(req));
+        return;
+    }
+    if (sscanf(req, "GET /obj/%ld", &id) != 1) {
+        q = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        write_all(fd, q, strlen(q));
+        return;
+    }
+    __atomic_fetch_add(&served, 1, __ATOMIC_RELAXED);
+    size = object_size(id);
+    if ((q = strchr(req, '?')) != NULL && q < strchr(req, '\n')) {
+        char *p;
+        if ((p = strstr(q, "size=")) != NULL) {
+            size = atol(p + 5);
+        }
+        if ((p = strstr(q, "delay=")) != NULL) {
+            delay = atoi(p + 6);
+        }
+    }
+    if (size < 0 || size > MAX_SIZE) {
+        size = MAX_SIZE;
+    }
+    if (jitter_ms > 0) {
+        seed = (unsigned long long)time(NULL) ^ (unsigned long)&seed ^ id;
+        delay += (int)(unit(&seed) * jitter_ms);
+    }
+    if (delay > 0) {
+        usleep(delay * 1000);
+    }
+    len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+                   "Content-Type: text/plain\r\nContent-Length: %ld\r\n"
+                   "Cache-Control: max-age=%d\r\n\r\n", size, max_age);
+    /* the payload is the same for every object, offset by its id */
+    if (write_all(fd, head, len) == 0) {
+        write_all(fd, payload + id % 251, size);
+    }
+}
+
+static void *worker(void *arg) {
+    int listenfd = *(int *)arg, fd, one = 1;
+
+    while (1) {
+        if ((fd = accept(listenfd, NULL, NULL)) < 0) {
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int parse_dist(char *spec) {
+    if (sscanf(spec, "fixed:%lf", &dist_a) == 1) {
+        dist = FIXED;
+    }
+    else if (sscanf(spec, "uniform:%lf:%lf", &dist_a, &dist_b) == 2 &&
+             dist_b >= dist_a) {
+        dist = UNIFORM;
+    }
+    else if (sscanf(spec, "pareto:%lf:%lf", &dist_a, &dist_b) == 2 &&
+             dist_b > 0) {
+        dist = PARETO;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int port = 18080, nthreads = 32, opt, listenfd, one = 1, i;
+    struct sockaddr_in addr;
+    pthread_t tid;
+    long k;
+
+    while ((opt = getopt(argc, argv, "p:t:z:d:j:m:")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'z':
+            if (parse_dist(optarg) < 0) {
+                fprintf(stderr, "bad size distribution: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'd': delay_ms = atoi(optarg); break;
+        case 'j': jitter_ms = atoi(optarg); break;
+        case 'm': max_age = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-t threads] [-z sizes] "
+                    "[-d delay_ms] [-j jitter_ms] [-m max_age]\n", argv[0]);
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    payload = malloc(MAX_SIZE + 256);
+    for (k = 0; k < MAX_SIZE + 256; k++) {
+        payload[k] = "abcdefghijklmnopqrstuvwxyz0123456789\n"[k % 37];
+    }
+
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return 1;
+    }
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenfd, 1024) < 0) {
+        perror("bind");
+        return 1;
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_create(&tid, NULL, worker, &listenfd);
+    }
+    pause();
+    return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# run.sh - benchmark the proxy built by the Makefile
+#
+# Starts bench/origin and ./proxy on local ports, runs
+# bench/loadgen closed loop and then open loop against them, and
+# stops both. Extra arguments go to the proxy as key=value options.
+#
+# usage: bench/run.sh [key=value ...]
+# environment: OBJECTS, ZIPF, CONNS, SECONDS, RATE, SIZES, DELAY,
+#              ORIGIN_PORT, PROXY_PORT
+#
+
+cd "$(dirname "$0")/.." || exit 1
+make -s proxy bench || exit 1
+
+OBJECTS=${OBJECTS:-10000}
+ZIPF=${ZIPF:-0.9}
+CONNS=${CONNS:-16}
+SECONDS_=${SECONDS:-10}
+RATE=${RATE:-2000}
+SIZES=${SIZES:-pareto:1024:1.2}
+DELAY=${DELAY:-0}
+
+ORIGIN_PORT=${ORIGIN_PORT:-18090}
+PROXY_PORT=${PROXY_PORT:-18091}
+
+bench/origin -p "$ORIGIN_PORT" -z "$SIZES" -d "$DELAY" &
+ORIGIN_PID=$!
+sleep 0.5
+./proxy "$PROXY_PORT" "$@" > /dev/null &
+PROXY_PID=$!
+trap 'kill $ORIGIN_PID $PROXY_PID 2>/dev/null' EXIT INT TERM
+sleep 0.5
+
+echo "origin: $SIZES, delay ${DELAY}ms; proxy: $*"
+bench/loadgen -x "$PROXY_PORT" -o "$ORIGIN_PORT" -n "$OBJECTS" \
+    -s "$ZIPF" -c "$CONNS" -t "$SECONDS_"
+echo
+bench/loadgen -x "$PROXY_PORT" -o "$ORIGIN_PORT" -n "$OBJECTS" \
+    -s "$ZIPF" -c "$CONNS" -t "$SECONDS_" -r "$RATE"
@@ -0,0 +1,121 @@
+/*
+ * pool of request buffers for proxy.c
+ *
+ * The line buffers, rio_t and header buffers a request needs used
+ * to be locals of thread_pro() and fetch_origin(), so every thread
+ * needed a stack deep enough for the largest miss. They are now taken
+ * from here when a request gets to the step that needs them, and given
+ * back when it is done, so a hit never touches the buffers of a miss
+ * and connection threads can run on small stacks (conf.thread_stack_kb).
+ *
+ * A request is rounded up to a power of 2 between 1KB and 64KB and
+ * served from the free list of that class; larger ones go straight
+ * to malloc. Given back blocks stay on their list for reuse while the
+ * free ones add up to at most conf.buf_pool_max_bytes. The report
+ * shows the bytes in use and their high-water mark.
+ */
+
+#include "csapp.h"
+#include "config.h"
+#include "bufpool.h"
+
+/* put in front of every block, keeps the data 16-byte aligned */
+typedef union BUF_HDR {
+    struct {
+        int cls;              /* size class, -1 if from malloc */
+        size_t size;          /* bytes of the block after the header */
+    } h;
+    union BUF_HDR *next;      /* free list link while it is pooled */
+    char align[16];
+} BUF_HDR;
+
+static struct {
+    BUF_HDR *free[BUF_NCLASSES];
+    unsigned long nfree[BUF_NCLASSES];
+    unsigned long free_bytes;
+    unsigned long in_use;     /* bytes handed out */
+    unsigned long high_water; /* most bytes ever handed out at once */
+    unsigned long gets, misses;   /* misses had to malloc */
+    sem_t mutex;
+} bp;
+
+void buf_init(void) {
+    memset(&bp, 0, sizeof(bp));
+    Sem_init(&bp.mutex, 0, 1);
+}
+
+/* the size class for size bytes, -1 if it is too big for one */
+static int buf_class(size_t size) {
+    int cls = 0;
+
+    while (cls < BUF_NCLASSES && (1UL << (cls + BUF_MIN_SHIFT)) < size) {
+        cls++;
+    }
+    return cls < BUF_NCLASSES ? cls : -1;
+}
+
+/* a buffer of at least size bytes, given back with buf_put() */
+void *buf_get(size_t size) {
+    int cls = buf_class(size);
+    BUF_HDR *b = NULL;
+
+    if (cls >= 0) {
+        size = 1UL << (cls + BUF_MIN_SHIFT);
+    }
+    P(&bp.mutex);
+    bp.gets++;
+    if (cls >= 0 && (b = bp.free[cls]) != NULL) {
+        bp.free[cls] = b->next;
+        bp.nfree[cls]--;
+        bp.free_bytes -= size;
+    }
+    else {
+        bp.misses++;
+    }
+    bp.in_use += size;
+    if (bp.in_use > bp.high_water) {
+        bp.high_water = bp.in_use;
+    }
+    V(&bp.mutex);
+    if (b == NULL) {
+        b = Malloc(sizeof(BUF_HDR) + size);
+    }
+    b->h.cls = cls;
+    b->h.size = size;
+    return b + 1;
+}
+
+void buf_put(void *buf) {
+    BUF_HDR *b = (BUF_HDR *)buf - 1;
+    int cls = b->h.cls;
+    size_t size = b->h.size;
+
+    P(&bp.mutex);
+    bp.in_use -= size;
+    if (cls >= 0 && bp.free_bytes + size <= conf.buf_pool_max_bytes) {
+        b->next = bp.free[cls];
+        bp.free[cls] = b;
+        bp.nfree[cls]++;
+        bp.free_bytes += size;
+        b = NULL;
+    }
+    V(&bp.mutex);
+    if (b != NULL) {
+        Free(b);
+    }
+}
+
+/* print the bytes in use and pooled */
+void buf_report(FILE *fp) {
+    int cls;
+
+    P(&bp.mutex);
+    fprintf(fp, "bufpool: %lu bytes in use, high water %lu, %lu bytes "
+            "pooled (", bp.in_use, bp.high_water, bp.free_bytes);
+    for (cls = 0; cls < BUF_NCLASSES; cls++) {
+        fprintf(fp, "%s%luK:%lu", cls ? " " : "",
+                (1UL << (cls + BUF_MIN_SHIFT)) >> 10, bp.nfree[cls]);
+    }
+    fprintf(fp, "), %lu gets, %lu from malloc\n", bp.gets, bp.misses);
+    V(&bp.mutex);
+}
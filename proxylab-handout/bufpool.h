@@ -0,0 +1,18 @@
+/*
+ * pool of request buffers for proxy.c
+ */
+
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+/* size classes are powers of 2 from BUF_MIN_SHIFT to BUF_MAX_SHIFT */
+#define BUF_MIN_SHIFT 10
+#define BUF_MAX_SHIFT 16
+#define BUF_NCLASSES (BUF_MAX_SHIFT - BUF_MIN_SHIFT + 1)
+
+void  buf_init(void);
+void *buf_get(size_t size);
+void  buf_put(void *buf);
+void  buf_report(FILE *fp);
+
+#endif /* __BUFPOOL_H__ */
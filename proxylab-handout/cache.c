@@ -1,52 +1,386 @@
 /*
  * cache for proxy.c
  *
- * In this cache I implement a linked list based cache to cache 
- * web content using LRU policy. In each cache block there is a 
- * request header, block size, data and pointer to the previous 
+ * In this cache I implement a linked list based cache to cache
+ * web content using LRU policy. In each cache block there is a
+ * request header, block size, data and pointer to the previous
  * and next block. The hit cache would be moved to head whenever
- * cache hit happens. P-V commends are implemented to make it 
+ * cache hit happens. P-V commends are implemented to make it
  * thread-safe.
  *
+ * Every block carries the time it was fetched and a ttl. A block
+ * past its ttl is still served for conf.stale_ttl seconds while it
+ * is revalidated in the background, and a block that keeps getting
+ * hits close to the end of its ttl is refreshed before it expires.
+ * Blocks are reference counted so that a refresh or an eviction
+ * never frees data another thread is still sending.
+ *
+ * The data of a block is a chain of CACHE_CHUNK_SIZE chunks that
+ * is filled while the response streams through the proxy, so large
+ * objects need neither a big contiguous buffer nor a stack array.
+ * The object and total byte budgets come from conf.
+ *
+ * Bodies are content addressed: each one is hashed and kept once
+ * in a table of CACHE_OBJ, so uris that return the same bytes
+ * share one reference counted body and only pay for their own
+ * headers. cache_size counts the bytes actually stored.
+ *
+ * When the caller marks a fill as compressible, each chunk that
+ * shrinks by at least conf.compress_min_pct is stored LZ4-style
+ * compressed (lz.c) and is decompressed on its own when it is sent,
+ * so a range only pays for the chunks it touches. Compression is
+ * deterministic, so dedup still works on the stored chunks.
+ *
+ * Next to the LRU list, every block is indexed by uri in a radix
+ * tree (trie.c). It makes a lookup cost the length of the uri, and
+ * lets a prefix purge visit only the blocks under that prefix.
+ *
+ * Keys are canonical uris (http_canonical_uri()). A response with
+ * a Vary header is stored under a variant key, the uri key followed
+ * by the values the request had for the varied headers, and a body
+ * less marker block under the uri key holds the Vary list. A lookup
+ * that finds a marker builds the variant key from the request
+ * headers and looks again, so each client gets its own variant.
+ *
+ * Hits, misses, inserts, evictions and the time spent waiting for
+ * the mutex are counted per thread in stats.c, off the lock.
+ *
  * Name: Xuan Li
  * ID: xuanli1
  * Date: 04/25/2015
  */
 
+#include <limits.h>
 #include "csapp.h"
 #include "cache.h"
+#include "config.h"
+#include "lz.h"
+#include "http.h"
+#include "stats.h"
+
+/* time spent decompressing on the hit path, updated atomically */
+static unsigned long decomp_ns;
+
+/* monotonic clock in milliseconds */
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* monotonic clock in nanoseconds */
+static unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* take the mutex, counting how long we had to wait for it */
+static void cache_lock(CACHE *cache) {
+    unsigned long start;
+
+    if (sem_trywait(&cache->mutex) == 0) {
+        return;
+    }
+    start = now_ns();
+    P(&cache->mutex);
+    stats_add(STAT_LOCK_WAITS, 1);
+    stats_add(STAT_LOCK_WAIT_NS, now_ns() - start);
+}
 
 /* create and initial a new cache */
 CACHE *cache_init() {
     CACHE *cache = Malloc (sizeof(CACHE));
-    CACHE_B *extra_header = (CACHE_B *)malloc(sizeof(CACHE_B));
+    CACHE_B *extra_header = (CACHE_B *)Calloc(1, sizeof(CACHE_B));
     cache->head = extra_header;
     cache->head->next = NULL;
+    cache->tail = cache->head;
+    cache->objs = Calloc(CACHE_OBJ_BUCKETS, sizeof(CACHE_OBJ *));
+    trie_init(&cache->index);
     cache->cache_size = 0;
+    cache->logical_size = 0;
     cache->block_cnt = 0;
+    cache->obj_cnt = 0;
+    cache->dedup_cnt = 0;
+    cache->ahead_cnt = 0;
+    cache->purge_cnt = 0;
+    cache->comp_saved = 0;
+    cache->comp_ns = 0;
     sem_init(&cache->mutex, 0, 1);
     return cache;
 }
 
-/* create a new block given required id, data and size */
-CACHE_B *create_block(char *id, char *data, unsigned int size) {
-    CACHE_B *temp = (CACHE_B *)malloc(sizeof(CACHE_B));
-    temp->id = (char *)malloc(strlen(id) + 1);
+/* free a chain of chunks */
+static void free_chunks(CACHE_C *chunk) {
+    CACHE_C *next;
+    while (chunk) {
+        next = chunk->next;
+        Free(chunk);
+        chunk = next;
+    }
+}
+
+/* start an empty object */
+void cache_fill_init(CACHE_FILL *fill) {
+    fill->first = NULL;
+    fill->last = NULL;
+    fill->size = 0;
+    fill->stored = 0;
+    fill->too_big = 0;
+    fill->compress = 0;
+}
+
+/*
+ * append len bytes to an object being filled. once it grows past
+ * conf.object_max_bytes its chunks are freed and -1 is returned
+ */
+int cache_fill_append(CACHE_FILL *fill, char *buf, unsigned len) {
+    CACHE_C *chunk;
+    unsigned n;
+
+    if (fill->too_big) {
+        return -1;
+    }
+    if (fill->size + len > conf.object_max_bytes) {
+        cache_fill_free(fill);
+        fill->too_big = 1;
+        return -1;
+    }
+    while (len > 0) {
+        chunk = fill->last;
+        if (chunk == NULL || chunk->len == CACHE_CHUNK_SIZE) {
+            chunk = Malloc(sizeof(CACHE_C) + CACHE_CHUNK_SIZE);
+            chunk->next = NULL;
+            chunk->len = 0;
+            chunk->raw_len = 0;
+            if (fill->last) {
+                fill->last->next = chunk;
+            }
+            else {
+                fill->first = chunk;
+            }
+            fill->last = chunk;
+        }
+        n = CACHE_CHUNK_SIZE - chunk->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(chunk->data + chunk->len, buf, n);
+        chunk->len += n;
+        chunk->raw_len += n;
+        fill->size += n;
+        fill->stored += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* drop an object that will not be cached */
+void cache_fill_free(CACHE_FILL *fill) {
+    free_chunks(fill->first);
+    fill->first = NULL;
+    fill->last = NULL;
+    fill->size = 0;
+    fill->stored = 0;
+}
+
+/* trim the last chunk of a filled object so small objects stay small */
+static void fill_trim(CACHE_FILL *fill) {
+    CACHE_C *last = fill->last, *prev;
+
+    if (last == NULL || last->len == CACHE_CHUNK_SIZE) {
+        return;
+    }
+    last = Realloc(last, sizeof(CACHE_C) + last->len);
+    if (fill->first == fill->last) {
+        fill->first = last;
+    }
+    else {
+        for (prev = fill->first; prev->next != fill->last; prev = prev->next)
+            ;
+        prev->next = last;
+    }
+    fill->last = last;
+}
+
+/*
+ * replace every chunk of fill that compresses well enough by its
+ * compressed form. returns the time it took in ns.
+ */
+static unsigned long fill_compress(CACHE_FILL *fill) {
+    unsigned long start = now_ns();
+    char *buf = Malloc(CACHE_CHUNK_SIZE);
+    CACHE_C *chunk, *comp, **pp = &fill->first;
+    int cap, n;
+
+    for (chunk = fill->first; chunk; chunk = comp->next) {
+        comp = chunk;
+        cap = chunk->len - chunk->len * conf.compress_min_pct / 100;
+        n = lz_compress(chunk->data, chunk->len, buf, cap);
+        if (n > 0 && n < chunk->len) {
+            comp = Malloc(sizeof(CACHE_C) + n);
+            comp->next = chunk->next;
+            comp->len = n;
+            comp->raw_len = chunk->raw_len;
+            memcpy(comp->data, buf, n);
+            fill->stored -= chunk->len - n;
+            if (fill->last == chunk) {
+                fill->last = comp;
+            }
+            Free(chunk);
+        }
+        *pp = comp;
+        pp = &comp->next;
+    }
+    Free(buf);
+    return now_ns() - start;
+}
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/*
+ * fast non-cryptographic 64 bit hash of a body as it is stored,
+ * eight bytes per step. chunks are hashed one after the other, so
+ * equal chains of chunks always hash equal.
+ */
+static unsigned long long body_hash(CACHE_FILL *fill) {
+    unsigned long long h = HASH_PRIME1 ^ fill->size, w;
+    CACHE_C *chunk;
+    char *ptr;
+    unsigned len;
+
+    for (chunk = fill->first; chunk; chunk = chunk->next) {
+        ptr = chunk->data;
+        for (len = chunk->len; len >= 8; len -= 8, ptr += 8) {
+            memcpy(&w, ptr, 8);
+            h ^= ROTL64(w * HASH_PRIME2, 31) * HASH_PRIME1;
+            h = ROTL64(h, 27) * HASH_PRIME1 + HASH_PRIME2;
+        }
+        for (; len > 0; len--, ptr++) {
+            h ^= (unsigned char)*ptr * HASH_PRIME1;
+            h = ROTL64(h, 11) * HASH_PRIME2;
+        }
+    }
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    return h;
+}
+
+/* compare the chunks of two bodies of the same size */
+static int body_equal(CACHE_C *a, CACHE_C *b) {
+    for (; a && b; a = a->next, b = b->next) {
+        if (a->len != b->len || a->raw_len != b->raw_len ||
+            memcmp(a->data, b->data, a->len)) {
+            return 0;
+        }
+    }
+    return a == b;
+}
+
+/* find a stored body equal to fill. mutex must be held. */
+static CACHE_OBJ *obj_find(CACHE *cache, unsigned long long hash,
+                           CACHE_FILL *fill) {
+    CACHE_OBJ *obj = cache->objs[hash & (CACHE_OBJ_BUCKETS - 1)];
+    for (; obj; obj = obj->hnext) {
+        if (obj->hash == hash && obj->size == fill->size &&
+            body_equal(obj->data, fill->first)) {
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+/* store the chunks of fill as a new body. mutex must be held. */
+static CACHE_OBJ *obj_create(CACHE *cache, unsigned long long hash,
+                             CACHE_FILL *fill) {
+    CACHE_OBJ *obj = Malloc(sizeof(CACHE_OBJ));
+    CACHE_OBJ **bucket = &cache->objs[hash & (CACHE_OBJ_BUCKETS - 1)];
+
+    obj->hash = hash;
+    obj->size = fill->size;
+    obj->stored = fill->stored;
+    obj->data = fill->first;
+    obj->live = 0;
+    obj->refcnt = 0;
+    obj->hnext = *bucket;
+    *bucket = obj;
+    cache->cache_size += obj->stored;
+    cache->comp_saved += obj->size - obj->stored;
+    cache->obj_cnt++;
+    cache_fill_init(fill);
+    return obj;
+}
+
+/*
+ * a block holding obj left the list: once no block in the list
+ * uses it, the body stops counting and cannot be shared any more.
+ * mutex must be held.
+ */
+static void obj_unlive(CACHE *cache, CACHE_OBJ *obj) {
+    CACHE_OBJ **pp;
+
+    if (--obj->live > 0) {
+        return;
+    }
+    pp = &cache->objs[obj->hash & (CACHE_OBJ_BUCKETS - 1)];
+    while (*pp != obj) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = obj->hnext;
+    cache->cache_size -= obj->stored;
+    cache->comp_saved -= obj->size - obj->stored;
+    cache->obj_cnt--;
+}
+
+/* create a new block given required id, response head and ttl */
+CACHE_B *create_block(char *id, char *head, unsigned head_len, long ttl_ms) {
+    CACHE_B *temp = (CACHE_B *)Malloc(sizeof(CACHE_B));
+
+    temp->id = (char *)Malloc(strlen(id) + 1);
     strcpy(temp->id, id);
-    temp->data = (char *)malloc(size);
-    memcpy(temp->data, data, size);
-    temp->size = size;
+    temp->head = (char *)Malloc(head_len);
+    memcpy(temp->head, head, head_len);
+    temp->head_len = head_len;
+    temp->body = NULL;
+    temp->size = head_len;
+    temp->fetch_ms = now_ms();
+    temp->ttl_ms = ttl_ms;
+    temp->late_hits = 0;
+    temp->refreshing = 0;
+    temp->refcnt = 0;
+    temp->dead = 0;
+    temp->marker = 0;
     temp->prev = NULL;
     temp->next = NULL;
     return temp;
 }
 
+/*
+ * give back the memory of a block nobody references any more,
+ * and its body if no other block points to it. mutex must be held.
+ */
+static void free_block(CACHE_B *block) {
+    CACHE_OBJ *obj = block->body;
+    if (obj != NULL && --obj->refcnt == 0) {
+        free_chunks(obj->data);
+        Free(obj);
+    }
+    Free(block->id);
+    Free(block->head);
+    Free(block);
+}
+
 /* help function for updating the hit block to the head of the list */
 void insert_cache_after_head(CACHE *cache, CACHE_B *block) {
     if (cache->head->next == NULL) {
         cache->head->next = block;
         block->prev = cache->head;
         block->next = NULL;
+        cache->tail = block;
     }
     else {
         block->next = cache->head->next;
@@ -54,8 +388,6 @@ void insert_cache_after_head(CACHE *cache, CACHE_B *block) {
         cache->head->next = block;
         block->prev = cache->head;
     }
-    cache->cache_size += block->size;
-    cache->block_cnt++;
 }
 
 /* used to leave the hit cache empty */
@@ -63,79 +395,389 @@ void clear_cache(CACHE *cache, CACHE_B *block) {
     if (block->next == NULL) {
         CACHE_B *temp = block->prev;
         temp->next = NULL;
+        cache->tail = temp;
     }
     else {
         CACHE_B *temp = block->prev;
         temp->next = block->next;
         block->next->prev = temp;
     }
-    cache->cache_size -= block->size;
+}
+
+/*
+ * take a block out of the cache, it is freed right away unless a
+ * thread is still sending it. mutex must be held.
+ */
+static void cache_remove(CACHE *cache, CACHE_B *block) {
+    clear_cache(cache, block);
+    trie_del(&cache->index, block->id);
+    cache->cache_size -= block->head_len;
+    cache->logical_size -= block->size;
     cache->block_cnt--;
+    if (block->body != NULL) {
+        obj_unlive(cache, block->body);
+    }
+    block->dead = 1;
+    if (block->refcnt == 0) {
+        free_block(block);
+    }
 }
 
-/* maintain the size of cache within the required MAX_CACHE_SIZE */
-void cache_control(CACHE *cache, int exp_size) {
-    P(&cache->mutex);
-    while (cache->cache_size > exp_size) {
-        CACHE_B *end = cache->head;
-        while (end->next != NULL) {
-            end = end->next;
-        }
-        CACHE_B *end_prev = end->prev;
-        end_prev->next = NULL;
-        cache->cache_size -= end->size;
-        cache->block_cnt --;
-        Free(end);
+/*
+ * maintain the size of cache within exp_size bytes,
+ * dropping blocks from the tail. mutex must be held.
+ */
+void cache_control(CACHE *cache, unsigned long exp_size) {
+    while (cache->cache_size > exp_size && cache->tail != cache->head) {
+        cache_remove(cache, cache->tail);
+        stats_add(STAT_EVICTIONS, 1);
     }
-    V(&cache->mutex);
     return;
 }
 
-/* help function to update the cache */
+/*
+ * evict from the tail until the cache is within max_bytes, taking
+ * the mutex for at most batch bytes at a time so that lookups get
+ * in between. returns the bytes evicted.
+ */
+unsigned long cache_shrink(CACHE *cache, unsigned long max_bytes,
+                           unsigned long batch) {
+    unsigned long before, total = 0;
+    int more = 1;
+
+    while (more) {
+        cache_lock(cache);
+        before = cache->cache_size;
+        if (before > max_bytes) {
+            cache_control(cache, before - max_bytes > batch ?
+                          before - batch : max_bytes);
+        }
+        total += before - cache->cache_size;
+        more = cache->cache_size > max_bytes && before > cache->cache_size;
+        V(&cache->mutex);
+    }
+    return total;
+}
+
+/* help function to update the cache. mutex must be held. */
 void cache_move_to_head(CACHE *cache, CACHE_B *block) {
-    P(&cache->mutex);
     clear_cache(cache, block);
     insert_cache_after_head(cache, block);
-    V(&cache->mutex);
 }
 
-/* update the linked list when given a new uri */
-void cache_update(CACHE *cache, char *uri, char *data, unsigned size) {
-    P(&cache->mutex);
-    if (size > MAX_OBJECT_SIZE) {
-	 return;
+/* find the block of a given uri. mutex must be held. */
+static CACHE_B *cache_find(CACHE *cache, char *uri) {
+    return trie_get(&cache->index, uri);
+}
+
+/*
+ * update the linked list when given a new uri, a block already
+ * cached under the same key is replaced. head is copied, the body
+ * is shared with an equal stored body or else the cache takes over
+ * the chunks of fill. fill is left empty either way. hdrs are the
+ * request headers, they pick the variant of a response with Vary.
+ */
+void cache_update(CACHE *cache, char *key, char *hdrs, char *head,
+                  unsigned head_len, CACHE_FILL *fill, long ttl_ms) {
+    CACHE_B *old_block, *new_block, *marker = NULL;
+    CACHE_OBJ *obj;
+    char vary[MAXLINE], *id = key, *vkey = NULL;
+    unsigned long long hash;
+    unsigned long need, comp_ns = 0;
+    /* memctl.c may move the budget, use one value throughout */
+    unsigned long budget = __atomic_load_n(&conf.cache_max_bytes,
+                                           __ATOMIC_RELAXED);
+
+    if (fill->too_big || fill->size > conf.object_max_bytes ||
+        head_len + fill->size > budget) {
+        cache_fill_free(fill);
+        return;
     }
-    if (size + cache->cache_size > MAX_CACHE_SIZE) {
-        cache_control(cache, MAX_CACHE_SIZE - size);
+    if (http_header_value(head, head_len, "Vary", vary, MAXLINE) > 0) {
+        vkey = Malloc(CACHE_KEY_MAX);
+        if (http_variant_key(vkey, CACHE_KEY_MAX, key, vary, hdrs) < 0) {
+            Free(vkey);
+            cache_fill_free(fill);
+            return;
+        }
+        id = vkey;
+        /* markers go when they are evicted or replaced, not with age */
+        marker = create_block(key, vary, strlen(vary) + 1, LONG_MAX / 4);
+        marker->marker = 1;
+    }
+    fill_trim(fill);
+    if (fill->compress && conf.compress &&
+        fill->size >= conf.compress_min_bytes) {
+        comp_ns = fill_compress(fill);
+    }
+    hash = body_hash(fill);
+    new_block = create_block(id, head, head_len, ttl_ms);
+
+    cache_lock(cache);
+    if ((old_block = cache_find(cache, id)) != NULL) {
+        cache_remove(cache, old_block);
+    }
+    cache->comp_ns += comp_ns;
+    need = head_len;
+    if (obj_find(cache, hash, fill) == NULL) {
+        need += fill->stored;
+    }
+    if (need + cache->cache_size > budget) {
+        cache_control(cache, budget - need);
     }
-    CACHE_B *new_block = create_block(uri, data, size);
+    if ((obj = obj_find(cache, hash, fill)) != NULL) {
+        cache->dedup_cnt++;
+    }
+    else {
+        /* the eviction may have dropped the body we meant to share */
+        cache_control(cache, budget - head_len - fill->stored);
+        obj = obj_create(cache, hash, fill);
+    }
+    obj->live++;
+    obj->refcnt++;
+    new_block->body = obj;
+    new_block->size = head_len + obj->size;
     insert_cache_after_head(cache, new_block);
+    trie_put(&cache->index, new_block->id, new_block);
+    cache->cache_size += head_len;
+    cache->logical_size += new_block->size;
+    cache->block_cnt++;
+    if (marker != NULL) {
+        old_block = cache_find(cache, key);
+        if (old_block != NULL && old_block->marker &&
+            !strcmp(old_block->head, vary)) {
+            cache_move_to_head(cache, old_block);
+            free_block(marker);
+        }
+        else {
+            /* variants of another Vary list are left to age out */
+            if (old_block != NULL) {
+                cache_remove(cache, old_block);
+            }
+            insert_cache_after_head(cache, marker);
+            trie_put(&cache->index, marker->id, marker);
+            cache->cache_size += marker->head_len;
+            cache->logical_size += marker->size;
+            cache->block_cnt++;
+        }
+    }
     V(&cache->mutex);
+    stats_add(STAT_INSERTS, 1);
+
+    /* a duplicate body was not taken over */
+    cache_fill_free(fill);
+    if (vkey != NULL) {
+        Free(vkey);
+    }
     return;
 }
- 
+
 /* to check if a given uri has been cached or not */
 int cache_check(CACHE *cache, char *uri) {
-    CACHE_B *ptr = cache->head->next;
-    while (ptr) {
-        if (!strcmp(uri, ptr->id)) {
-            return 1;
+    int found;
+    cache_lock(cache);
+    found = cache_find(cache, uri) != NULL;
+    V(&cache->mutex);
+    return found;
+}
+
+/*
+ * fetch the block of a given key and move it to the head. NULL is
+ * returned on a miss or when the block is past its stale window.
+ * when key has variants, hdrs, the request headers, pick one.
+ * *state tells the caller whether it should start a background
+ * refresh; only one caller is told so per block. The block must be
+ * handed back with cache_release().
+ */
+CACHE_B *cache_lookup(CACHE *cache, char *key, char *hdrs, int *state) {
+    CACHE_B *ptr;
+    char *vkey = NULL;
+    long age;
+
+    *state = CACHE_FRESH;
+    cache_lock(cache);
+    ptr = cache_find(cache, key);
+    if (ptr && ptr->marker) {
+        cache_move_to_head(cache, ptr);
+        vkey = Malloc(CACHE_KEY_MAX);
+        ptr = http_variant_key(vkey, CACHE_KEY_MAX, key, ptr->head,
+                               hdrs) < 0 ? NULL : cache_find(cache, vkey);
+    }
+    if (ptr) {
+        age = now_ms() - ptr->fetch_ms;
+        if (age > ptr->ttl_ms + conf.stale_ttl * 1000) {
+            ptr = NULL;
+        }
+        else if (age > ptr->ttl_ms) {
+            stats_add(STAT_STALE_HITS, 1);
+            if (!ptr->refreshing) {
+                ptr->refreshing = 1;
+                *state = CACHE_REFRESH;
+            }
+        }
+        else if (conf.refresh_ahead_hits > 0 &&
+                 age * 100 >= ptr->ttl_ms * conf.refresh_ahead_pct) {
+            ptr->late_hits++;
+            if (!ptr->refreshing &&
+                ptr->late_hits >= conf.refresh_ahead_hits) {
+                ptr->refreshing = 1;
+                cache->ahead_cnt++;
+                *state = CACHE_REFRESH;
+            }
         }
-        ptr = ptr->next;
     }
-    return 0;
+    if (ptr) {
+        cache_move_to_head(cache, ptr);
+        ptr->refcnt++;
+    }
+    V(&cache->mutex);
+    if (vkey != NULL) {
+        Free(vkey);
+    }
+    stats_add(ptr ? STAT_HITS : STAT_MISSES, 1);
+    return ptr;
+}
+
+/* hand back a block returned by cache_lookup() */
+void cache_release(CACHE *cache, CACHE_B *block) {
+    cache_lock(cache);
+    block->refcnt--;
+    if (block->dead && block->refcnt == 0) {
+        free_block(block);
+    }
+    V(&cache->mutex);
+}
+
+/* allow a new refresh of uri after the last one did not succeed */
+void cache_refresh_failed(CACHE *cache, char *uri) {
+    CACHE_B *ptr;
+    cache_lock(cache);
+    if ((ptr = cache_find(cache, uri)) != NULL) {
+        ptr->refreshing = 0;
+        ptr->late_hits = 0;
+    }
+    V(&cache->mutex);
+}
+
+/* drop the blocks under prefix. mutex must be held. */
+static int remove_prefix(CACHE *cache, char *prefix) {
+    void **blocks;
+    int n, i;
+
+    n = trie_prefix(&cache->index, prefix, &blocks);
+    for (i = 0; i < n; i++) {
+        cache_remove(cache, blocks[i]);
+    }
+    if (blocks) {
+        Free(blocks);
+    }
+    return n;
+}
+
+/*
+ * drop the block of key, and its variants if it has any
+ * returns the number of blocks dropped
+ */
+int cache_purge(CACHE *cache, char *key) {
+    CACHE_B *ptr;
+    char *prefix;
+    int n = 0;
+
+    cache_lock(cache);
+    if ((ptr = cache_find(cache, key)) != NULL) {
+        if (ptr->marker) {
+            prefix = Malloc(strlen(key) + 2);
+            sprintf(prefix, "%s\t", key);
+            n += remove_prefix(cache, prefix);
+            Free(prefix);
+        }
+        cache_remove(cache, ptr);
+        n++;
+    }
+    cache->purge_cnt += n;
+    V(&cache->mutex);
+    return n;
+}
+
+/*
+ * drop every block whose key starts with prefix, in time
+ * proportional to the number of matches
+ * returns the number of blocks dropped
+ */
+int cache_purge_prefix(CACHE *cache, char *prefix) {
+    int n;
+
+    cache_lock(cache);
+    n = remove_prefix(cache, prefix);
+    cache->purge_cnt += n;
+    V(&cache->mutex);
+    return n;
 }
 
-/* fetch the recently used block when given uri */
-CACHE_B *cache_get(CACHE *cache, char *uri) {
-    CACHE_B *ptr = cache->head->next;
-    while (ptr) {
-        if (!strcmp(uri, ptr->id)) {
-            cache_move_to_head(cache, ptr);
-            return ptr;
+/*
+ * write len bytes of the body of a block starting at offset off
+ * to fd, decompressing the chunks that are stored compressed.
+ * returns 0 on success, -1 on a write error
+ */
+int cache_write_range(int fd, CACHE_B *block, unsigned long off,
+                      unsigned long len) {
+    CACHE_C *chunk = block->body->data;
+    char raw[CACHE_CHUNK_SIZE], *ptr;
+    unsigned long n, start, spent = 0;
+    int rc = 0;
+
+    while (chunk && off >= chunk->raw_len) {
+        off -= chunk->raw_len;
+        chunk = chunk->next;
+    }
+    for (; chunk && len > 0; chunk = chunk->next) {
+        ptr = chunk->data;
+        if (chunk->len < chunk->raw_len) {
+            start = now_ns();
+            if (lz_decompress(chunk->data, chunk->len, raw,
+                              CACHE_CHUNK_SIZE) != chunk->raw_len) {
+                rc = -1;
+                break;
+            }
+            spent += now_ns() - start;
+            ptr = raw;
+        }
+        n = chunk->raw_len - off;
+        if (n > len) {
+            n = len;
         }
-        ptr = ptr->next;
+        if (rio_writen(fd, ptr + off, n) < 0) {
+            rc = -1;
+            break;
+        }
+        stats_add(STAT_BYTES_CACHE, n);
+        len -= n;
+        off = 0;
     }
-    return NULL;
+    if (spent) {
+        __sync_fetch_and_add(&decomp_ns, spent);
+    }
+    return rc;
 }
 
+/* print the cache counters */
+void cache_report(CACHE *cache, FILE *fp) {
+    cache_lock(cache);
+    fprintf(fp, "cache: %lu bytes in %u blocks\n",
+            cache->cache_size, cache->block_cnt);
+    fprintf(fp, "cache: %lu bytes of objects in %u bodies, "
+            "dedup ratio %.2f (%lu shared inserts)\n",
+            cache->logical_size, cache->obj_cnt,
+            cache->cache_size ? (double)cache->logical_size /
+            (cache->cache_size + cache->comp_saved) : 1.0,
+            cache->dedup_cnt);
+    fprintf(fp, "cache: compression saved %lu bytes, %.1f ms compressing, "
+            "%.1f ms decompressing\n", cache->comp_saved,
+            cache->comp_ns / 1e6, decomp_ns / 1e6);
+    fprintf(fp, "cache: %lu hits (%lu stale), %lu misses, %lu evictions, "
+            "%lu purged\n", stats_counter(STAT_HITS),
+            stats_counter(STAT_STALE_HITS), stats_counter(STAT_MISSES),
+            stats_counter(STAT_EVICTIONS), cache->purge_cnt);
+    fprintf(fp, "cache: %lu refresh-ahead\n", cache->ahead_cnt);
+    V(&cache->mutex);
+}
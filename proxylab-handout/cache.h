@@ -1,32 +1,119 @@
-/* 
- * this file defines some cache method and variable 
+/*
+ * this file defines some cache method and variable
  */
 
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "csapp.h"
+#include "trie.h"
 
+/* defaults of conf.cache_max_bytes and conf.object_max_bytes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
+/* objects are stored as a chain of chunks of at most this size */
+#define CACHE_CHUNK_SIZE 16384
+
+/* buckets of the table of bodies by content hash, a power of 2 */
+#define CACHE_OBJ_BUCKETS 4096
+
+/* longest key of a variant, the uri key and its varied headers */
+#define CACHE_KEY_MAX 8192
+
+/* what to do with a block returned by cache_lookup() */
+#define CACHE_FRESH   0   /* just serve it */
+#define CACHE_REFRESH 1   /* serve it, then refresh it in the background */
+
 /* cache structure contains cache information */
 typedef struct CACHE {
     struct CACHE_B *head;
-    unsigned cache_size;
+    struct CACHE_B *tail;
+    struct CACHE_OBJ **objs;   /* bodies by content hash */
+    TRIE index;                /* blocks by uri, for lookups and purges */
+    unsigned long cache_size;  /* bytes actually stored */
+    unsigned long logical_size;/* bytes of all blocks, shared or not */
     unsigned block_cnt;
+    unsigned obj_cnt;          /* distinct bodies */
+    unsigned long dedup_cnt;   /* inserts that reused a stored body */
+    unsigned long comp_saved;  /* bytes saved by compressed chunks */
+    unsigned long comp_ns;     /* time spent compressing */
+    unsigned long ahead_cnt;   /* refreshes started before expiry */
+    unsigned long purge_cnt;   /* blocks dropped by PURGE */
     sem_t mutex;
 } CACHE;
 
+/*
+ * one piece of an object, the last chunk is trimmed to its len.
+ * a chunk with len < raw_len is stored compressed (lz.c).
+ */
+typedef struct CACHE_C {
+    struct CACHE_C *next;
+    unsigned len;         /* bytes stored in data */
+    unsigned raw_len;     /* bytes of the object it stands for */
+    char data[];
+} CACHE_C;
+
+/* an object being filled while it streams in from the origin */
+typedef struct CACHE_FILL {
+    CACHE_C *first;
+    CACHE_C *last;
+    unsigned long size;
+    unsigned long stored; /* size after compression */
+    int too_big;          /* went over conf.object_max_bytes */
+    int compress;         /* set by the caller to store it compressed */
+} CACHE_FILL;
+
+/*
+ * a response body, shared by every block whose body has the same
+ * content. live counts the blocks in the list, refcnt every block
+ * that still points here.
+ */
+typedef struct CACHE_OBJ {
+    unsigned long long hash;
+    unsigned long size;
+    unsigned long stored; /* bytes in the chunks, less when compressed */
+    CACHE_C *data;
+    int live;
+    int refcnt;
+    struct CACHE_OBJ *hnext;
+} CACHE_OBJ;
+
 /* Defination of cache block */
 typedef struct CACHE_B {
-    unsigned int size;
+    unsigned long size;  /* head_len plus the body size */
     char *id;
-    char *data;
+    char *head;          /* status line and headers of the response */
+    unsigned head_len;
+    CACHE_OBJ *body;
+    long fetch_ms;       /* when the data came from the origin */
+    long ttl_ms;         /* how long the data stays fresh */
+    unsigned late_hits;  /* hits inside the refresh-ahead window */
+    int refreshing;      /* a background refresh is pending */
+    int refcnt;          /* threads still sending this block */
+    int dead;            /* unlinked, freed by the last cache_release() */
+    int marker;          /* no body, head is the Vary of the variants */
     struct CACHE_B *next;
     struct CACHE_B *prev;
 } CACHE_B;
 
 /* methods related to cache and used in proxy.c */
 CACHE *cache_init();
-CACHE_B *cache_get(CACHE *cache, char *uri);
+CACHE_B *cache_lookup(CACHE *cache, char *key, char *hdrs, int *state);
+void cache_release(CACHE *cache, CACHE_B *block);
 int cache_check(CACHE *cache, char *uri);
-void cache_update(CACHE *cache, char *uri, char *data, unsigned size);
+void cache_update(CACHE *cache, char *key, char *hdrs, char *head,
+                  unsigned head_len, CACHE_FILL *fill, long ttl_ms);
+void cache_fill_init(CACHE_FILL *fill);
+int  cache_fill_append(CACHE_FILL *fill, char *buf, unsigned len);
+void cache_fill_free(CACHE_FILL *fill);
+void cache_refresh_failed(CACHE *cache, char *uri);
+int  cache_purge(CACHE *cache, char *uri);
+int  cache_purge_prefix(CACHE *cache, char *prefix);
+unsigned long cache_shrink(CACHE *cache, unsigned long max_bytes,
+                           unsigned long batch);
+int  cache_write_range(int fd, CACHE_B *block, unsigned long off,
+                       unsigned long len);
+void cache_report(CACHE *cache, FILE *fp);
 
+#endif /* __CACHE_H__ */
@@ -0,0 +1,258 @@
+/*
+ * runtime configuration for proxy.c
+ *
+ * A table maps each option name to its field in the global conf
+ * structure. conf holds the defaults until conf_parse() overrides
+ * them from the command line.
+ */
+
+#include "csapp.h"
+#include "cache.h"
+#include "config.h"
+
+CONF conf = {
+    .cache_max_bytes    = MAX_CACHE_SIZE,
+    .cache_auto         = 0,
+    .cache_min_bytes    = MAX_OBJECT_SIZE * 4,
+    .mem_limit_bytes    = 0,
+    .mem_target_pct     = 75,
+    .mem_psi_pct        = 10,
+    .mem_interval_ms    = 1000,
+    .object_max_bytes   = MAX_OBJECT_SIZE,
+    .cache_ttl          = 60,
+    .stale_ttl          = 30,
+    .refresh_threads    = 2,
+    .refresh_queue      = 64,
+    .refresh_ahead_pct  = 80,
+    .refresh_ahead_hits = 4,
+    .compress           = 0,
+    .compress_min_bytes = 1024,
+    .compress_min_pct   = 10,
+    .purge_any          = 0,
+    .neg_ttl            = 5,
+    .neg_max_bytes      = 65536,
+    .trace_slow_ms      = 1000,
+    .trace_interval_ms  = 1000,
+    .access_log         = NULL,
+    .log_max_bytes      = 64L << 20,
+    .log_keep           = 4,
+    .log_flush_ms       = 100,
+    .acceptors          = 1,
+    .acceptor_pin       = 0,
+    .numa               = 0,
+    .max_conns          = 0,
+    .max_inflight       = 0,
+    .shed_miss_pct      = 80,
+    .client_rate        = 0,
+    .client_burst       = 20,
+    .origin_rate        = 0,
+    .origin_burst       = 20,
+    .rate_queue_ms      = 0,
+    .pools              = NULL,
+    .eject_failures     = 3,
+    .eject_ms           = 10000,
+    .probe_ms           = 0,
+    .idle_timeout_ms    = 30000,
+    .read_timeout_ms    = 30000,
+    .write_timeout_ms   = 30000,
+    .timer_wheel        = 1,
+    .thread_stack_kb    = 256,
+    .buf_pool_max_bytes = 4L << 20,
+    .tunnel_threads     = 1,
+    .tunnel_idle_ms     = 300000,
+    .max_tunnels        = 4096,
+    .connect_any_port   = 0,
+    .workers            = 0,
+    .shm_cache_bytes    = 64L << 20,
+};
+
+/* description of one key=value option, a number or else a string */
+typedef struct CONF_OPT {
+    char *name;
+    long *val;
+    long min;
+    char *help;
+    long max;                /* 0 for no upper bound */
+    char **str;
+} CONF_OPT;
+
+static CONF_OPT conf_opts[] = {
+    {"cache_max_bytes",    &conf.cache_max_bytes,    0,
+     "byte budget of the whole cache (the start with cache_auto=1)"},
+    {"cache_auto",         &conf.cache_auto,         0,
+     "1 grows and shrinks the cache budget with the memory there is"},
+    {"cache_min_bytes",    &conf.cache_min_bytes,    0,
+     "least bytes cache_auto shrinks the cache to"},
+    {"mem_limit_bytes",    &conf.mem_limit_bytes,    0,
+     "memory cache_auto keeps the proxy RSS in, 0 uses the cgroup "
+     "limit or else the host memory"},
+    {"mem_target_pct",     &conf.mem_target_pct,     1,
+     "% of that memory cache_auto aims to use", 100},
+    {"mem_psi_pct",        &conf.mem_psi_pct,        0,
+     "memory pressure (PSI some avg10, %) that shrinks the cache, "
+     "0 ignores it", 100},
+    {"mem_interval_ms",    &conf.mem_interval_ms,    1,
+     "how often cache_auto checks memory use (ms)"},
+    {"object_max_bytes",   &conf.object_max_bytes,   0,
+     "largest object that is cached, in bytes"},
+    {"cache_ttl",          &conf.cache_ttl,          0,
+     "default freshness lifetime of a cached object (s)"},
+    {"stale_ttl",          &conf.stale_ttl,          0,
+     "how long an expired object may be served while revalidating (s)"},
+    {"refresh_threads",    &conf.refresh_threads,    0,
+     "number of background refresh workers"},
+    {"refresh_queue",      &conf.refresh_queue,      1,
+     "refresh jobs that may be pending before new ones are dropped"},
+    {"refresh_ahead_pct",  &conf.refresh_ahead_pct,  1,
+     "start of the refresh-ahead window, in percent of the ttl", 100},
+    {"refresh_ahead_hits", &conf.refresh_ahead_hits, 0,
+     "hits inside that window that trigger a refresh (0 disables)"},
+    {"compress",           &conf.compress,           0,
+     "1 stores text bodies compressed in the cache"},
+    {"compress_min_bytes", &conf.compress_min_bytes, 0,
+     "smallest body that is compressed"},
+    {"compress_min_pct",   &conf.compress_min_pct,   0,
+     "least saving, in percent, for a chunk to be kept compressed", 100},
+    {"purge_any",          &conf.purge_any,          0,
+     "1 accepts PURGE from any client, not just local ones"},
+    {"neg_ttl",            &conf.neg_ttl,            0,
+     "how long an upstream failure is answered from cache (s, 0 disables)"},
+    {"neg_max_bytes",      &conf.neg_max_bytes,      0,
+     "byte budget of the negative cache"},
+    {"trace_slow_ms",      &conf.trace_slow_ms,      0,
+     "print the phases of requests at least this slow (ms, 0 disables)"},
+    {"trace_interval_ms",  &conf.trace_interval_ms,  1,
+     "how often slow request traces are printed (ms)"},
+    {"access_log",         NULL,                     0,
+     "file the access log is written to (none by default)", 0,
+     &conf.access_log},
+    {"log_max_bytes",      &conf.log_max_bytes,      4096,
+     "size at which the access log is rotated"},
+    {"log_keep",           &conf.log_keep,           0,
+     "rotated access logs kept as access_log.1, .2, ..."},
+    {"log_flush_ms",       &conf.log_flush_ms,       1,
+     "how often buffered access log records are written (ms)"},
+    {"acceptors",          &conf.acceptors,          1,
+     "listening sockets on the port (SO_REUSEPORT), one thread each"},
+    {"acceptor_pin",       &conf.acceptor_pin,       0,
+     "1 pins each acceptor, and the connections it takes, to a CPU"},
+    {"numa",               &conf.numa,               0,
+     "1 binds acceptors round robin to NUMA nodes, threads and memory"},
+    {"max_conns",          &conf.max_conns,          0,
+     "connections served at once, more get a 503 (0 is no limit)"},
+    {"max_inflight",       &conf.max_inflight,       0,
+     "requests served at once, more get a 503 (0 is no limit)"},
+    {"shed_miss_pct",      &conf.shed_miss_pct,      1,
+     "percent of max_inflight that cache misses may take", 100},
+    {"client_rate",        &conf.client_rate,        0,
+     "requests a second from one client IP (0 is no limit)"},
+    {"client_burst",       &conf.client_burst,       1,
+     "requests a client may send at once before client_rate applies"},
+    {"origin_rate",        &conf.origin_rate,        0,
+     "origin fetches a second to one host:port (0 is no limit)"},
+    {"origin_burst",       &conf.origin_burst,       1,
+     "fetches an origin may get at once before origin_rate applies"},
+    {"rate_queue_ms",      &conf.rate_queue_ms,      0,
+     "how long a request over a rate may be delayed (0 rejects it)"},
+    {"pools",              NULL,                     0,
+     "vhost=[rr|least|hash@]host:port,...;... backend pools by vhost", 0,
+     &conf.pools},
+    {"eject_failures",     &conf.eject_failures,     1,
+     "connect or read failures in a row that eject a pool backend"},
+    {"eject_ms",           &conf.eject_ms,           0,
+     "how long an ejected backend is skipped (ms)"},
+    {"probe_ms",           &conf.probe_ms,           0,
+     "probe ejected backends this often, keeping them out until one "
+     "succeeds (ms, 0 is off)"},
+    {"idle_timeout_ms",    &conf.idle_timeout_ms,    0,
+     "how long a new connection may take to send its request line "
+     "(ms, 0 is forever)"},
+    {"read_timeout_ms",    &conf.read_timeout_ms,    0,
+     "how long a read from a client or origin may block (ms)"},
+    {"write_timeout_ms",   &conf.write_timeout_ms,   0,
+     "how long a write to a client or origin may block (ms)"},
+    {"timer_wheel",        &conf.timer_wheel,        0,
+     "1 enforces timeouts with a timer thread, 0 with socket options"},
+    {"thread_stack_kb",    &conf.thread_stack_kb,    0,
+     "stack size of connection threads in KB (0 is the system default)"},
+    {"buf_pool_max_bytes", &conf.buf_pool_max_bytes, 0,
+     "free request buffers kept for reuse, in bytes"},
+    {"tunnel_threads",     &conf.tunnel_threads,     0,
+     "threads relaying CONNECT tunnels (0 answers CONNECT with 501)"},
+    {"tunnel_idle_ms",     &conf.tunnel_idle_ms,     0,
+     "how long a tunnel may carry no data before it is closed "
+     "(ms, 0 is forever)"},
+    {"max_tunnels",        &conf.max_tunnels,        0,
+     "open CONNECT tunnels, 0 is no limit"},
+    {"connect_any_port",   &conf.connect_any_port,   0,
+     "1 allows CONNECT to any port, 0 only to 443"},
+    {"workers",            &conf.workers,            0,
+     "pre-forked worker processes sharing a cache, 0 is one process"},
+    {"shm_cache_bytes",    &conf.shm_cache_bytes,    1L << 20,
+     "bytes of the cache shared by the workers"},
+    {NULL, NULL, 0, NULL}
+};
+
+/* find the option called name, NULL if there is none */
+static CONF_OPT *conf_find(char *name) {
+    CONF_OPT *opt;
+    for (opt = conf_opts; opt->name; opt++) {
+        if (!strcmp(opt->name, name)) {
+            return opt;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * apply every key=value in argv to conf
+ * returns 0 on success, -1 on the first unknown or invalid option
+ */
+int conf_parse(int argc, char **argv) {
+    char key[MAXLINE], *eq, *end;
+    CONF_OPT *opt;
+    long val;
+    int i;
+
+    for (i = 0; i < argc; i++) {
+        if ((eq = strchr(argv[i], '=')) == NULL ||
+            eq - argv[i] >= MAXLINE) {
+            fprintf(stderr, "bad option: %s\n", argv[i]);
+            return -1;
+        }
+        memcpy(key, argv[i], eq - argv[i]);
+        key[eq - argv[i]] = '\0';
+        if ((opt = conf_find(key)) == NULL) {
+            fprintf(stderr, "unknown option: %s\n", key);
+            return -1;
+        }
+        if (opt->str) {
+            *opt->str = *(eq + 1) ? eq + 1 : NULL;
+            continue;
+        }
+        val = strtol(eq + 1, &end, 10);
+        if (*(eq + 1) == '\0' || *end != '\0' || val < opt->min ||
+            (opt->max && val > opt->max)) {
+            fprintf(stderr, "bad value for %s: %s\n", key, eq + 1);
+            return -1;
+        }
+        *opt->val = val;
+    }
+    return 0;
+}
+
+/* print every option with its current value */
+void conf_usage(FILE *fp) {
+    CONF_OPT *opt;
+    fprintf(fp, "options (key=value):\n");
+    for (opt = conf_opts; opt->name; opt++) {
+        if (opt->str) {
+            fprintf(fp, "  %-20s %s [%s]\n", opt->name, opt->help,
+                    *opt->str ? *opt->str : "");
+        }
+        else {
+            fprintf(fp, "  %-20s %s [%ld]\n", opt->name, opt->help,
+                    *opt->val);
+        }
+    }
+}
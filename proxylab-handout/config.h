@@ -0,0 +1,74 @@
+/*
+ * runtime configuration for proxy.c
+ *
+ * Options are given on the command line after the port as
+ * key=value pairs, e.g.  ./proxy 15213 cache_ttl=30 refresh_threads=4
+ * Most options are numbers; a few, like access_log, take a string.
+ */
+
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+/* every tunable of the proxy lives here */
+typedef struct CONF {
+    long cache_max_bytes;    /* total bytes of cached objects */
+    long cache_auto;         /* move cache_max_bytes with free memory */
+    long cache_min_bytes;    /* least cache_auto shrinks the cache to */
+    long mem_limit_bytes;    /* memory to stay in, 0 asks cgroup or host */
+    long mem_target_pct;     /* share of that memory to fill */
+    long mem_psi_pct;        /* memory pressure that shrinks, 0 ignores */
+    long mem_interval_ms;    /* how often memory use is checked */
+    long object_max_bytes;   /* largest object that is cached */
+    long cache_ttl;          /* default freshness lifetime (s) */
+    long stale_ttl;          /* serve-stale window after expiry (s) */
+    long refresh_threads;    /* background refresh workers */
+    long refresh_queue;      /* pending refresh jobs before dropping */
+    long refresh_ahead_pct;  /* refresh-ahead window, % of ttl */
+    long refresh_ahead_hits; /* hits in that window to trigger refresh */
+    long compress;           /* store text bodies compressed */
+    long compress_min_bytes; /* smallest body worth compressing */
+    long compress_min_pct;   /* least saving to keep a chunk compressed */
+    long purge_any;          /* accept PURGE from non-local clients */
+    long neg_ttl;            /* how long upstream failures are cached (s) */
+    long neg_max_bytes;      /* byte budget of the negative cache */
+    long trace_slow_ms;      /* requests this slow are traced, 0 is off */
+    long trace_interval_ms;  /* how often slow traces are exported */
+    char *access_log;        /* access log file, NULL for none */
+    long log_max_bytes;      /* size at which the access log is rotated */
+    long log_keep;           /* rotated access logs kept */
+    long log_flush_ms;       /* how often the log writer wakes up */
+    long acceptors;          /* listening sockets, each with a thread */
+    long acceptor_pin;       /* pin each acceptor to its own CPU */
+    long numa;               /* spread acceptors over NUMA nodes */
+    long max_conns;          /* connections with a thread, 0 is no limit */
+    long max_inflight;       /* requests being served, 0 is no limit */
+    long shed_miss_pct;      /* share of max_inflight open to misses */
+    long client_rate;        /* requests/s per client IP, 0 is no limit */
+    long client_burst;       /* requests a client may send at once */
+    long origin_rate;        /* requests/s per origin, 0 is no limit */
+    long origin_burst;       /* requests an origin may get at once */
+    long rate_queue_ms;      /* delay allowed over a rate, 0 rejects */
+    char *pools;             /* reverse proxy pools, NULL for none */
+    long eject_failures;     /* failures in a row that eject a backend */
+    long eject_ms;           /* how long an ejected backend stays out */
+    long probe_ms;           /* probe interval of ejected backends, 0 off */
+    long idle_timeout_ms;    /* wait for a request line, 0 is forever */
+    long read_timeout_ms;    /* wait for each read, 0 is forever */
+    long write_timeout_ms;   /* wait for each write, 0 is forever */
+    long timer_wheel;        /* deadlines on a timer wheel, else sockets */
+    long thread_stack_kb;    /* stack of connection threads, 0 default */
+    long buf_pool_max_bytes; /* free request buffers kept for reuse */
+    long tunnel_threads;     /* CONNECT relay threads, 0 refuses CONNECT */
+    long tunnel_idle_ms;     /* idle time that closes a tunnel, 0 never */
+    long max_tunnels;        /* open tunnels, 0 is no limit */
+    long connect_any_port;   /* allow CONNECT to ports other than 443 */
+    long workers;            /* worker processes, 0 runs in this one */
+    long shm_cache_bytes;    /* cache shared by the workers */
+} CONF;
+
+extern CONF conf;
+
+int  conf_parse(int argc, char **argv);
+void conf_usage(FILE *fp);
+
+#endif /* __CONFIG_H__ */
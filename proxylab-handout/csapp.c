@@ -850,6 +850,25 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsomeb - Robustly read whatever is available, up to n bytes
+ *    (buffered). Unlike rio_readnb it returns as soon as one read()
+ *    brings in data, so it suits relaying a stream. A read at least
+ *    as big as the internal buffer, once that is empty, goes straight
+ *    into usrbuf.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t cnt;
+
+    if (rp->rio_cnt <= 0 && n >= sizeof(rp->rio_buf)) {
+        while ((cnt = read(rp->rio_fd, usrbuf, n)) < 0 && errno == EINTR)
+            ;
+        return cnt;
+    }
+    return rio_read(rp, usrbuf, n);
+}
+
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
  */
@@ -959,21 +978,34 @@ int open_clientfd(char *hostname, int port)
 
 int open_clientfd_r(char *hostname, int port) {
     int clientfd;
-    struct addrinfo *addlist, *p;
+    struct addrinfo *addlist;
     char port_str[MAXLINE];
     int rv;
 
-    /* Create the socket descriptor */
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        return -1;
-    }
-
     /* Get a list of addrinfo structs */
     sprintf(port_str, "%d", port);
     if ((rv = getaddrinfo(hostname, port_str, NULL, &addlist)) != 0) {
+        return -2; /* like open_clientfd, -2 is a DNS error */
+    }
+    clientfd = connect_addrinfo(addlist);
+    freeaddrinfo(addlist);
+    return clientfd;
+}
+
+/*
+ * connect_addrinfo - connect to the first IPv4 address of a list
+ * from getaddrinfo, for callers that resolve the name themselves.
+ * Returns the socket, or -1 when every connect failed.
+ */
+int connect_addrinfo(struct addrinfo *addlist) {
+    int clientfd;
+    struct addrinfo *p;
+
+    /* Create the socket descriptor */
+    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         return -1;
     }
-  
+
     /* Walk the list, using each addrinfo to try to connect */
     for (p = addlist; p; p = p->ai_next) {
         if ((p->ai_family == AF_INET)) {
@@ -983,8 +1015,6 @@ int open_clientfd_r(char *hostname, int port) {
         }
     } 
 
-    /* Clean up */
-    freeaddrinfo(addlist);
     if (!p) { /* all connects failed */
         close(clientfd);
         return -1;
@@ -1030,6 +1060,37 @@ int open_listenfd(int port)
 	return -1;
     return listenfd;
 }
+
+/*
+ * open_listenfd_reuseport - like open_listenfd, but several sockets
+ * may listen on the same port (SO_REUSEPORT) and the kernel spreads
+ * new connections across them. Returns -1 on error.
+ */
+int open_listenfd_reuseport(int port)
+{
+    int listenfd, optval=1;
+    struct sockaddr_in serveraddr;
+
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+                   (const void *)&optval , sizeof(int)) < 0 ||
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                   (const void *)&optval , sizeof(int)) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short)port);
+    if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 ||
+        listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
 /* $end open_listenfd */
 
 /****************************************************
@@ -0,0 +1,480 @@
+/*
+ * small HTTP helpers for proxy.c
+ *
+ * Header blocks are handled as raw "Name: value\r\n" lines, the
+ * way they come off the wire and the way the cache stores them.
+ * None of these functions need the block to be NUL-terminated.
+ *
+ * Chunked bodies are decoded in place as they arrive, a read at a
+ * time: the chunk data is moved down over the size lines with one
+ * memmove per run, only the size lines are looked at byte by byte.
+ */
+
+#include "csapp.h"
+#include "http.h"
+
+/* find the end of the line starting at ptr, or end if there is none */
+static char *line_end(char *ptr, char *end) {
+    while (ptr < end && *ptr != '\n') {
+        ptr++;
+    }
+    return ptr < end ? ptr + 1 : end;
+}
+
+/*
+ * copy the value of header name (case-insensitive) from the first
+ * len bytes of hdrs into val, without surrounding blanks
+ * returns the length of the value, -1 if the header is not there
+ */
+int http_header_value(char *hdrs, int len, char *name, char *val, int maxlen) {
+    char *ptr = hdrs, *end = hdrs + len, *next, *vend;
+    int nlen = strlen(name), vlen;
+
+    for (; ptr < end; ptr = next) {
+        next = line_end(ptr, end);
+        if (next - ptr <= nlen || ptr[nlen] != ':' ||
+            strncasecmp(ptr, name, nlen)) {
+            continue;
+        }
+        ptr += nlen + 1;
+        vend = next;
+        while (ptr < vend && (*ptr == ' ' || *ptr == '\t')) {
+            ptr++;
+        }
+        while (vend > ptr && isspace((unsigned char)vend[-1])) {
+            vend--;
+        }
+        vlen = vend - ptr;
+        if (vlen >= maxlen) {
+            vlen = maxlen - 1;
+        }
+        memcpy(val, ptr, vlen);
+        val[vlen] = '\0';
+        return vlen;
+    }
+    return -1;
+}
+
+/*
+ * check that data starts with a complete response head
+ * returns the length of the head including the blank line, -1 if
+ * it is not an HTTP response or the head is not within len bytes
+ */
+int http_parse_head(char *data, int len, int *status) {
+    int i;
+
+    if (len < 12 || strncmp(data, "HTTP/1.", 7)) {
+        return -1;
+    }
+    *status = atoi(data + 9);
+    for (i = 0; i + 3 < len; i++) {
+        if (data[i] == '\r' && !memcmp(data + i, "\r\n\r\n", 4)) {
+            return i + 4;
+        }
+    }
+    return -1;
+}
+
+/*
+ * copy the header lines of a response head, without its status
+ * line and blank line, into dst. headers named in skip (a NULL
+ * terminated list) are left out. returns the bytes copied.
+ */
+int http_copy_headers(char *dst, char *head, int head_len, char **skip) {
+    char *ptr, *next, *end = head + head_len, *out = dst;
+    char **name;
+    int nlen;
+
+    ptr = line_end(head, end);
+    for (; ptr < end; ptr = next) {
+        next = line_end(ptr, end);
+        if (*ptr == '\r' || *ptr == '\n') {
+            break;
+        }
+        for (name = skip; *name; name++) {
+            nlen = strlen(*name);
+            if (next - ptr > nlen && ptr[nlen] == ':' &&
+                !strncasecmp(ptr, *name, nlen)) {
+                break;
+            }
+        }
+        if (*name == NULL) {
+            memcpy(out, ptr, next - ptr);
+            out += next - ptr;
+        }
+    }
+    *out = '\0';
+    return out - dst;
+}
+
+/* parse a decimal number at *pp, -1 if there is none */
+static long parse_num(char **pp) {
+    char *end;
+    long num;
+
+    if (!isdigit((unsigned char)**pp)) {
+        return -1;
+    }
+    num = strtol(*pp, &end, 10);
+    *pp = end;
+    return num;
+}
+
+/*
+ * parse a Range header value against an entity of size bytes
+ * returns the number of satisfiable ranges stored in ranges, 0 if
+ * none is satisfiable (416), or -1 if the header should be ignored
+ * because it is malformed or asks for more than max ranges
+ */
+int http_parse_range(char *spec, unsigned long size, HTTP_RANGE *ranges,
+                     int max) {
+    char *ptr = spec + 6;
+    long first, last;
+    int n = 0;
+
+    if (strncasecmp(spec, "bytes=", 6)) {
+        return -1;
+    }
+    while (1) {
+        while (*ptr == ' ' || *ptr == '\t') {
+            ptr++;
+        }
+        if (*ptr == '-') {
+            /* suffix range: the last n bytes */
+            ptr++;
+            if ((last = parse_num(&ptr)) < 0) {
+                return -1;
+            }
+            first = (unsigned long)last >= size ? 0 : size - last;
+            last = size - 1;
+            if (size == 0 || first > last) {
+                first = -1;
+            }
+        }
+        else {
+            if ((first = parse_num(&ptr)) < 0 || *ptr++ != '-') {
+                return -1;
+            }
+            if ((last = parse_num(&ptr)) < 0) {
+                last = size - 1;
+            }
+            else if (last < first) {
+                return -1;
+            }
+            if ((unsigned long)first >= size) {
+                first = -1;
+            }
+            else if ((unsigned long)last >= size) {
+                last = size - 1;
+            }
+        }
+        if (first >= 0) {
+            if (n == max) {
+                return -1;
+            }
+            ranges[n].first = first;
+            ranges[n].last = last;
+            n++;
+        }
+        while (*ptr == ' ' || *ptr == '\t') {
+            ptr++;
+        }
+        if (*ptr == '\0') {
+            break;
+        }
+        if (*ptr++ != ',') {
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* sort query parameters by their text */
+static int param_cmp(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+/* copy n bytes of a path or query, with %xx escapes in upper case */
+static char *copy_escaped(char *dst, char *src, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = src[i];
+        if (src[i] == '%' && i + 2 < n &&
+            isxdigit((unsigned char)src[i + 1]) &&
+            isxdigit((unsigned char)src[i + 2])) {
+            dst[i + 1] = toupper(src[i + 1]);
+            dst[i + 2] = toupper(src[i + 2]);
+            i += 2;
+        }
+    }
+    return dst + n;
+}
+
+/*
+ * the canonical form of a request uri, the cache key of what it
+ * names: "http://" and the host in lower case, no :80, a path of at
+ * least "/", %xx escapes in upper case, the query parameters sorted
+ * and no fragment. uri may leave out "http://".
+ * returns the length written to dst, -1 if it does not fit in size
+ */
+int http_canonical_uri(char *uri, char *dst, int size) {
+    char *ptr = uri, *host, *port = NULL, *path, *query, *end, *out;
+    char *params[256], *qcopy, *save;
+    int host_len, port_len = 0, n = 0, i;
+
+    if (!strncasecmp(ptr, "http://", 7)) {
+        ptr += 7;
+    }
+    host = ptr;
+    while (*ptr && *ptr != ':' && *ptr != '/' && *ptr != '?' &&
+           *ptr != '#') {
+        ptr++;
+    }
+    host_len = ptr - host;
+    if (*ptr == ':') {
+        port = ++ptr;
+        while (isdigit((unsigned char)*ptr)) {
+            ptr++;
+        }
+        port_len = ptr - port;
+        if (port_len == 2 && !strncmp(port, "80", 2)) {
+            port_len = 0;
+        }
+    }
+    path = ptr;
+    end = path + strcspn(path, "#");
+    query = memchr(path, '?', end - path);
+    /* the parts are at most as long as uri, plus "http://" and "/" */
+    if (strlen(uri) + 9 > (size_t)size) {
+        return -1;
+    }
+    out = dst + sprintf(dst, "http://");
+    for (i = 0; i < host_len; i++) {
+        *out++ = tolower(host[i]);
+    }
+    if (port_len > 0) {
+        *out++ = ':';
+        memcpy(out, port, port_len);
+        out += port_len;
+    }
+    if (*path != '/') {
+        *out++ = '/';
+    }
+    out = copy_escaped(out, path, (query ? query : end) - path);
+    if (query != NULL && query + 1 < end) {
+        qcopy = Malloc(end - query);
+        memcpy(qcopy, query + 1, end - query - 1);
+        qcopy[end - query - 1] = '\0';
+        for (ptr = strtok_r(qcopy, "&", &save); ptr;
+             ptr = strtok_r(NULL, "&", &save)) {
+            if (n == 256) {
+                Free(qcopy);
+                return -1;
+            }
+            params[n++] = ptr;
+        }
+        qsort(params, n, sizeof(char *), param_cmp);
+        for (i = 0; i < n; i++) {
+            *out++ = i ? '&' : '?';
+            out = copy_escaped(out, params[i], strlen(params[i]));
+        }
+        Free(qcopy);
+    }
+    *out = '\0';
+    return out - dst;
+}
+
+/*
+ * the key of the variant of key that a request with the headers
+ * hdrs gets, when the response varies on the header names listed
+ * in vary: key, then "\tname:value" for each of them, lower case
+ * and without blanks. returns its length, -1 if it does not fit
+ */
+int http_variant_key(char *dst, int size, char *key, char *vary,
+                     char *hdrs) {
+    char list[MAXLINE], value[MAXLINE], *name, *save, *ptr;
+    int len = strlen(key), hdrs_len = strlen(hdrs);
+
+    if (len + 1 > size) {
+        return -1;
+    }
+    memcpy(dst, key, len + 1);
+    snprintf(list, MAXLINE, "%s", vary);
+    for (name = strtok_r(list, ", \t", &save); name;
+         name = strtok_r(NULL, ", \t", &save)) {
+        if (http_header_value(hdrs, hdrs_len, name, value, MAXLINE) < 0) {
+            value[0] = '\0';
+        }
+        if (len + strlen(name) + strlen(value) + 3 > (size_t)size) {
+            return -1;
+        }
+        dst[len++] = '\t';
+        for (ptr = name; *ptr; ptr++) {
+            dst[len++] = tolower(*ptr);
+        }
+        dst[len++] = ':';
+        for (ptr = value; *ptr; ptr++) {
+            if (!isspace((unsigned char)*ptr)) {
+                dst[len++] = tolower(*ptr);
+            }
+        }
+        dst[len] = '\0';
+    }
+    return len;
+}
+
+/* tell whether a response head has a chunked body */
+int http_is_chunked(char *head, int head_len) {
+    char value[MAXLINE], *ptr;
+
+    if (http_header_value(head, head_len, "Transfer-Encoding",
+                          value, MAXLINE) < 0) {
+        return 0;
+    }
+    for (ptr = value; *ptr; ptr++) {
+        *ptr = tolower(*ptr);
+    }
+    return strstr(value, "chunked") != NULL;
+}
+
+/*
+ * rewrite a response head for a plain body: the status line and
+ * headers without Transfer-Encoding, with Content-Length: size, or
+ * none if size < 0. dst needs head_len + 64 bytes.
+ * returns the length of the new head
+ */
+int http_plain_head(char *dst, char *head, int head_len, long size) {
+    static char *skip[] = {"Transfer-Encoding", "Content-Length", NULL};
+    char *status_end = line_end(head, head + head_len);
+    int len = status_end - head;
+
+    memcpy(dst, head, len);
+    len += http_copy_headers(dst + len, head, head_len, skip);
+    if (size >= 0) {
+        len += sprintf(dst + len, "Content-Length: %ld\r\n", size);
+    }
+    return len + sprintf(dst + len, "\r\n");
+}
+
+/* where a chunked body is in its framing */
+enum {
+    CH_SIZE,                 /* in the hex size */
+    CH_EXT,                  /* in the rest of the size line */
+    CH_DATA,                 /* in chunk data */
+    CH_DATA_END,             /* at the CRLF after the data */
+    CH_TRAILER,              /* at the start of a trailer line */
+    CH_TRAILER_LINE,         /* in a trailer line */
+    CH_DONE,
+    CH_ERROR
+};
+
+void http_chunked_init(HTTP_CHUNKED *c) {
+    c->state = CH_SIZE;
+    c->left = 0;
+}
+
+/*
+ * decode the next len bytes of a chunked body in buf, in place
+ * returns the number of body bytes now at the start of buf, or -1
+ * if the framing is broken. bytes after the last chunk are dropped.
+ */
+int http_chunked_decode(HTTP_CHUNKED *c, char *buf, int len) {
+    char *in = buf, *end = buf + len, *out = buf, *nl;
+    unsigned long n;
+    int digit;
+
+    while (in < end && c->state != CH_DONE) {
+        switch (c->state) {
+        case CH_SIZE:
+            if (isxdigit((unsigned char)*in)) {
+                digit = isdigit((unsigned char)*in) ? *in - '0' :
+                        tolower(*in) - 'a' + 10;
+                if (c->left >> 56) {
+                    c->state = CH_ERROR;
+                    return -1;
+                }
+                c->left = c->left * 16 + digit;
+                in++;
+            }
+            else {
+                c->state = CH_EXT;
+            }
+            break;
+        case CH_EXT:
+            if ((nl = memchr(in, '\n', end - in)) == NULL) {
+                in = end;
+                break;
+            }
+            in = nl + 1;
+            c->state = c->left > 0 ? CH_DATA : CH_TRAILER;
+            break;
+        case CH_DATA:
+            n = end - in < (long)c->left ? end - in : c->left;
+            memmove(out, in, n);
+            out += n;
+            in += n;
+            if ((c->left -= n) == 0) {
+                c->state = CH_DATA_END;
+            }
+            break;
+        case CH_DATA_END:
+            if (*in == '\r') {
+                in++;
+            }
+            else if (*in == '\n') {
+                in++;
+                c->state = CH_SIZE;
+            }
+            else {
+                c->state = CH_ERROR;
+                return -1;
+            }
+            break;
+        case CH_TRAILER:
+            if (*in == '\r') {
+                in++;
+            }
+            else if (*in == '\n') {
+                in++;
+                c->state = CH_DONE;
+            }
+            else {
+                c->state = CH_TRAILER_LINE;
+            }
+            break;
+        case CH_TRAILER_LINE:
+            if ((nl = memchr(in, '\n', end - in)) == NULL) {
+                in = end;
+                break;
+            }
+            in = nl + 1;
+            c->state = CH_TRAILER;
+            break;
+        default:
+            return -1;
+        }
+    }
+    return out - buf;
+}
+
+/* tell whether the last chunk and the trailer have been decoded */
+int http_chunked_done(HTTP_CHUNKED *c) {
+    return c->state == CH_DONE;
+}
+
+/*
+ * frame the len bytes at data as one chunk, writing its size line in
+ * the HTTP_CHUNK_ROOM bytes before data and CRLF in the 2 after it;
+ * len 0 makes the last chunk. returns the start of the chunk and
+ * sets len to its length
+ */
+char *http_chunk_wrap(char *data, int *len) {
+    char size[HTTP_CHUNK_ROOM];
+    int n = sprintf(size, "%x\r\n", *len);
+
+    memcpy(data - n, size, n);
+    memcpy(data + *len, "\r\n", 2);
+    *len += n + 2;
+    return data - n;
+}
@@ -0,0 +1,40 @@
+/*
+ * small HTTP helpers for proxy.c
+ */
+
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+/* most ranges served from one Range header, more are ignored */
+#define HTTP_MAX_RANGES 16
+
+/* a satisfiable byte range, both ends inclusive */
+typedef struct HTTP_RANGE {
+    unsigned long first;
+    unsigned long last;
+} HTTP_RANGE;
+
+/* a chunked body being decoded, see http_chunked_decode() */
+typedef struct HTTP_CHUNKED {
+    int state;
+    unsigned long left;      /* bytes of the current chunk still to come */
+} HTTP_CHUNKED;
+
+/* room http_chunk_wrap() needs before the data (hex size, CRLF) */
+#define HTTP_CHUNK_ROOM 18
+
+int http_header_value(char *hdrs, int len, char *name, char *val, int maxlen);
+int http_parse_head(char *data, int len, int *status);
+int http_copy_headers(char *dst, char *head, int head_len, char **skip);
+int http_parse_range(char *spec, unsigned long size, HTTP_RANGE *ranges,
+                     int max);
+int http_canonical_uri(char *uri, char *dst, int size);
+int http_variant_key(char *dst, int size, char *key, char *vary, char *hdrs);
+int http_is_chunked(char *head, int head_len);
+int http_plain_head(char *dst, char *head, int head_len, long size);
+void http_chunked_init(HTTP_CHUNKED *c);
+int http_chunked_decode(HTTP_CHUNKED *c, char *buf, int len);
+int http_chunked_done(HTTP_CHUNKED *c);
+char *http_chunk_wrap(char *data, int *len);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,203 @@
+/*
+ * LZ4-style block compression for the cache
+ *
+ * The output follows the LZ4 block format: a sequence of tokens,
+ * each made of a literal run and a back reference. The high nibble
+ * of the token is the literal length and the low nibble the match
+ * length minus 4, a nibble of 15 being continued in following bytes
+ * of 255. The reference is a 2 byte little endian offset. The last
+ * sequence is literals only.
+ *
+ * Matches are found through a small hash table of 4 byte sequences
+ * with no chaining, which trades some ratio for speed; the search
+ * step grows over incompressible stretches so they pass quickly.
+ */
+
+#include <string.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH     4
+#define LZ_HASH_LOG      12
+#define LZ_LAST_LITERALS 5    /* the block always ends in literals */
+#define LZ_MF_LIMIT      12   /* no match starts this close to the end */
+#define LZ_SKIP_TRIGGER  6    /* misses before the step grows */
+
+static unsigned read32(const unsigned char *p) {
+    unsigned v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned lz_hash(unsigned seq) {
+    return (seq * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/* write a length continuation: runs of 255 and a final byte */
+static unsigned char *put_len(unsigned char *op, int len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* emit one sequence, returns NULL if it does not fit in oend */
+static unsigned char *put_seq(unsigned char *op, unsigned char *oend,
+                              const unsigned char *lit, int litlen,
+                              int offset, int matchlen) {
+    unsigned char *token;
+
+    if (op + litlen + litlen / 255 + matchlen / 255 + 5 > oend) {
+        return NULL;
+    }
+    token = op++;
+    *token = (litlen >= 15 ? 15 : litlen) << 4;
+    if (litlen >= 15) {
+        op = put_len(op, litlen - 15);
+    }
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if (offset == 0) {
+        return op;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    matchlen -= LZ_MIN_MATCH;
+    *token |= matchlen >= 15 ? 15 : matchlen;
+    if (matchlen >= 15) {
+        op = put_len(op, matchlen - 15);
+    }
+    return op;
+}
+
+/*
+ * compress n bytes (at most LZ_MAX_INPUT) of src into dst
+ * returns the compressed size, -1 if it would not fit in cap bytes
+ */
+int lz_compress(const char *src, int n, char *dst, int cap) {
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *ip = base, *anchor = base, *ref, *m, *r;
+    const unsigned char *end = base + n;
+    const unsigned char *mflimit = end - LZ_MF_LIMIT;
+    const unsigned char *matchlimit = end - LZ_LAST_LITERALS;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+    unsigned short table[1 << LZ_HASH_LOG];
+    unsigned seq, h;
+    int misses = 0;
+
+    if (n > LZ_MAX_INPUT) {
+        return -1;
+    }
+    memset(table, 0, sizeof(table));
+    while (n > LZ_MF_LIMIT && ip < mflimit) {
+        seq = read32(ip);
+        h = lz_hash(seq);
+        ref = base + table[h];
+        table[h] = ip - base;
+        if (ref >= ip || ip - ref > 65535 || read32(ref) != seq) {
+            ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+        /* extend the match backwards over pending literals, then on */
+        while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        m = ip + LZ_MIN_MATCH;
+        r = ref + LZ_MIN_MATCH;
+        while (m < matchlimit && *m == *r) {
+            m++;
+            r++;
+        }
+        if ((op = put_seq(op, oend, anchor, ip - anchor, ip - ref,
+                          m - ip)) == NULL) {
+            return -1;
+        }
+        ip = anchor = m;
+        misses = 0;
+    }
+    if ((op = put_seq(op, oend, anchor, end - anchor, 0, 0)) == NULL) {
+        return -1;
+    }
+    return op - (unsigned char *)dst;
+}
+
+/* read a length continuation, -1 if it runs past iend */
+static int get_len(const unsigned char **ipp, const unsigned char *iend) {
+    const unsigned char *ip = *ipp;
+    int len = 0, b;
+
+    do {
+        if (ip >= iend) {
+            return -1;
+        }
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    *ipp = ip;
+    return len;
+}
+
+/*
+ * decompress n bytes of src into dst
+ * returns the decompressed size, -1 if src is corrupt or the
+ * output would not fit in cap bytes
+ */
+int lz_decompress(const char *src, int n, char *dst, int cap) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + n;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap, *match;
+    int token, len, offset, ext;
+
+    while (ip < iend) {
+        token = *ip++;
+        len = token >> 4;
+        if (len == 15) {
+            if ((ext = get_len(&ip, iend)) < 0) {
+                return -1;
+            }
+            len += ext;
+        }
+        if (ip + len > iend || op + len > oend) {
+            return -1;
+        }
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip == iend) {
+            break;
+        }
+
+        if (ip + 2 > iend) {
+            return -1;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - (unsigned char *)dst) {
+            return -1;
+        }
+        len = token & 15;
+        if (len == 15) {
+            if ((ext = get_len(&ip, iend)) < 0) {
+                return -1;
+            }
+            len += ext;
+        }
+        len += LZ_MIN_MATCH;
+        if (op + len > oend) {
+            return -1;
+        }
+        match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        }
+        else {
+            /* overlapping copy repeats the last offset bytes */
+            while (len-- > 0) {
+                *op++ = *match++;
+            }
+        }
+    }
+    return op - (unsigned char *)dst;
+}
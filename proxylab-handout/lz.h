@@ -0,0 +1,14 @@
+/*
+ * LZ4-style block compression for the cache
+ */
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+/* largest input of one lz_compress() call, offsets are 16 bits */
+#define LZ_MAX_INPUT 65536
+
+int lz_compress(const char *src, int n, char *dst, int cap);
+int lz_decompress(const char *src, int n, char *dst, int cap);
+
+#endif /* __LZ_H__ */
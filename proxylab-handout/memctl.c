@@ -0,0 +1,310 @@
+/*
+ * cache budget that follows the memory there is, for proxy.c
+ *
+ * With conf.cache_auto a thread wakes every conf.mem_interval_ms and
+ * compares the memory in use with conf.mem_target_pct of a limit.
+ * The limit and the use come from, in this order:
+ *
+ *   mem_limit_bytes=   that limit, against the RSS of the proxy
+ *   cgroup v2          memory.max, against memory.current
+ *   cgroup v1          memory.limit_in_bytes, against usage_in_bytes
+ *   the host           MemTotal, against MemTotal - MemAvailable
+ *
+ * A cgroup counts the page cache of its files as well, so the
+ * inactive file pages it could drop are not counted as used. A
+ * cgroup with no limit falls through to the host.
+ *
+ * Over the target, or with memory pressure (PSI "some avg10", of the
+ * cgroup or else of the host) at conf.mem_psi_pct or more, the budget
+ * conf.cache_max_bytes is cut by the excess, at most a quarter of it
+ * per step, and the cache is evicted down to it MEMCTL_BATCH bytes at
+ * a time so that lookups are not held up. Freed memory is then given
+ * back to the kernel. Under the target with the cache close to full,
+ * the budget grows by half of the headroom, at most 1/MEMCTL_STEP of
+ * it per step, so the cache takes what is there without overshoot.
+ * The budget never goes below conf.cache_min_bytes.
+ *
+ * Without cache_auto, cache_max_bytes stays what it was set to.
+ */
+
+#include <malloc.h>
+#include "csapp.h"
+#include "config.h"
+#include "cache.h"
+#include "memctl.h"
+
+#define MEM_RSS     0
+#define MEM_CGROUP2 1
+#define MEM_CGROUP1 2
+#define MEM_HOST    3
+
+static char *source_names[] = {"rss", "cgroup v2", "cgroup v1", "host"};
+
+static CACHE *cache;
+static int source = -1;
+static char cg_dir[MAXLINE / 2]; /* memory cgroup of the proxy */
+static char psi_path[MAXLINE];   /* memory.pressure to read, "" if none */
+
+/* counters and last readings, only the memctl thread writes them */
+static long last_used, last_limit, last_psi = -1;
+static unsigned long grows, shrinks, evicted;
+
+/* read the first number in path into val, -1 if there is none */
+static int read_long(char *path, long *val) {
+    FILE *fp;
+    int rc;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    rc = fscanf(fp, "%ld", val) == 1 ? 0 : -1;
+    fclose(fp);
+    return rc;
+}
+
+/* the value of a "name value" line of path, -1 if it is not there */
+static long read_field(char *path, char *name) {
+    char line[MAXLINE];
+    size_t len = strlen(name);
+    long val = -1;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        if (!strncmp(line, name, len) &&
+            (line[len] == ' ' || line[len] == ':')) {
+            val = atol(line + len + 1);
+            break;
+        }
+    }
+    fclose(fp);
+    return val;
+}
+
+/*
+ * find the directory of file for the cgroup at path under mount.
+ * inside a cgroup namespace the mount is the cgroup itself.
+ * returns 0 and sets cg_dir, -1 if neither has file.
+ */
+static int cg_find(char *mount, char *path, char *file) {
+    char probe[MAXLINE];
+
+    snprintf(cg_dir, sizeof(cg_dir), "%s%s", mount,
+             strcmp(path, "/") ? path : "");
+    snprintf(probe, MAXLINE, "%s/%s", cg_dir, file);
+    if (access(probe, R_OK) == 0) {
+        return 0;
+    }
+    snprintf(cg_dir, sizeof(cg_dir), "%s", mount);
+    snprintf(probe, MAXLINE, "%s/%s", cg_dir, file);
+    return access(probe, R_OK);
+}
+
+/* pick where the limit and the use are read from */
+static void source_init(void) {
+    char line[MAXLINE], path[MAXLINE], v2[MAXLINE] = "", *p;
+    FILE *fp;
+    long val;
+
+    source = MEM_HOST;
+    psi_path[0] = '\0';
+    if (conf.mem_limit_bytes > 0) {
+        source = MEM_RSS;
+    }
+    else if ((fp = fopen("/proc/self/cgroup", "r")) != NULL) {
+        while (fgets(line, MAXLINE, fp) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            /* "0::/path" on v2, "4:memory:/path" or "4:cpu,memory:..." */
+            if (!strncmp(line, "0::", 3)) {
+                snprintf(v2, MAXLINE, "%s", line + 3);
+            }
+            else if ((p = strstr(line, "memory:")) != NULL &&
+                     (p[-1] == ':' || p[-1] == ',') &&
+                     cg_find("/sys/fs/cgroup/memory", p + 7,
+                             "memory.limit_in_bytes") == 0) {
+                snprintf(path, MAXLINE, "%s/memory.limit_in_bytes", cg_dir);
+                /* no limit is a huge number rounded to a page */
+                if (read_long(path, &val) == 0 && val < (1L << 62)) {
+                    source = MEM_CGROUP1;
+                }
+            }
+        }
+        fclose(fp);
+        if (source == MEM_HOST && v2[0] &&
+            cg_find("/sys/fs/cgroup", v2, "memory.max") == 0) {
+            snprintf(path, MAXLINE, "%s/memory.max", cg_dir);
+            /* no limit reads "max" */
+            if (read_long(path, &val) == 0) {
+                source = MEM_CGROUP2;
+            }
+            snprintf(psi_path, MAXLINE, "%s/memory.pressure", cg_dir);
+        }
+    }
+    if (psi_path[0] == '\0' || access(psi_path, R_OK) < 0) {
+        snprintf(psi_path, MAXLINE, "/proc/pressure/memory");
+        if (access(psi_path, R_OK) < 0) {
+            psi_path[0] = '\0';
+        }
+    }
+}
+
+/* read the memory limit and the memory in use, -1 if they cannot be */
+static int mem_read(long *used, long *limit) {
+    char path[MAXLINE];
+    long rss, total, avail, cur, inactive;
+
+    switch (source) {
+    case MEM_RSS:
+        /* "VmRSS:  1234 kB" */
+        if ((rss = read_field("/proc/self/status", "VmRSS")) < 0) {
+            return -1;
+        }
+        *used = rss * 1024;
+        *limit = conf.mem_limit_bytes;
+        return 0;
+    case MEM_CGROUP2:
+    case MEM_CGROUP1:
+        snprintf(path, MAXLINE, "%s/%s", cg_dir, source == MEM_CGROUP2 ?
+                 "memory.max" : "memory.limit_in_bytes");
+        if (read_long(path, limit) < 0) {
+            return -1;
+        }
+        snprintf(path, MAXLINE, "%s/%s", cg_dir, source == MEM_CGROUP2 ?
+                 "memory.current" : "memory.usage_in_bytes");
+        if (read_long(path, &cur) < 0) {
+            return -1;
+        }
+        snprintf(path, MAXLINE, "%s/memory.stat", cg_dir);
+        inactive = read_field(path, source == MEM_CGROUP2 ?
+                              "inactive_file" : "total_inactive_file");
+        *used = inactive > 0 && inactive < cur ? cur - inactive : cur;
+        return 0;
+    default:
+        total = read_field("/proc/meminfo", "MemTotal");
+        avail = read_field("/proc/meminfo", "MemAvailable");
+        if (total <= 0 || avail < 0) {
+            return -1;
+        }
+        *limit = total * 1024;
+        *used = (total - avail) * 1024;
+        return 0;
+    }
+}
+
+/* "some avg10" memory pressure in hundredths of a percent, -1 if none */
+static long psi_read(void) {
+    char line[MAXLINE];
+    double avg10;
+    long psi = -1;
+    FILE *fp;
+
+    if (psi_path[0] == '\0' || (fp = fopen(psi_path, "r")) == NULL) {
+        return -1;
+    }
+    if (fgets(line, MAXLINE, fp) != NULL &&
+        sscanf(line, "some avg10=%lf", &avg10) == 1) {
+        psi = (long)(avg10 * 100);
+    }
+    fclose(fp);
+    return psi;
+}
+
+/* one step of the controller */
+static void memctl_step(void) {
+    long used, limit, target, budget, size, psi, step, delta;
+    unsigned long freed;
+
+    if (mem_read(&used, &limit) < 0) {
+        return;
+    }
+    psi = psi_read();
+    last_used = used;
+    last_limit = limit;
+    last_psi = psi;
+    target = limit / 100 * conf.mem_target_pct;
+    budget = conf.cache_max_bytes;
+    size = __atomic_load_n(&cache->cache_size, __ATOMIC_RELAXED);
+    step = budget / MEMCTL_STEP;
+    if (step < CACHE_CHUNK_SIZE) {
+        step = CACHE_CHUNK_SIZE;
+    }
+
+    if (used > target ||
+        (conf.mem_psi_pct > 0 && psi >= conf.mem_psi_pct * 100)) {
+        /* shrink twice as fast as it grows */
+        delta = used > target ? used - target : step;
+        if (delta > 2 * step) {
+            delta = 2 * step;
+        }
+        if (budget - delta < conf.cache_min_bytes) {
+            delta = budget - conf.cache_min_bytes;
+        }
+        if (delta <= 0) {
+            return;
+        }
+        __atomic_store_n(&conf.cache_max_bytes, budget - delta,
+                         __ATOMIC_RELAXED);
+        shrinks++;
+        if ((freed = cache_shrink(cache, budget - delta, MEMCTL_BATCH))) {
+            evicted += freed;
+            malloc_trim(0);
+        }
+    }
+    else if (size >= budget - step) {
+        /* only a cache that is close to full has a use for more */
+        delta = (target - used) / 2;
+        if (delta > step) {
+            delta = step;
+        }
+        if (delta < CACHE_CHUNK_SIZE) {
+            return;
+        }
+        __atomic_store_n(&conf.cache_max_bytes, budget + delta,
+                         __ATOMIC_RELAXED);
+        grows++;
+    }
+}
+
+static void *memctl_thread(void *vargp) {
+    Pthread_detach(pthread_self());
+    while (1) {
+        usleep(conf.mem_interval_ms * 1000);
+        memctl_step();
+    }
+    return NULL;
+}
+
+/* start the controller of the budget of cache if conf asks for it */
+void memctl_init(CACHE *c) {
+    pthread_t tid;
+
+    cache = c;
+    if (!conf.cache_auto) {
+        return;
+    }
+    if (conf.cache_max_bytes < conf.cache_min_bytes) {
+        conf.cache_max_bytes = conf.cache_min_bytes;
+    }
+    source_init();
+    Pthread_create(&tid, NULL, memctl_thread, NULL);
+}
+
+/* print the budget and what the controller last saw */
+void memctl_report(FILE *fp) {
+    long budget = __atomic_load_n(&conf.cache_max_bytes, __ATOMIC_RELAXED);
+
+    if (!conf.cache_auto) {
+        fprintf(fp, "memctl: off, cache budget %ld bytes\n", budget);
+        return;
+    }
+    fprintf(fp, "memctl (%s): cache budget %ld bytes, memory %ld of %ld "
+            "bytes (target %ld%%)", source_names[source], budget,
+            last_used, last_limit, conf.mem_target_pct);
+    if (last_psi >= 0) {
+        fprintf(fp, ", pressure %ld.%02ld%%", last_psi / 100, last_psi % 100);
+    }
+    fprintf(fp, "; %lu grows, %lu shrinks, %lu bytes evicted\n",
+            grows, shrinks, evicted);
+}
@@ -0,0 +1,19 @@
+/*
+ * cache budget that follows the memory there is, for proxy.c
+ */
+
+#ifndef __MEMCTL_H__
+#define __MEMCTL_H__
+
+#include "cache.h"
+
+/* most a budget moves in one step, in 1/MEMCTL_STEP of it */
+#define MEMCTL_STEP 8
+
+/* bytes evicted under one hold of the cache mutex */
+#define MEMCTL_BATCH (256 * 1024)
+
+void memctl_init(CACHE *cache);
+void memctl_report(FILE *fp);
+
+#endif /* __MEMCTL_H__ */
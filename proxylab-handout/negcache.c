@@ -0,0 +1,181 @@
+/*
+ * negative cache of upstream failures for proxy.c
+ *
+ * When an origin cannot be resolved or connected to, or answers
+ * a uri with a 5xx, the error response sent to the client is kept
+ * here for a few seconds. Requests for the same origin or uri are
+ * answered from it right away instead of tying up a thread on a
+ * connect that is going to fail. Keys are "origin host:port" for
+ * connect and DNS failures and the uri for 5xx replies.
+ *
+ * Entries live in a hash table and a FIFO list, and count against
+ * their own small byte budget (conf.neg_max_bytes) so failures can
+ * never push good objects out of the main cache.
+ */
+
+#include "csapp.h"
+#include "config.h"
+#include "negcache.h"
+
+typedef struct NEG_E {
+    char *key;
+    char *resp;               /* the whole error response */
+    int len;
+    long expire_ms;
+    struct NEG_E *hnext;      /* next in the hash bucket */
+    struct NEG_E *older;      /* FIFO list, oldest at neg.tail */
+    struct NEG_E *newer;
+} NEG_E;
+
+static struct {
+    NEG_E *table[NEG_BUCKETS];
+    NEG_E *head;              /* newest entry */
+    NEG_E *tail;              /* oldest entry */
+    unsigned long size;       /* bytes of keys and responses */
+    unsigned cnt;
+    unsigned long hit_cnt, insert_cnt, expire_cnt, evict_cnt;
+    sem_t mutex;
+} neg;
+
+/* monotonic clock in milliseconds */
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static unsigned neg_hash(char *key) {
+    unsigned h = 2166136261U;
+    while (*key) {
+        h = (h ^ (unsigned char)*key++) * 16777619U;
+    }
+    return h & (NEG_BUCKETS - 1);
+}
+
+void neg_init(void) {
+    memset(&neg, 0, sizeof(neg));
+    Sem_init(&neg.mutex, 0, 1);
+}
+
+/* unlink and free an entry. mutex must be held. */
+static void neg_remove(NEG_E *e) {
+    NEG_E **pp = &neg.table[neg_hash(e->key)];
+
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    if (e->newer) {
+        e->newer->older = e->older;
+    }
+    else {
+        neg.head = e->older;
+    }
+    if (e->older) {
+        e->older->newer = e->newer;
+    }
+    else {
+        neg.tail = e->newer;
+    }
+    neg.size -= strlen(e->key) + e->len;
+    neg.cnt--;
+    Free(e->key);
+    Free(e->resp);
+    Free(e);
+}
+
+/* the live entry of key, expired ones are dropped. mutex must be held. */
+static NEG_E *neg_find(char *key) {
+    NEG_E *e;
+
+    for (e = neg.table[neg_hash(key)]; e; e = e->hnext) {
+        if (!strcmp(e->key, key)) {
+            if (e->expire_ms > now_ms()) {
+                return e;
+            }
+            neg_remove(e);
+            neg.expire_cnt++;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * answer fd with the error cached under key
+ * returns the status code it was answered with, 0 if nothing is cached
+ */
+int neg_serve(char *key, int fd) {
+    char resp[NEG_MAX_RESP];
+    NEG_E *e;
+    int len = 0;
+
+    P(&neg.mutex);
+    if ((e = neg_find(key)) != NULL) {
+        len = e->len;
+        memcpy(resp, e->resp, len);
+        neg.hit_cnt++;
+    }
+    V(&neg.mutex);
+    if (len > 0) {
+        rio_writen(fd, resp, len);
+        /* "HTTP/1.x NNN ..." */
+        return len > 12 ? atoi(resp + 9) : 1;
+    }
+    return 0;
+}
+
+/* remember the error response resp for key during ttl_ms */
+void neg_insert(char *key, char *resp, int len, long ttl_ms) {
+    unsigned long need = strlen(key) + len;
+    NEG_E *e, *old;
+
+    if (ttl_ms <= 0 || len > NEG_MAX_RESP || need > conf.neg_max_bytes) {
+        return;
+    }
+    e = Malloc(sizeof(NEG_E));
+    e->key = Malloc(strlen(key) + 1);
+    strcpy(e->key, key);
+    e->resp = Malloc(len);
+    memcpy(e->resp, resp, len);
+    e->len = len;
+    e->expire_ms = now_ms() + ttl_ms;
+
+    P(&neg.mutex);
+    if ((old = neg_find(key)) != NULL) {
+        neg_remove(old);
+    }
+    while (neg.tail && neg.size + need > conf.neg_max_bytes) {
+        if (neg.tail->expire_ms > now_ms()) {
+            neg.evict_cnt++;
+        }
+        else {
+            neg.expire_cnt++;
+        }
+        neg_remove(neg.tail);
+    }
+    e->hnext = neg.table[neg_hash(key)];
+    neg.table[neg_hash(key)] = e;
+    e->older = neg.head;
+    e->newer = NULL;
+    if (neg.head) {
+        neg.head->newer = e;
+    }
+    else {
+        neg.tail = e;
+    }
+    neg.head = e;
+    neg.size += need;
+    neg.cnt++;
+    neg.insert_cnt++;
+    V(&neg.mutex);
+}
+
+/* print the negative cache counters */
+void neg_report(FILE *fp) {
+    P(&neg.mutex);
+    fprintf(fp, "negcache: %lu bytes in %u entries, %lu hits, %lu inserts, "
+            "%lu expired, %lu evicted\n", neg.size, neg.cnt, neg.hit_cnt,
+            neg.insert_cnt, neg.expire_cnt, neg.evict_cnt);
+    V(&neg.mutex);
+}
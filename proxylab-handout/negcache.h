@@ -0,0 +1,19 @@
+/*
+ * negative cache of upstream failures for proxy.c
+ */
+
+#ifndef __NEGCACHE_H__
+#define __NEGCACHE_H__
+
+/* buckets of the negative cache table, a power of 2 */
+#define NEG_BUCKETS 256
+
+/* largest error response that is kept */
+#define NEG_MAX_RESP 8192
+
+void neg_init(void);
+int  neg_serve(char *key, int fd);
+void neg_insert(char *key, char *resp, int len, long ttl_ms);
+void neg_report(FILE *fp);
+
+#endif /* __NEGCACHE_H__ */
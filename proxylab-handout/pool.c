@@ -0,0 +1,345 @@
+/*
+ * upstream pools of the reverse proxy mode of proxy.c
+ *
+ * conf.pools maps virtual hosts to pools of backends:
+ *
+ *   pools=www.example.com=hash@10.0.0.1:8080,10.0.0.2:8080;api=least@...
+ *
+ * A request for a virtual host, by Host header or absolute uri, is
+ * sent to one of its backends instead of the host named in it; the
+ * cache still keys it by http://<vhost><path>. The policy before '@'
+ * is rr (the default), least or hash:
+ *
+ *   rr     each backend in turn
+ *   least  the backend with the fewest requests outstanding
+ *   hash   a consistent hash of the uri, so every uri keeps going to
+ *          the same backend and its cache stays warm, and adding or
+ *          removing a backend only moves the uris it owns
+ *
+ * Pools are built once at startup and never change, so they are read
+ * without locks; the per-backend counters are atomics.
+ *
+ * Health is tracked passively: conf.eject_failures connects or reads
+ * failing in a row eject a backend for conf.eject_ms, and picks skip
+ * it (unless the whole pool is out, then it is used anyway). Once back
+ * a single failure ejects it again; a success clears the count. With
+ * conf.probe_ms a prober thread instead keeps ejected backends out
+ * until a TCP connect to them succeeds. The ejection state is one
+ * atomic deadline per backend, so picks read it without a lock.
+ */
+
+#include <poll.h>
+#include "csapp.h"
+#include "config.h"
+#include "stats.h"
+#include "pool.h"
+
+/* eject_until of a backend only the prober brings back */
+#define POOL_FOREVER (~0UL)
+
+static POOL pools[POOL_MAX];
+static int npools;
+
+static unsigned pool_hash(char *key) {
+    unsigned h = 2166136261U;
+    while (*key) {
+        h = (h ^ (unsigned char)*key++) * 16777619U;
+    }
+    /* FNV alone spreads short keys that differ at the end poorly */
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+    return h;
+}
+
+static int point_cmp(const void *a, const void *b) {
+    unsigned x = ((POOL_POINT *)a)->hash, y = ((POOL_POINT *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/* parse one "vhost=[policy@]host:port,..." into a new pool */
+static int pool_parse(char *spec) {
+    char *eq = strchr(spec, '='), *at, *addr, *next, *colon;
+    char key[POOL_HOST_LEN + 32];
+    POOL *pool;
+    UPSTREAM *up;
+    int i, j;
+
+    if (eq == NULL || eq == spec || eq - spec >= POOL_HOST_LEN ||
+        npools == POOL_MAX) {
+        return -1;
+    }
+    pool = &pools[npools];
+    memcpy(pool->vhost, spec, eq - spec);
+    pool->vhost[eq - spec] = '\0';
+    addr = eq + 1;
+    pool->policy = POOL_RR;
+    if ((at = strchr(addr, '@')) != NULL) {
+        *at = '\0';
+        if (!strcmp(addr, "least")) {
+            pool->policy = POOL_LEAST;
+        }
+        else if (!strcmp(addr, "hash")) {
+            pool->policy = POOL_HASH;
+        }
+        else if (strcmp(addr, "rr")) {
+            return -1;
+        }
+        addr = at + 1;
+    }
+    for (; addr && *addr; addr = next) {
+        if ((next = strchr(addr, ',')) != NULL) {
+            *next++ = '\0';
+        }
+        if (pool->n == POOL_MAX_UPSTREAMS ||
+            (colon = strrchr(addr, ':')) == NULL || colon == addr ||
+            colon - addr >= POOL_HOST_LEN || atoi(colon + 1) <= 0 ||
+            atoi(colon + 1) > 65535) {
+            return -1;
+        }
+        up = &pool->ups[pool->n++];
+        memcpy(up->host, addr, colon - addr);
+        up->host[colon - addr] = '\0';
+        up->port = atoi(colon + 1);
+    }
+    if (pool->n == 0) {
+        return -1;
+    }
+    pool->ring = Malloc(pool->n * POOL_VNODES * sizeof(POOL_POINT));
+    for (i = 0; i < pool->n; i++) {
+        for (j = 0; j < POOL_VNODES; j++) {
+            snprintf(key, sizeof(key), "%s:%d#%d", pool->ups[i].host,
+                     pool->ups[i].port, j);
+            pool->ring[i * POOL_VNODES + j].hash = pool_hash(key);
+            pool->ring[i * POOL_VNODES + j].up = &pool->ups[i];
+        }
+    }
+    qsort(pool->ring, pool->n * POOL_VNODES, sizeof(POOL_POINT), point_cmp);
+    npools++;
+    return 0;
+}
+
+/*
+ * build the pools from spec, "vhost=...;vhost=..." or NULL for none
+ * returns 0, or -1 if spec is malformed
+ */
+int pool_init(char *spec) {
+    char *copy, *item, *next;
+
+    npools = 0;
+    if (spec == NULL) {
+        return 0;
+    }
+    copy = Malloc(strlen(spec) + 1);
+    strcpy(copy, spec);
+    for (item = copy; item && *item; item = next) {
+        if ((next = strchr(item, ';')) != NULL) {
+            *next++ = '\0';
+        }
+        if (pool_parse(item) < 0) {
+            fprintf(stderr, "bad pool: %s\n", item);
+            return -1;
+        }
+    }
+    /* the pools hold copies of what they need */
+    Free(copy);
+    return 0;
+}
+
+/* the pool of virtual host host (without a port), NULL if none */
+POOL *pool_find(char *host) {
+    int i;
+
+    for (i = 0; i < npools; i++) {
+        if (!strcasecmp(pools[i].vhost, host)) {
+            return &pools[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * choose the backend of pool for key (the uri) and count a request
+ * on it; pool_done() must follow
+ */
+UPSTREAM *pool_pick(POOL *pool, char *key) {
+    UPSTREAM *up, *best;
+    unsigned long now = stats_now_us();
+    unsigned h;
+    int lo, hi, mid, i, start, total = pool->n * POOL_VNODES;
+
+    if (pool->policy == POOL_HASH) {
+        h = pool_hash(key);
+        lo = 0;
+        hi = total;
+        /* the first point at or after h, wrapping around */
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (pool->ring[mid].hash < h) {
+                lo = mid + 1;
+            }
+            else {
+                hi = mid;
+            }
+        }
+        /* an ejected backend's uris move on to the next ones */
+        for (i = 0; i < total; i++) {
+            up = pool->ring[(lo + i) % total].up;
+            if (!pool_ejected(up, now)) {
+                break;
+            }
+        }
+        if (i == total) {
+            up = pool->ring[lo % total].up;
+        }
+    }
+    else {
+        start = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) %
+                pool->n;
+        best = NULL;
+        for (i = 0; i < pool->n; i++) {
+            up = &pool->ups[(start + i) % pool->n];
+            if (pool_ejected(up, now)) {
+                continue;
+            }
+            if (pool->policy == POOL_RR) {
+                best = up;
+                break;
+            }
+            /* starting at the round robin position spreads ties */
+            if (best == NULL ||
+                __atomic_load_n(&up->outstanding, __ATOMIC_RELAXED) <
+                __atomic_load_n(&best->outstanding, __ATOMIC_RELAXED)) {
+                best = up;
+            }
+        }
+        up = best ? best : &pool->ups[start];
+    }
+    __atomic_add_fetch(&up->outstanding, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&up->requests, 1, __ATOMIC_RELAXED);
+    return up;
+}
+
+/*
+ * the request picked on up is over, ok tells whether it got a reply;
+ * too many failures in a row eject up
+ */
+void pool_done(UPSTREAM *up, int ok) {
+    __atomic_sub_fetch(&up->outstanding, 1, __ATOMIC_RELAXED);
+    if (ok) {
+        if (__atomic_load_n(&up->fails, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&up->fails, 0, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+    __atomic_add_fetch(&up->failures, 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&up->fails, 1, __ATOMIC_RELAXED) >=
+        conf.eject_failures &&
+        !pool_ejected(up, stats_now_us())) {
+        __atomic_store_n(&up->eject_until, conf.probe_ms > 0 ? POOL_FOREVER :
+                         stats_now_us() + conf.eject_ms * 1000UL,
+                         __ATOMIC_RELAXED);
+        __atomic_add_fetch(&up->ejections, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* tell whether up is out of rotation at time now (us) */
+int pool_ejected(UPSTREAM *up, unsigned long now) {
+    return __atomic_load_n(&up->eject_until, __ATOMIC_RELAXED) > now;
+}
+
+/* try a TCP connect to up within timeout_ms, 0 if it was accepted */
+static int pool_probe(UPSTREAM *up, int timeout_ms) {
+    struct addrinfo hints, *addlist, *p;
+    struct pollfd pfd;
+    char port[16];
+    int fd, err, rc = -1;
+    socklen_t len = sizeof(err);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    sprintf(port, "%d", up->port);
+    if (getaddrinfo(up->host, port, &hints, &addlist) != 0) {
+        return -1;
+    }
+    for (p = addlist; p && rc < 0; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, SOCK_STREAM, 0)) < 0) {
+            continue;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+            rc = 0;
+        }
+        else if (errno == EINPROGRESS) {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, timeout_ms) == 1 &&
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+                err == 0) {
+                rc = 0;
+            }
+        }
+        close(fd);
+    }
+    freeaddrinfo(addlist);
+    return rc;
+}
+
+/* every conf.probe_ms, bring back the ejected backends that answer */
+static void *pool_prober(void *varptr) {
+    UPSTREAM *up;
+    int i, j;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        usleep(conf.probe_ms * 1000);
+        for (i = 0; i < npools; i++) {
+            for (j = 0; j < pools[i].n; j++) {
+                up = &pools[i].ups[j];
+                if (pool_ejected(up, stats_now_us()) &&
+                    pool_probe(up, conf.probe_ms) == 0) {
+                    __atomic_store_n(&up->fails, 0, __ATOMIC_RELAXED);
+                    __atomic_store_n(&up->eject_until, 0, __ATOMIC_RELAXED);
+                    __atomic_add_fetch(&up->recoveries, 1,
+                                       __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/* start the prober if conf.probe_ms asks for one and there are pools */
+void pool_probe_init(void) {
+    pthread_t tid;
+
+    if (conf.probe_ms > 0 && npools > 0) {
+        Pthread_create(&tid, NULL, pool_prober, NULL);
+    }
+}
+
+/* print every backend with its counters */
+void pool_report(FILE *fp) {
+    static char *policies[] = {"rr", "least", "hash"};
+    UPSTREAM *up;
+    unsigned long now = stats_now_us();
+    int i, j;
+
+    for (i = 0; i < npools; i++) {
+        fprintf(fp, "pool %s (%s):", pools[i].vhost,
+                policies[pools[i].policy]);
+        for (j = 0; j < pools[i].n; j++) {
+            up = &pools[i].ups[j];
+            fprintf(fp, " %s:%d %lu req %lu fail %ld out %lu ejected "
+                    "%lu recovered%s%s", up->host, up->port,
+                    __atomic_load_n(&up->requests, __ATOMIC_RELAXED),
+                    __atomic_load_n(&up->failures, __ATOMIC_RELAXED),
+                    __atomic_load_n(&up->outstanding, __ATOMIC_RELAXED),
+                    __atomic_load_n(&up->ejections, __ATOMIC_RELAXED),
+                    __atomic_load_n(&up->recoveries, __ATOMIC_RELAXED),
+                    pool_ejected(up, now) ? " (out)" : "",
+                    j + 1 < pools[i].n ? "," : "");
+        }
+        fprintf(fp, "\n");
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * upstream pools of the reverse proxy mode of proxy.c
+ */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#define POOL_MAX 16            /* virtual hosts with a pool */
+#define POOL_MAX_UPSTREAMS 64  /* backends in one pool */
+#define POOL_VNODES 160        /* points of a backend on the hash ring */
+#define POOL_HOST_LEN 256
+
+/* how a pool picks a backend */
+#define POOL_RR    0   /* round robin */
+#define POOL_LEAST 1   /* fewest outstanding requests */
+#define POOL_HASH  2   /* consistent hash of the uri */
+
+typedef struct UPSTREAM {
+    char host[POOL_HOST_LEN];
+    int port;
+    long outstanding;          /* requests being fetched from it */
+    unsigned long requests;
+    unsigned long failures;
+    long fails;                /* consecutive failures */
+    unsigned long eject_until; /* out of rotation until then (us) */
+    unsigned long ejections;
+    unsigned long recoveries;  /* brought back by the prober */
+} UPSTREAM;
+
+typedef struct POOL_POINT {
+    unsigned hash;
+    UPSTREAM *up;
+} POOL_POINT;
+
+typedef struct POOL {
+    char vhost[POOL_HOST_LEN];
+    int policy;
+    UPSTREAM ups[POOL_MAX_UPSTREAMS];
+    int n;
+    unsigned long next;        /* round robin position */
+    POOL_POINT *ring;          /* n * POOL_VNODES points, sorted */
+} POOL;
+
+int  pool_init(char *spec);
+POOL *pool_find(char *host);
+UPSTREAM *pool_pick(POOL *pool, char *key);
+void pool_done(UPSTREAM *up, int ok);
+int  pool_ejected(UPSTREAM *up, unsigned long now);
+void pool_probe_init(void);
+void pool_report(FILE *fp);
+
+#endif /* __POOL_H__ */
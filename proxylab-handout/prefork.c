@@ -0,0 +1,173 @@
+/*
+ * pre-forked worker processes for proxy.c
+ *
+ * With conf.workers the process that parses the options becomes a
+ * master: it forks that many workers before any thread is started
+ * and then only watches them. Each worker returns from prefork_run()
+ * and sets up a proxy of its own, with its own threads, cache and
+ * listening sockets on the shared port (SO_REUSEPORT), so a crash
+ * takes down one worker and the connections it had, not the proxy.
+ *
+ * The master restarts a worker that exits, after PREFORK_PAUSE_MS
+ * if it did not live PREFORK_MIN_LIFE_MS, so a worker that cannot
+ * start does not spin. SIGUSR1 is passed on to every worker, and the
+ * master prints the restarts and the shared cache (shmcache.c).
+ * SIGTERM or SIGINT stop the workers and remove the shared segment.
+ * Workers get SIGTERM when the master dies.
+ */
+
+#include <sys/prctl.h>
+#include "csapp.h"
+#include "config.h"
+#include "shmcache.h"
+#include "prefork.h"
+
+typedef struct WORKER {
+    pid_t pid;
+    long started_ms;
+} WORKER;
+
+static WORKER *workers;
+static int nworkers;
+static unsigned long restarts;
+static volatile sig_atomic_t got_chld, got_usr1, got_term;
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void master_handler(int sig) {
+    if (sig == SIGCHLD) {
+        got_chld = 1;
+    }
+    else if (sig == SIGUSR1) {
+        got_usr1 = 1;
+    }
+    else {
+        got_term = 1;
+    }
+}
+
+/*
+ * fork worker i. returns 1 in the new worker, with the signals as
+ * they were before prefork_run() but SIGUSR1 blocked until the worker
+ * takes it; 0 in the master.
+ */
+static int spawn(int i, sigset_t *old) {
+    sigset_t mask;
+    pid_t pid;
+
+    if ((pid = Fork()) == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        Signal(SIGCHLD, SIG_DFL);
+        Signal(SIGUSR1, SIG_DFL);
+        Signal(SIGTERM, SIG_DFL);
+        Signal(SIGINT, SIG_DFL);
+        mask = *old;
+        sigaddset(&mask, SIGUSR1);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        return 1;
+    }
+    workers[i].pid = pid;
+    workers[i].started_ms = now_ms();
+    return 0;
+}
+
+/*
+ * wait for the workers that exited and start new ones. returns the
+ * number of the worker in a new worker, -1 in the master.
+ */
+static int reap(sigset_t *old) {
+    pid_t pid;
+    int status, i;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < nworkers && workers[i].pid != pid; i++)
+            ;
+        if (i == nworkers) {
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "worker %d (pid %d) killed by signal %d\n",
+                    i, pid, WTERMSIG(status));
+        }
+        else {
+            fprintf(stderr, "worker %d (pid %d) exited with %d\n",
+                    i, pid, WEXITSTATUS(status));
+        }
+        if (now_ms() - workers[i].started_ms < PREFORK_MIN_LIFE_MS) {
+            usleep(PREFORK_PAUSE_MS * 1000);
+        }
+        restarts++;
+        if (spawn(i, old)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* stop every worker and remove the shared cache */
+static void shutdown_workers(void) {
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        kill(workers[i].pid, SIGTERM);
+    }
+    for (i = 0; i < nworkers; i++) {
+        waitpid(workers[i].pid, NULL, 0);
+    }
+    shm_cache_destroy();
+}
+
+/*
+ * fork conf.workers workers and supervise them. returns only in a
+ * worker, with the worker's number.
+ */
+int prefork_run(void) {
+    sigset_t mask, old;
+    int i;
+
+    nworkers = conf.workers;
+    workers = Calloc(nworkers, sizeof(WORKER));
+    /* signals only arrive in sigsuspend(), between two checks */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, &old);
+    Signal(SIGCHLD, master_handler);
+    Signal(SIGUSR1, master_handler);
+    Signal(SIGTERM, master_handler);
+    Signal(SIGINT, master_handler);
+
+    for (i = 0; i < nworkers; i++) {
+        if (spawn(i, &old)) {
+            return i;
+        }
+    }
+    while (1) {
+        sigsuspend(&old);
+        if (got_term) {
+            shutdown_workers();
+            exit(0);
+        }
+        if (got_usr1) {
+            got_usr1 = 0;
+            for (i = 0; i < nworkers; i++) {
+                kill(workers[i].pid, SIGUSR1);
+            }
+            fprintf(stderr, "workers: %d, %lu restarts\n", nworkers,
+                    restarts);
+            shm_cache_report(stderr);
+        }
+        if (got_chld) {
+            got_chld = 0;
+            if ((i = reap(&old)) >= 0) {
+                return i;
+            }
+        }
+    }
+}
@@ -0,0 +1,14 @@
+/*
+ * pre-forked worker processes for proxy.c
+ */
+
+#ifndef __PREFORK_H__
+#define __PREFORK_H__
+
+/* a worker that lived less than this (ms) is restarted after a pause */
+#define PREFORK_MIN_LIFE_MS 1000
+#define PREFORK_PAUSE_MS 100
+
+int prefork_run(void);
+
+#endif /* __PREFORK_H__ */
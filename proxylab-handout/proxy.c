@@ -10,109 +10,316 @@
  * provide feedback from server to client. The feedback 
  * is stored in the LRU cache generated with linked list.  
  * 
+ * Cached objects that are stale, or hot and about to expire, are
+ * still served from the cache and refetched by a pool of refresh
+ * threads (refresh.c), so no client waits on the origin for them.
+ * Tunables are given as key=value after the port (config.c), and
+ * SIGUSR1 prints the counters to stderr.
+ *
+ * Requests with a Range header are answered with 206 partial
+ * content straight from the cached bytes; ranged (206) responses
+ * from the origin are never cached.
+ *
+ * "PURGE <uri>" drops one cached uri and "PURGE <prefix>*" every
+ * uri under a host or path prefix such as http://host/img/
+ *
+ * Origins that cannot be resolved or reached, and uris that get a
+ * 5xx, are answered from a small negative cache (negcache.c) for
+ * conf.neg_ttl seconds instead of being retried by every request.
+ *
+ * Counters and per-phase latency histograms (stats.c) are served
+ * to local clients as text on "GET /stats" sent to the proxy.
+ * Requests slower than conf.trace_slow_ms are printed to stderr
+ * with the time each phase took (trace.c). Every request gets a
+ * line in the access log (accesslog.c) when access_log= is given.
+ *
+ * With acceptors=N the port is opened N times with SO_REUSEPORT and
+ * each socket has its own accept thread (acceptor.c), optionally
+ * pinned to a CPU with acceptor_pin=1. numa=1 binds the acceptors,
+ * and the connection threads they start, to NUMA nodes in turn so
+ * cache memory is filled on the node that serves the connection.
+ *
+ * max_conns= and max_inflight= bound the load (admit.c); over them
+ * clients get a 503 right away, and misses are shed before hits.
+ * client_rate= and origin_rate= put a token bucket on every client
+ * IP and every origin (ratelimit.c).
+ *
+ * As a reverse proxy, pools= maps virtual hosts to pools of backends
+ * (pool.c). Requests for them, by Host header or absolute uri, go to
+ * a backend picked round robin, by fewest outstanding requests or by
+ * a consistent hash of the uri, and are cached as usual. Backends
+ * that keep failing are ejected for a while, or until a prober thread
+ * finds them up again (probe_ms=).
+ *
+ * Connections that sit idle before their request line, or whose reads
+ * or writes block past a deadline, are shut down by a timer wheel
+ * thread (timeout.c) and counted as reaped.
+ *
+ * The large buffers of a request come from a pool (bufpool.c) when
+ * the request needs them, not from the stack, so connection threads
+ * run on stacks of thread_stack_kb.
+ *
+ * The cache key of a request is its canonical uri (host case, default
+ * port and query order do not matter), and responses with Vary are
+ * cached per value of the headers they vary on. The client's
+ * Accept-Encoding is passed on to the origin.
+ *
+ * Origins are asked in HTTP/1.1. Chunked responses are decoded as
+ * they stream in (http.c), cached plain with a Content-Length, and
+ * passed on chunked to HTTP/1.1 clients and plain to HTTP/1.0 ones.
+ *
+ * Methods other than GET are passed through: the request body, by
+ * Content-Length or chunked, is streamed to the origin a block at a
+ * time and the response is never cached. A HEAD response has no body
+ * whatever its head says. A POST, PUT, PATCH or DELETE that went
+ * through drops the cached GET of the uri.
+ *
+ * "CONNECT host:443" opens a tunnel; once the origin is connected
+ * both sockets are relayed by an epoll thread (tunnel.c) and the
+ * connection thread is done, so idle tunnels hold no thread.
+ *
+ * The cache budget is cache_max_bytes=. With cache_auto=1 it follows
+ * the memory there is (memctl.c): it grows while the proxy, its
+ * cgroup or the host is under mem_target_pct of its memory, and
+ * shrinks, evicting a batch at a time, when it is over or memory
+ * pressure builds up, so the cache uses what it can without the
+ * proxy getting OOM-killed.
+ *
+ * With workers=N the proxy pre-forks N worker processes (prefork.c)
+ * that each accept on the port, and a master that restarts any that
+ * die. Next to its own cache, every worker uses a cache in shared
+ * memory (shmcache.c): a miss in its own cache is looked up there
+ * before the origin is asked, and what comes from an origin is stored
+ * in both, so a restarted worker still gets hits. A PURGE or a write
+ * drops the uri from the shared cache and is logged there, and every
+ * worker drops it from its own cache before its next lookup.
+ * Each worker writes its own access log, access_log.w<n>.
+ *
  */
 
 
 #include <stdio.h>
 #include "csapp.h"
 #include "cache.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#include "config.h"
+#include "refresh.h"
+#include "http.h"
+#include "negcache.h"
+#include "stats.h"
+#include "trace.h"
+#include "accesslog.h"
+#include "acceptor.h"
+#include "affinity.h"
+#include "admit.h"
+#include "ratelimit.h"
+#include "pool.h"
+#include "timeout.h"
+#include "bufpool.h"
+#include "tunnel.h"
+#include "memctl.h"
+#include "shmcache.h"
+#include "prefork.h"
 
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *accept_hdr = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
-static const char *accept_encoding_hdr = "Accept-Encoding: gzip, deflate\r\n";
 static const char *host_hdr = "Host: %s\r\n";
 static const char *connection_hdr = "Connection: close\r\n";
 static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
 
+/* the buffers of one request, taken from the buffer pool (bufpool.c) */
+typedef struct REQ {
+    rio_t rio;
+    char request[MAXLINE];
+    char uri[MAXLINE];
+    char host[MAXLINE];
+    char append[MAXLINE];
+    char header_server[MAXLINE];
+    char client_hdrs[MAXLINE];
+    char key[MAXLINE];       /* the canonical uri, the cache key */
+} REQ;
+
+/* the body of a request other than GET, streamed to the origin */
+typedef struct REQ_BODY {
+    rio_t *rio;              /* the client's */
+    long length;             /* Content-Length, 0 for no body */
+    int chunked;             /* Transfer-Encoding: chunked instead */
+    int expect;              /* the client waits for a 100 Continue */
+    int head;                /* a HEAD, whose response has no body */
+    int unsafe;              /* a write that makes the cached GET stale */
+} REQ_BODY;
+
+/* blocks request bodies are relayed in */
+#define BODY_BLOCK 65536
+
+/* the buffers fetch_origin() needs, only taken on a miss */
+typedef struct FETCH_BUF {
+    rio_t rio;
+    char buf[MAXBUF];
+    char head[MAXBUF];
+    char plain[MAXBUF + 64];  /* the head rewritten for a de-chunked body */
+} FETCH_BUF;
+
 /* major functions */
-void assemble_header(rio_t *client_riop, char *header_buf,char *host, char *append);
+int  assemble_header(rio_t *client_riop, char *header_buf, char *method,
+                     char *host, char *append, char *client_hdrs);
 int  parse_uri(char *uri, char *host, char *append);
 void error_msg(int fd, char *cause, char *num, char *bmsg, char *dmsg);
+int  error_page(char *buf, char *cause, char *num, char *bmsg, char *dmsg);
 void *thread_wrapper(void *varptr);
-void thread_pro(int connfd_client);
-void adjust_cache(CACHE *cache, char *uri, int connfd_client);
+void thread_pro(int connfd_client, REQ *req);
+void purge(int fd, rio_t *rio, char *uri);
+void connect_tunnel(int fd, rio_t *rio, char *target);
+void stats_page(int fd, rio_t *rio);
+int  local_client(int fd);
+void client_ip(int fd, char *buf);
+int  rate_wait(int kind, char *key);
+unsigned long phase_end(int phase, unsigned long since);
+int  origin_connect(char *host, int port);
+int  fetch_origin(char *uri, char *host, int port, char *header_server,
+                  REQ_BODY *body, int connfd_client, int client_chunked);
+int  fetch_upstream(char *uri, char *host, int port, char *header_server,
+                    REQ_BODY *body, int connfd_client, int client_chunked);
+void body_framing(char *method, char *client_hdrs, rio_t *rio,
+                  REQ_BODY *body);
+int  send_body(REQ_BODY *body, int server_fd);
+int  vhost_uri(char *client_hdrs, char *uri);
+void relay(int *fdp, char *buf, int len);
+long response_ttl(char *head, int head_len);
+int  response_complete(char *head, int head_len, unsigned long body_size);
+int  response_compressible(char *head, int head_len);
+int  refresh_uri(char *uri);
+void *report_thread(void *varptr);
+void adjust_cache(CACHE *cache, CACHE_B *cached_object, int connfd_client,
+                  char *client_hdrs, char *version);
+void send_ranges(int fd, CACHE_B *cached_object, HTTP_RANGE *ranges, int n,
+                 char *version);
 void get_header(char *header, char *key);
+CACHE_B *shared_lookup(char *key, char *hdrs, int *state);
 
 CACHE *cache;
 
 int main(int argc, char **argv) {
-    int listenfd, *connfdp, port_client;
-    struct sockaddr_in client_addr;
-    socklen_t client_length = sizeof(client_addr);
-    pthread_t thread_id;	
+    int port_client, worker;
+    pthread_t thread_id;
+    static sigset_t report_mask;
+    static char log_name[MAXLINE];
 
-    cache = cache_init();
-
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <port> [key=value ...]\n", argv[0]);
+        conf_usage(stderr);
         exit(0);
     }
-
+    if (conf_parse(argc - 2, argv + 2) < 0) {
+        conf_usage(stderr);
+        exit(1);
+    }
     port_client = atoi(argv[1]);
-    Signal(SIGPIPE, SIG_IGN);
 
-    if ((listenfd = Open_listenfd(port_client)) < 0) {
-        fprintf(stderr, "Error: open_listenfd\n");
-        exit(0);
+    /* the master stays in prefork_run(), the workers go on from here */
+    if (conf.workers > 0) {
+        if (shm_cache_init(port_client) < 0) {
+            exit(1);
+        }
+        worker = prefork_run();
+        /* each worker writes and rotates a log of its own */
+        if (conf.access_log != NULL) {
+            snprintf(log_name, MAXLINE, "%s.w%d", conf.access_log, worker);
+            conf.access_log = log_name;
+        }
     }
 
-    while (1) {
-        connfdp = Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *) &client_addr, &client_length);
-        Pthread_create(&thread_id, NULL, thread_wrapper, connfdp);
+    node_init();
+    stats_init();
+    buf_init();
+    cache = cache_init();
+    neg_init();
+    rl_init();
+    if (pool_init(conf.pools) < 0) {
+        exit(1);
     }
 
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* every thread inherits the mask, only report_thread takes SIGUSR1 */
+    sigemptyset(&report_mask);
+    sigaddset(&report_mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &report_mask, NULL);
+    Pthread_create(&thread_id, NULL, report_thread, &report_mask);
+
+    refresh_init(conf.refresh_threads, conf.refresh_queue, refresh_uri);
+    trace_init();
+    alog_init();
+    pool_probe_init();
+    timeout_init();
+    tunnel_init();
+    memctl_init(cache);
+
+    /* the acceptors inherit the mask as well */
+    acceptor_run(port_client, thread_wrapper);
+
     return 0;
 }
 
 /* 
  * get information from client's request and 
- * forward to the serve with a reassembled one
+ * forward to the serve with a reassembled one.
+ * every header line the client sent is kept in client_hdrs.
+ * rioptr is NULL for requests made by the proxy itself.
+ * returns -1 if a Content-Length or Transfer-Encoding line did not
+ * fit, the body must not be sent without its framing.
  */
-void assemble_header(rio_t *rioptr, char *headerbuf, char *host, char *append) {
-    char hostbuf[MAXLINE], requestbuf[MAXLINE], 
-         extrbuf[MAXLINE],      index[MAXLINE],
-	                  tempHeadbuf[MAXLINE];
+int assemble_header(rio_t *rioptr, char *headerbuf, char *method,
+                    char *host, char *append, char *client_hdrs) {
+    char *hostbuf = buf_get(5 * MAXLINE), *requestbuf = hostbuf + MAXLINE,
+         *extrbuf = requestbuf + MAXLINE, *index = extrbuf + MAXLINE,
+         *tempHeadbuf = index + MAXLINE;
+    int framing, dropped = 0;
 
-    Rio_readlineb(rioptr, requestbuf, MAXLINE);
+    sprintf(hostbuf, host_hdr, host);
+    extrbuf[0] = '\0';
+    client_hdrs[0] = '\0';
 
-    while (strcmp(requestbuf, "\r\n")) {
-        sprintf(hostbuf, host_hdr, host);
+    while (rioptr && rio_readlineb(rioptr, requestbuf, MAXLINE) > 0 &&
+           strcmp(requestbuf, "\r\n")) {
         get_header(requestbuf, index);
+        framing = !strcasecmp(index, "Content-Length") ||
+                  !strcasecmp(index, "Transfer-Encoding");
+        if (strlen(client_hdrs) + strlen(requestbuf) < MAXLINE) {
+            strcat(client_hdrs, requestbuf);
+        }
+        else {
+            dropped |= framing;
+        }
         if (!strcmp(index, "Host")) {
-            memset(hostbuf, 0, strlen(hostbuf));
             strcpy(hostbuf, requestbuf);
         }
         else if (strcmp(index, "User-Agent"       ) &&
                  strcmp(index, "Accept"           ) &&
-                 strcmp(index, "Accept-Encoding"  ) &&
                  strcmp(index, "Connection"       ) &&
-                 strcmp(index, "Proxy-Connection")) {
-            strcpy(extrbuf, requestbuf);
-        }
-
-    if (Rio_readlineb(rioptr, requestbuf, MAXLINE) < 0) {
-            break;
+                 strcmp(index, "Proxy-Connection") &&
+                 strcmp(index, "Expect"           )) {
+            if (strlen(extrbuf) + strlen(requestbuf) < MAXLINE / 2) {
+                strcat(extrbuf, requestbuf);
+            }
+            else {
+                dropped |= framing;
+            }
         }
     }
    	
-    sprintf(tempHeadbuf, "GET %s HTTP/1.0\r\n", append);
+    sprintf(tempHeadbuf, "%s %s HTTP/1.1\r\n", method, append);
     strcat(headerbuf, tempHeadbuf         );
     strcat(headerbuf, hostbuf             );
     strcat(headerbuf, user_agent_hdr      );
     strcat(headerbuf, accept_hdr          );
-    strcat(headerbuf, accept_encoding_hdr );
     strcat(headerbuf, connection_hdr      );
     strcat(headerbuf, proxy_connection_hdr);
-    strcat(headerbuf, "\r\n"              );
     strcat(headerbuf, extrbuf             );
+    strcat(headerbuf, "\r\n"              );
 
-    return;
+    buf_put(hostbuf);
+    return dropped ? -1 : 0;
 }   
 
 /*
@@ -130,15 +337,20 @@ int parse_uri(char *uri, char *host, char *append) {
         uri_buf_ptr += 7;
     }
 
-    while (*uri_buf_ptr != ':' && *uri_buf_ptr != '/') {
+    while (*uri_buf_ptr != ':' && *uri_buf_ptr != '/' &&
+           *uri_buf_ptr != '\0') {
         *host++ = *uri_buf_ptr++;
     }
 
     *host = '\0';
-    if (*uri_buf_ptr == '/') {
+    if (*uri_buf_ptr != ':') {
+        if (*uri_buf_ptr == '\0') {
+            *append++ = '/';
+        }
         while (*uri_buf_ptr != '\0') {
             *append++ = *uri_buf_ptr++;
         }
+        *append = '\0';
         portnum = 80;
     }
 
@@ -146,16 +358,14 @@ int parse_uri(char *uri, char *host, char *append) {
         uri_buf_ptr++;
 	// point to the start of port
         port_index = uri_buf_ptr;
-        while (*uri_buf_ptr != '/') {
+        while (*uri_buf_ptr != '/' && *uri_buf_ptr != '\0') {
             uri_buf_ptr++;
         }
-        *uri_buf_ptr = '\0';
-	// get port 
-        strcpy(port_buf, port_index);
-        *uri_buf_ptr = '/';
+        strncpy(port_buf, port_index, uri_buf_ptr - port_index);
+        port_buf[uri_buf_ptr - port_index] = '\0';
 	// convert to integer
         portnum = atoi(port_buf);
-        strcpy(append, uri_buf_ptr);
+        strcpy(append, *uri_buf_ptr ? uri_buf_ptr : "/");
     }
     return portnum;
 }
@@ -164,22 +374,33 @@ int parse_uri(char *uri, char *host, char *append) {
  * print error message on client page
  */
 void error_msg(int fd, char *cause, char *num, char *bmsg, char *dmsg) {
-    char buf[MAXLINE], body[MAXBUF];
+    char buf[MAXBUF];
+    int len = error_page(buf, cause, num, bmsg, dmsg);
+
+    alog_status(atoi(num));
+    if (rio_writen(fd, buf, len) >= 0) {
+        alog_bytes(len);
+    }
+}
+
+/*
+ * build the whole error response into buf (MAXBUF bytes),
+ * returns its length
+ */
+int error_page(char *buf, char *cause, char *num, char *bmsg, char *dmsg) {
+    char body[MAXBUF];
+    int len;
+
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, num, bmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, dmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", num, bmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    len = snprintf(body, MAXBUF, "<html><title>Proxy Error</title>"
+                   "<body bgcolor=""ffffff"">\r\n%s: %s\r\n"
+                   "<p>%s: %.*s\r\n<hr><em>The Tiny Web server</em>\r\n",
+                   num, bmsg, dmsg, MAXLINE, cause);
+
+    /* and the HTTP response around it */
+    return snprintf(buf, MAXBUF, "HTTP/1.0 %s %s\r\n"
+                    "Content-type: text/html\r\n"
+                    "Content-length: %d\r\n\r\n%s", num, bmsg, len, body);
 }
 
 /*
@@ -187,85 +408,972 @@ void error_msg(int fd, char *cause, char *num, char *bmsg, char *dmsg) {
  */
 void *thread_wrapper(void *varptr) {
     int connfd_client = *((int *)varptr);
+    REQ *req;
+    unsigned long start = stats_now_us();
     Pthread_detach(pthread_self());
     Free(varptr);
-    thread_pro(connfd_client);
+    req = buf_get(sizeof(REQ));
+    thread_pro(connfd_client, req);
+    buf_put(req);
+    alog_end(stats_now_us() - start);
+    timeout_disarm(TIMER_CLIENT);
     Close(connfd_client);
+    admit_conn_end();
     return NULL;
 }
 
 /*
- * major client-server interaction process
+ * major client-server interaction process, with the buffers in req
  */ 
-void thread_pro(int connfd_client) {
-    char client_request[MAXLINE], method[MAXLINE], 
-	 uri[MAXLINE], version[MAXLINE];
-    rio_t rio_client;
+void thread_pro(int connfd_client, REQ *req) {
+    char *client_request = req->request, method[16], *uri = req->uri,
+         version[16];
+    char *host = req->host, *append = req->append,
+         *header_server = req->header_server,
+         *client_hdrs = req->client_hdrs, *key = req->key, *origin_key,
+         *page,
+         client[INET6_ADDRSTRLEN];
+    rio_t *rio_client = &req->rio;
+    CACHE_B *cached_object;
+    REQ_BODY body;
+    int server_port, state, status, len, admitted, pooled, pass;
+    int how = TRACE_MISS;
+    unsigned long start = stats_now_us(), t;
+
     //get request from client
-    Rio_readinitb(&rio_client, connfd_client);
-    if (Rio_readlineb(&rio_client, client_request, MAXLINE) < 0) {
-        Close(connfd_client);
-        unix_error("Rio_readn ECONNRESET error");
-    }
-    sscanf(client_request, "%s %s %s", method, uri, version);
-    //check if the method is get
-    if (strcmp(method, "GET") != 0) {
-        error_msg(connfd_client, method, "501", "Invalid Implement",
-                    "The method is not supported in proxy.");
+    trace_begin();
+    Rio_readinitb(rio_client, connfd_client);
+    timeout_arm(TIMER_CLIENT, connfd_client, TO_IDLE);
+    if (rio_readlineb(rio_client, client_request, MAXLINE) <= 0) {
+        timeout_note(TIMER_CLIENT);
+        return;
+    }
+    timeout_arm(TIMER_CLIENT, connfd_client, TO_READ);
+    if (sscanf(client_request, "%15s %s %15s", method, uri, version) != 3) {
+        error_msg(connfd_client, client_request, "400", "Bad Request",
+                    "The request line could not be parsed.");
+        return;
+    }
+    client_ip(connfd_client, client);
+    alog_request(client, method, uri);
+    if (rate_wait(RL_CLIENT, client) < 0) {
+        error_msg(connfd_client, client, "429", "Too Many Requests",
+                    "This client is over its request rate.");
+        return;
+    }
+    if (!strcmp(method, "PURGE")) {
+        purge(connfd_client, rio_client, uri);
         return;
     }
+    if (!strcmp(method, "GET") && !strcmp(uri, STATS_URI)) {
+        stats_page(connfd_client, rio_client);
+        return;
+    }
+    if (!strcmp(method, "CONNECT")) {
+        connect_tunnel(connfd_client, rio_client, uri);
+        return;
+    }
+    /* anything but GET streams through to the origin, uncached */
+    pass = strcmp(method, "GET") != 0;
 
-    if (cache_check(cache, uri)) {
-        adjust_cache(cache, uri, connfd_client);
+    header_server[0] = '\0';
+    if (uri[0] == '/') {
+        /* origin form: a reverse proxy request for the Host header */
+        if (assemble_header(rio_client, header_server, method, "", uri,
+                            client_hdrs) < 0) {
+            error_msg(connfd_client, uri, "431",
+                      "Request Header Fields Too Large",
+                      "The headers are too long to pass on.");
+            return;
+        }
+        if (vhost_uri(client_hdrs, uri) < 0) {
+            error_msg(connfd_client, uri, "404", "Not Found",
+                        "No backend pool serves this host.");
+            return;
+        }
+        server_port = parse_uri(uri, host, append);
     }
-   
     else {
-        printf("Cache not hit\n");
-        char host[MAXLINE], append[MAXLINE];
-        int server_port = parse_uri(uri, host, append);
+        server_port = parse_uri(uri, host, append);
         if (((server_port < 1000) || (server_port > 65535))
-        			  && (server_port != 80)) {
-            printf("Invalid port number (out of range).\n");
-            exit(0);
-        }
-	int server_fd = open_clientfd_r(host, server_port);
-        if ( server_fd  < 0) {
-            error_msg(connfd_client, "GET", "999", "connection error",
-                        "unable to make connection to server");
-            Close(connfd_client);
+                                  && (server_port != 80)) {
+            error_msg(connfd_client, uri, "400", "Bad Request",
+                        "Invalid port number (out of range).");
             return;
         }
-	rio_t rio_server;
-	char header_server[MAXLINE];
-        assemble_header(&rio_client, header_server, host, append);
-        if (rio_writen(server_fd, header_server, strlen(header_server)) < 0) {
-            if (errno == EPIPE) {
-                printf("error: unable to send data to server\n");
-                Close(server_fd);
-                return;
-            }
+        if (assemble_header(rio_client, header_server, method, host,
+                            append, client_hdrs) < 0) {
+            error_msg(connfd_client, uri, "431",
+                      "Request Header Fields Too Large",
+                      "The headers are too long to pass on.");
+            return;
         }
-	Rio_readinitb(&rio_server, server_fd);
-        int size = 0;
-	int length = 0;
-        char add_buf[MAXLINE];
-	char object[MAX_OBJECT_SIZE];
-        while ((length = Rio_readlineb(&rio_server, add_buf, MAXLINE)) != 0) {
-            if (size + length <= MAX_OBJECT_SIZE) {
-                memcpy(object + size, add_buf, length);
-                size += length;
+    }
+    if (pass) {
+        body_framing(method, client_hdrs, rio_client, &body);
+    }
+    /* one key for every spelling of the uri */
+    if (http_canonical_uri(uri, key, MAXLINE) < 0) {
+        strcpy(key, uri);
+    }
+    /* the whole request is in; each write below has its own deadline */
+    timeout_disarm(TIMER_CLIENT);
+    stats_add(STAT_REQUESTS, 1);
+    t = phase_end(STAT_PH_READ, start);
+
+    /* purges made by other workers reach this one's cache first */
+    shm_cache_sync(cache);
+    cached_object = pass ? NULL :
+                    cache_lookup(cache, key, header_server, &state);
+    if (cached_object == NULL && !pass) {
+        cached_object = shared_lookup(key, header_server, &state);
+    }
+    t = phase_end(STAT_PH_LOOKUP, t);
+    /* misses are shed before hits, and before any upstream work */
+    if (!(admitted = admit_request(cached_object != NULL))) {
+        if (cached_object != NULL) {
+            cache_release(cache, cached_object);
+        }
+        alog_status(503);
+        if ((len = admit_reject(connfd_client)) > 0) {
+            alog_bytes(len);
+        }
+        alog_result("shed");
+        how = TRACE_ERROR;
+    }
+    else if (cached_object != NULL) {
+        /* the id of a variant says which headers to refresh it with */
+        if (state == CACHE_REFRESH &&
+            refresh_submit(cached_object->id) < 0) {
+            cache_refresh_failed(cache, cached_object->id);
+        }
+        /* hits are at most object_max_bytes, one deadline covers them */
+        timeout_arm(TIMER_CLIENT, connfd_client, TO_WRITE);
+        adjust_cache(cache, cached_object, connfd_client, client_hdrs,
+                     version);
+        timeout_disarm(TIMER_CLIENT);
+        phase_end(STAT_PH_TRANSFER, t);
+        how = TRACE_HIT;
+        alog_result(state == CACHE_REFRESH ? "refresh" : "hit");
+    }
+    else {
+        origin_key = buf_get(MAXLINE);
+        snprintf(origin_key, MAXLINE, "origin %.*s:%d", MAXLINE / 2, host,
+                 server_port);
+        /* a pool has many backends, one failing says nothing of it */
+        pooled = pool_find(host) != NULL;
+        if ((!pass && (status = neg_serve(key, connfd_client)) > 0) ||
+            (!pooled &&
+             (status = neg_serve(origin_key, connfd_client)) > 0)) {
+            alog_status(status);
+            alog_result("negative");
+            how = TRACE_ERROR;
+        }
+        else if (rate_wait(RL_ORIGIN, origin_key) < 0) {
+            error_msg(connfd_client, host, "503", "Service Unavailable",
+                        "The origin is over its request rate.");
+            alog_result("limited");
+            how = TRACE_ERROR;
+        }
+        else if ((status = fetch_upstream(key, host, server_port,
+                                          header_server,
+                                          pass ? &body : NULL, connfd_client,
+                                          !strcmp(version, "HTTP/1.1"))) == -4) {
+            /* the client stopped sending, or the origin taking, the body */
+            alog_result("error");
+            how = TRACE_ERROR;
+        }
+        else if (status < 0) {
+            page = buf_get(MAXBUF);
+            len = error_page(page, host, "502", "Bad Gateway",
+                             status == -2 ?
+                             "The origin host could not be resolved" :
+                             status == -3 ?
+                             "The origin sent no response" :
+                             "Unable to make connection to the origin");
+            alog_status(502);
+            if (rio_writen(connfd_client, page, len) >= 0) {
+                alog_bytes(len);
+            }
+            /* an origin that went silent may only be slow on this uri */
+            if (status == -3) {
+                if (!pass) {
+                    neg_insert(key, page, len, conf.neg_ttl * 1000);
+                }
             }
-            if (rio_writen(connfd_client, add_buf, length) < 0) {
-                printf("error: unable to send data to client\n");
+            else if (!pooled) {
+                neg_insert(origin_key, page, len, conf.neg_ttl * 1000);
             }
-            memset(add_buf, 0, strlen(add_buf));
+            buf_put(page);
+            alog_result("error");
+            how = TRACE_ERROR;
+        }
+        else {
+            alog_result(pass ? "pass" : "miss");
+        }
+        buf_put(origin_key);
+    }
+    if (admitted) {
+        admit_request_end();
+    }
+    t = stats_now_us() - start;
+    stats_record(STAT_PH_TOTAL, t);
+    trace_end(uri, how, t);
+}
+
+/* end a phase begun at since, in the stats and in the trace */
+unsigned long phase_end(int phase, unsigned long since) {
+    unsigned long now = stats_now_us();
+
+    stats_record(phase, now - since);
+    trace_phase(phase, now - since);
+    return now;
+}
+
+/*
+ * connect to the origin, resolving and connecting as two phases
+ * returns the socket, -2 if the host could not be resolved and -1
+ * if it could not be reached
+ */
+int origin_connect(char *host, int port) {
+    struct addrinfo *addlist;
+    char port_str[16];
+    unsigned long t = stats_now_us();
+    int fd;
+
+    sprintf(port_str, "%d", port);
+    if (getaddrinfo(host, port_str, NULL, &addlist) != 0) {
+        return -2;
+    }
+    t = phase_end(STAT_PH_DNS, t);
+    fd = connect_addrinfo(addlist);
+    freeaddrinfo(addlist);
+    if (fd >= 0) {
+        phase_end(STAT_PH_CONNECT, t);
+    }
+    return fd;
+}
+
+/* tell whether the peer of fd is on the loopback interface */
+int local_client(int fd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    return getpeername(fd, (SA *)&addr, &addr_len) == 0 &&
+           addr.sin_family == AF_INET &&
+           (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+}
+
+/* the address of the peer of fd as text, "-" if it is unknown */
+void client_ip(int fd, char *buf) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    void *in;
+
+    strcpy(buf, "-");
+    if (getpeername(fd, (SA *)&addr, &addr_len) < 0) {
+        return;
+    }
+    in = addr.ss_family == AF_INET6 ?
+         (void *)&((struct sockaddr_in6 *)&addr)->sin6_addr :
+         (void *)&((struct sockaddr_in *)&addr)->sin_addr;
+    inet_ntop(addr.ss_family, in, buf, INET6_ADDRSTRLEN);
+}
+
+/*
+ * take a token from the rate limit of key, sleeping first if the
+ * request was queued behind others
+ * returns 0 to go on, -1 if the request is over the limit
+ */
+int rate_wait(int kind, char *key) {
+    long wait = rl_acquire(kind, key);
+
+    if (wait > 0) {
+        usleep(wait);
+    }
+    return wait < 0 ? -1 : 0;
+}
+
+/* answer "GET /stats" from a local client with every counter */
+void stats_page(int fd, rio_t *rio) {
+    char buf[MAXLINE], *body;
+    int len, size = 4 * MAXBUF;
+
+    while (rio_readlineb(rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+        ;
+    if (!local_client(fd)) {
+        error_msg(fd, STATS_URI, "403", "Forbidden",
+                    "Only local clients may read the statistics.");
+        return;
+    }
+    body = Malloc(size);
+    len = stats_format(body, size);
+    len += admit_format(body + len, size - len);
+    sprintf(buf, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+            "version=0.0.4\r\nContent-Length: %d\r\n\r\n", len);
+    alog_status(200);
+    if (rio_writen(fd, buf, strlen(buf)) >= 0 &&
+        rio_writen(fd, body, len) >= 0) {
+        alog_bytes(strlen(buf) + len);
+    }
+    Free(body);
+}
+
+/*
+ * answer a PURGE request: uri is dropped from the cache, or every
+ * uri under it when it ends in '*'. only clients on the loopback
+ * interface may purge unless conf.purge_any is set.
+ */
+void purge(int fd, rio_t *rio, char *uri) {
+    char buf[MAXLINE], key[MAXLINE], body[32];
+    int n, len = strlen(uri);
+
+    /* the headers carry nothing we need */
+    while (rio_readlineb(rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+        ;
+    if (!conf.purge_any && !local_client(fd)) {
+        error_msg(fd, uri, "403", "Forbidden",
+                    "Only local clients may purge the cache.");
+        return;
+    }
+    if (len > 0 && uri[len - 1] == '*') {
+        uri[len - 1] = '\0';
+        /* keys are canonical uris, and so is the prefix */
+        if (http_canonical_uri(uri, key, MAXLINE) < 0) {
+            strcpy(key, uri);
         }
-        if (size <= MAX_OBJECT_SIZE) {
-            cache_update(cache, uri, object, size);
+        n = cache_purge_prefix(cache, key) + shm_cache_purge_prefix(key);
+    }
+    else {
+        if (http_canonical_uri(uri, key, MAXLINE) < 0) {
+            strcpy(key, uri);
+        }
+        n = cache_purge(cache, key) + shm_cache_purge(key);
+    }
+    len = snprintf(body, sizeof(body), "purged %d\n", n);
+    snprintf(buf, MAXLINE, "HTTP/1.0 %s\r\nContent-Type: text/plain\r\n"
+             "Content-Length: %d\r\n\r\n",
+             n ? "200 OK" : "404 Not Found", len);
+    alog_status(n ? 200 : 404);
+    if (rio_writen(fd, buf, strlen(buf)) >= 0 &&
+        rio_writen(fd, body, len) >= 0) {
+        alog_bytes(strlen(buf) + len);
+    }
+}
+
+/*
+ * answer "CONNECT host:port" by connecting to it and handing the
+ * client and origin sockets to a relay thread (tunnel.c). fd stays
+ * the caller's to close, the tunnel gets a copy of it.
+ */
+void connect_tunnel(int fd, rio_t *rio, char *target) {
+    static char established[] =
+        "HTTP/1.1 200 Connection established\r\n\r\n";
+    char buf[MAXLINE], *host = target, *colon, *head[2];
+    int port, server_fd, client_fd, len[2];
+
+    while (rio_readlineb(rio, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+        ;
+    timeout_disarm(TIMER_CLIENT);
+    if (conf.tunnel_threads == 0) {
+        error_msg(fd, "CONNECT", "501", "Invalid Implement",
+                    "The method is not supported in proxy.");
+        return;
+    }
+    if ((colon = strrchr(target, ':')) == NULL ||
+        (port = atoi(colon + 1)) <= 0 || port > 65535) {
+        error_msg(fd, target, "400", "Bad Request",
+                    "CONNECT needs a host:port.");
+        return;
+    }
+    if (port != 443 && !conf.connect_any_port) {
+        error_msg(fd, target, "403", "Forbidden",
+                    "Tunnels may only go to port 443.");
+        return;
+    }
+    *colon = '\0';
+    /* [v6 address] */
+    if (host[0] == '[' && colon[-1] == ']') {
+        host++;
+        colon[-1] = '\0';
+    }
+    snprintf(buf, MAXLINE, "origin %.*s:%d", MAXLINE / 2, host, port);
+    if (rate_wait(RL_ORIGIN, buf) < 0) {
+        error_msg(fd, host, "503", "Service Unavailable",
+                    "The origin is over its request rate.");
+        alog_result("limited");
+        return;
+    }
+    if ((server_fd = origin_connect(host, port)) < 0) {
+        error_msg(fd, host, "502", "Bad Gateway", server_fd == -2 ?
+                    "The origin host could not be resolved" :
+                    "Unable to make connection to the origin");
+        alog_result("error");
+        return;
+    }
+    /* what the client sent after its head, say a TLS hello, goes first */
+    head[0] = rio->rio_bufptr;
+    len[0] = rio->rio_cnt;
+    head[1] = established;
+    len[1] = strlen(established);
+    if ((client_fd = dup(fd)) < 0 ||
+        tunnel_add(client_fd, server_fd, head, len) < 0) {
+        if (client_fd >= 0) {
+            Close(client_fd);
+        }
+        Close(server_fd);
+        error_msg(fd, host, "503", "Service Unavailable",
+                    "Too many tunnels are open.");
+        alog_result("shed");
+        return;
+    }
+    alog_status(200);
+    alog_result("tunnel");
+}
+
+/*
+ * send the request to the origin and relay the response to
+ * connfd_client (-1 when nobody is waiting for it). A complete
+ * 200 response within conf.object_max_bytes is stored in the
+ * cache; its head is kept apart and its body is filled chunk by
+ * chunk while it streams through. A short complete 5xx response
+ * is kept in the negative cache under uri instead.
+ * A chunked body is decoded as it arrives, cached plain with a
+ * Content-Length, and sent on to the client chunked again when
+ * client_chunked is set (an HTTP/1.1 client), plain otherwise.
+ * body is NULL for a GET. For any other method it is the request
+ * body to stream to the origin; the response is not cached, it has
+ * no body after a HEAD, and a 2xx or 3xx one to a write drops the
+ * cached uri.
+ * returns -2 if the origin host could not be resolved, -1 if it
+ * could not be reached, -3 if it sent nothing back, -4 if the
+ * request body could not be relayed, 1 if the response was cached
+ * and 0 otherwise.
+ */
+int fetch_origin(char *uri, char *host, int port, char *header_server,
+                 REQ_BODY *body, int connfd_client, int client_chunked) {
+    FETCH_BUF *fb;
+    rio_t *rio_server;
+    char *add_buf, *head, *data, *out;
+    CACHE_FILL fill;
+    HTTP_CHUNKED chunks;
+    int server_fd, length, head_len, head_kept = 1;
+    int neg_len = -1, chunked = 0, done, complete = 0, out_len, status = 0;
+    long ttl_ms = -1;
+    unsigned long t;
+
+    if ((server_fd = origin_connect(host, port)) < 0) {
+        return server_fd;
+    }
+    fb = buf_get(sizeof(FETCH_BUF));
+    rio_server = &fb->rio;
+    add_buf = fb->buf;
+    head = fb->head;
+    /* room to frame what is read as a chunk without moving it */
+    data = add_buf + HTTP_CHUNK_ROOM;
+    t = stats_now_us();
+    timeout_arm(TIMER_ORIGIN, server_fd, TO_WRITE);
+    if (rio_writen(server_fd, header_server, strlen(header_server)) < 0) {
+        timeout_note(TIMER_ORIGIN);
+        timeout_disarm(TIMER_ORIGIN);
+        Close(server_fd);
+        buf_put(fb);
+        return -1;
+    }
+    timeout_disarm(TIMER_ORIGIN);
+    if (body != NULL && send_body(body, server_fd) < 0) {
+        Close(server_fd);
+        buf_put(fb);
+        return -4;
+    }
+    Rio_readinitb(rio_server, server_fd);
+
+    /* the status line and headers, line by line */
+    timeout_arm(TIMER_ORIGIN, server_fd, TO_READ);
+    do {
+        /* interim 1xx heads are dropped, the final one follows */
+        head_len = 0;
+        while ((length = rio_readlineb(rio_server, add_buf, MAXLINE)) > 0) {
+            if (head_len + length > MAXBUF) {
+                /* too long to keep, just relay it */
+                relay(&connfd_client, head, head_len);
+                head_len = 0;
+                head_kept = 0;
+            }
+            memcpy(head + head_len, add_buf, length);
+            head_len += length;
+            if (add_buf[0] == '\r' || add_buf[0] == '\n') {
+                break;
+            }
         }
+    } while (length > 0 && head_kept &&
+             http_parse_head(head, head_len, &status) >= 0 &&
+             status >= 100 && status < 200 && status != 101);
+    if (length < 0) {
+        timeout_note(TIMER_ORIGIN);
+    }
+    timeout_disarm(TIMER_ORIGIN);
+    if (head_len == 0) {
+        /* closed or failed before a byte of the response */
         Close(server_fd);
+        buf_put(fb);
+        return -3;
+    }
+    /* a head too long to keep is relayed as it is, and so is its body */
+    if (length > 0 && head_kept && http_is_chunked(head, head_len)) {
+        chunked = 1;
+        http_chunked_init(&chunks);
+    }
+    if (chunked && !client_chunked) {
+        relay(&connfd_client, fb->plain,
+              http_plain_head(fb->plain, head, head_len, -1));
+    }
+    else {
+        relay(&connfd_client, head, head_len);
+    }
+    t = phase_end(STAT_PH_FIRST_BYTE, t);
+    if (length > 0 && head_kept &&
+        http_parse_head(head, head_len, &status) >= 0) {
+        alog_status(status);
+        if (body == NULL) {
+            ttl_ms = response_ttl(head, head_len);
+            if (conf.neg_ttl > 0 && status >= 500) {
+                neg_len = head_len;
+            }
+        }
+        else if (body->unsafe && status >= 200 && status < 400) {
+            /* the write went through, what was cached is out of date */
+            cache_purge(cache, uri);
+            shm_cache_purge(uri);
+        }
+    }
+
+    /* the body, up to the connection closing or the last chunk */
+    cache_fill_init(&fill);
+    fill.compress = ttl_ms >= 0 && response_compressible(head, head_len);
+    /* whatever its Content-Length, a HEAD response ends with its head */
+    done = length <= 0 || (body != NULL && body->head);
+    while (!done) {
+        /* the deadline is per read, a slow client does not count */
+        timeout_arm(TIMER_ORIGIN, server_fd, TO_READ);
+        length = rio_readsomeb(rio_server, data,
+                               MAXBUF - HTTP_CHUNK_ROOM - 2);
+        if (length < 0) {
+            timeout_note(TIMER_ORIGIN);
+        }
+        timeout_disarm(TIMER_ORIGIN);
+        if (length <= 0) {
+            complete = length == 0 && !chunked;
+            break;
+        }
+        stats_add(STAT_BYTES_ORIGIN, length);
+        if (chunked) {
+            if ((length = http_chunked_decode(&chunks, data, length)) < 0) {
+                break;
+            }
+            done = complete = http_chunked_done(&chunks);
+        }
+        if (length == 0) {
+            continue;
+        }
+        if (ttl_ms >= 0) {
+            cache_fill_append(&fill, data, length);
+        }
+        if (neg_len >= 0) {
+            /* the error body goes right after its head */
+            if (neg_len + length <= MAXBUF) {
+                memcpy(head + neg_len, data, length);
+                neg_len += length;
+            }
+            else {
+                neg_len = -1;
+            }
+        }
+        out = data;
+        out_len = length;
+        if (chunked && client_chunked) {
+            out = http_chunk_wrap(data, &out_len);
+        }
+        relay(&connfd_client, out, out_len);
+    }
+    if (complete && chunked && client_chunked) {
+        out_len = 0;
+        out = http_chunk_wrap(data, &out_len);
+        relay(&connfd_client, out, out_len);
     }
-}                                                                                                   
+    Close(server_fd);
+    phase_end(STAT_PH_TRANSFER, t);
+    if (complete && neg_len >= 0 &&
+        response_complete(head, head_len, neg_len - head_len)) {
+        if (chunked) {
+            /* stored plain, with its length */
+            length = http_plain_head(fb->plain, head, head_len,
+                                     neg_len - head_len);
+            memcpy(fb->plain + length, head + head_len, neg_len - head_len);
+            neg_insert(uri, fb->plain, length + neg_len - head_len,
+                       conf.neg_ttl * 1000);
+        }
+        else {
+            neg_insert(uri, head, neg_len, conf.neg_ttl * 1000);
+        }
+    }
+    if (complete && ttl_ms >= 0 && !fill.too_big &&
+        response_complete(head, head_len, fill.size)) {
+        if (chunked) {
+            head_len = http_plain_head(fb->plain, head, head_len, fill.size);
+            head = fb->plain;
+        }
+        shm_cache_put(uri, head, head_len, &fill, ttl_ms);
+        cache_update(cache, uri, header_server, head, head_len, &fill,
+                     ttl_ms);
+        buf_put(fb);
+        return 1;
+    }
+    cache_fill_free(&fill);
+    buf_put(fb);
+    return 0;
+}
+
+/*
+ * find how the body of a request is framed from its headers, and
+ * what its method means for the response. a HEAD has no body.
+ */
+void body_framing(char *method, char *client_hdrs, rio_t *rio,
+                  REQ_BODY *body) {
+    char value[MAXLINE];
+    int len = strlen(client_hdrs);
+
+    body->rio = rio;
+    body->length = 0;
+    body->chunked = 0;
+    body->expect = 0;
+    body->head = !strcmp(method, "HEAD");
+    body->unsafe = !strcmp(method, "POST") || !strcmp(method, "PUT") ||
+                   !strcmp(method, "PATCH") || !strcmp(method, "DELETE");
+    if (body->head) {
+        return;
+    }
+    if (http_header_value(client_hdrs, len, "Transfer-Encoding",
+                          value, MAXLINE) >= 0) {
+        body->chunked = http_is_chunked(client_hdrs, len);
+    }
+    else if (http_header_value(client_hdrs, len, "Content-Length",
+                               value, MAXLINE) >= 0) {
+        body->length = strtol(value, NULL, 10);
+    }
+    body->expect = http_header_value(client_hdrs, len, "Expect",
+                                     value, MAXLINE) >= 0 &&
+                   !strcasecmp(value, "100-continue");
+}
+
+/*
+ * stream a request body from the client to server_fd in blocks of up
+ * to BODY_BLOCK, never holding more than one. a chunked body is
+ * decoded and framed again in chunks of our own.
+ * returns 0, or -1 if the client or the origin failed
+ */
+int send_body(REQ_BODY *body, int server_fd) {
+    static char go_on[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    char *buf, *data, *out;
+    HTTP_CHUNKED chunks;
+    long left = body->length;
+    /* room after the data for its CRLF and the last chunk */
+    int max = BODY_BLOCK - HTTP_CHUNK_ROOM - 7, n, out_len, rc = 0;
+    int client_fd = body->rio->rio_fd;
+
+    if (!body->chunked && left <= 0) {
+        return 0;
+    }
+    if (body->expect &&
+        rio_writen(client_fd, go_on, strlen(go_on)) < 0) {
+        return -1;
+    }
+    buf = buf_get(BODY_BLOCK);
+    data = buf + HTTP_CHUNK_ROOM;
+    http_chunked_init(&chunks);
+    while (body->chunked ? !http_chunked_done(&chunks) : left > 0) {
+        timeout_arm(TIMER_CLIENT, client_fd, TO_READ);
+        n = rio_readsomeb(body->rio, data,
+                          body->chunked || left > max ? max : left);
+        if (n < 0) {
+            timeout_note(TIMER_CLIENT);
+        }
+        timeout_disarm(TIMER_CLIENT);
+        if (n <= 0) {
+            rc = -1;
+            break;
+        }
+        if (body->chunked) {
+            if ((n = http_chunked_decode(&chunks, data, n)) < 0) {
+                rc = -1;
+                break;
+            }
+        }
+        else {
+            left -= n;
+        }
+        out = data;
+        out_len = n;
+        if (body->chunked) {
+            if (n > 0) {
+                out = http_chunk_wrap(data, &out_len);
+            }
+            if (http_chunked_done(&chunks)) {
+                /* the last chunk goes with the rest of the body */
+                memcpy(out + out_len, "0\r\n\r\n", 5);
+                out_len += 5;
+            }
+        }
+        if (out_len == 0) {
+            continue;
+        }
+        timeout_arm(TIMER_ORIGIN, server_fd, TO_WRITE);
+        if (rio_writen(server_fd, out, out_len) < 0) {
+            timeout_note(TIMER_ORIGIN);
+            rc = -1;
+        }
+        timeout_disarm(TIMER_ORIGIN);
+        if (rc < 0) {
+            break;
+        }
+    }
+    buf_put(buf);
+    return rc;
+}
+
+/*
+ * fetch uri from its origin, or in reverse proxy mode from a backend
+ * of the pool of its host. returns as fetch_origin()
+ */
+int fetch_upstream(char *uri, char *host, int port, char *header_server,
+                   REQ_BODY *body, int connfd_client, int client_chunked) {
+    POOL *pool = pool_find(host);
+    UPSTREAM *up;
+    int rc;
+
+    if (pool == NULL) {
+        return fetch_origin(uri, host, port, header_server, body,
+                            connfd_client, client_chunked);
+    }
+    up = pool_pick(pool, uri);
+    rc = fetch_origin(uri, up->host, up->port, header_server, body,
+                      connfd_client, client_chunked);
+    /* a body cut short is not held against the backend */
+    pool_done(up, rc >= 0 || rc == -4);
+    return rc;
+}
+
+/*
+ * turn the path uri of a reverse proxy request into the absolute uri
+ * http://<host><path>, host coming from the Host header of the client
+ * returns 0, or -1 if the host has no pool
+ */
+int vhost_uri(char *client_hdrs, char *uri) {
+    char host[MAXLINE], name[MAXLINE], path[MAXLINE];
+
+    if (http_header_value(client_hdrs, strlen(client_hdrs), "Host",
+                          host, MAXLINE) <= 0) {
+        return -1;
+    }
+    strcpy(name, host);
+    strtok(name, ":");
+    if (pool_find(name) == NULL) {
+        return -1;
+    }
+    strcpy(path, uri);
+    snprintf(uri, MAXLINE, "http://%.*s%.*s", MAXLINE / 4, host,
+             MAXLINE / 2, path);
+    return 0;
+}
+
+/* write to the client unless an earlier write to it failed */
+void relay(int *fdp, char *buf, int len) {
+    if (*fdp < 0 || len <= 0) {
+        return;
+    }
+    timeout_arm(TIMER_CLIENT, *fdp, TO_WRITE);
+    if (rio_writen(*fdp, buf, len) < 0) {
+        timeout_note(TIMER_CLIENT);
+        *fdp = -1;
+    }
+    else {
+        alog_bytes(len);
+    }
+    timeout_disarm(TIMER_CLIENT);
+}
+
+/*
+ * freshness lifetime of a response in ms: max-age from its
+ * Cache-Control header, conf.cache_ttl otherwise. -1 means the
+ * response must not be cached: it is not a 200, it is partial
+ * (Content-Range), it varies on everything (Vary: *), or it is
+ * no-store or private. Partial replies must never end up under the
+ * uri of the full object.
+ */
+long response_ttl(char *head, int head_len) {
+    char value[MAXLINE], *ptr;
+    int status;
+
+    if (http_parse_head(head, head_len, &status) < 0 || status != 200 ||
+        http_header_value(head, head_len, "Content-Range",
+                          value, MAXLINE) >= 0 ||
+        (http_header_value(head, head_len, "Vary", value, MAXLINE) >= 0 &&
+         strchr(value, '*') != NULL)) {
+        return -1;
+    }
+    if (http_header_value(head, head_len, "Cache-Control",
+                          value, MAXLINE) < 0) {
+        return conf.cache_ttl * 1000;
+    }
+    for (ptr = value; *ptr; ptr++) {
+        *ptr = tolower(*ptr);
+    }
+    if (strstr(value, "no-store") || strstr(value, "private")) {
+        return -1;
+    }
+    if ((ptr = strstr(value, "max-age=")) != NULL) {
+        return atol(ptr + 8) * 1000;
+    }
+    return conf.cache_ttl * 1000;
+}
+
+/* check that no part of the body was lost, going by Content-Length */
+int response_complete(char *head, int head_len, unsigned long body_size) {
+    char value[MAXLINE];
+
+    if (http_header_value(head, head_len, "Content-Length",
+                          value, MAXLINE) < 0) {
+        return 1;
+    }
+    return strtoul(value, NULL, 10) == body_size;
+}
+
+/*
+ * tell whether a body is worth compressing in the cache: text,
+ * json, javascript, xml or svg that is not already encoded
+ */
+int response_compressible(char *head, int head_len) {
+    static char *types[] = {"text/", "json", "javascript", "xml", "svg",
+                            NULL};
+    char value[MAXLINE], *ptr;
+    char **type;
+
+    if (http_header_value(head, head_len, "Content-Encoding",
+                          value, MAXLINE) >= 0 &&
+        strcasecmp(value, "identity")) {
+        return 0;
+    }
+    if (http_header_value(head, head_len, "Content-Type",
+                          value, MAXLINE) < 0) {
+        return 0;
+    }
+    for (ptr = value; *ptr; ptr++) {
+        *ptr = tolower(*ptr);
+    }
+    for (type = types; *type; type++) {
+        if (strstr(value, *type)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * refetch the block id for the background refresher without any
+ * client headers but the ones a variant was picked by: its id is
+ * the uri key and "\tname:value" for each of them. a failed refresh
+ * leaves the old block in the cache
+ */
+int refresh_uri(char *id) {
+    REQ *req = buf_get(sizeof(REQ));
+    char *key = req->key, *hdrs = req->header_server, *ptr, *next;
+    int key_len = strcspn(id, "\t"), server_port, len, rc = 0;
+
+    snprintf(key, MAXLINE, "%.*s", key_len, id);
+    server_port = parse_uri(key, req->host, req->append);
+    hdrs[0] = '\0';
+    assemble_header(NULL, hdrs, "GET", req->host, req->append,
+                    req->client_hdrs);
+    /* the varied headers go before the blank line */
+    len = strlen(hdrs) - 2;
+    for (ptr = id + key_len; *ptr == '\t' && len < MAXLINE; ptr = next) {
+        next = ptr + 1 + strcspn(ptr + 1, "\t");
+        len += snprintf(hdrs + len, MAXLINE - len, "%.*s\r\n",
+                        (int)(next - ptr - 1), ptr + 1);
+    }
+    if (len + 3 > MAXLINE) {
+        rc = -1;
+    }
+    else {
+        strcpy(hdrs + len, "\r\n");
+        if (fetch_upstream(key, req->host, server_port, hdrs, NULL, -1,
+                           0) != 1) {
+            rc = -1;
+        }
+    }
+    if (rc < 0) {
+        cache_refresh_failed(cache, id);
+    }
+    buf_put(req);
+    return rc;
+}
+
+/*
+ * print the counters to stderr whenever SIGUSR1 arrives,
+ * varptr is the signal mask blocked in every other thread
+ */
+void *report_thread(void *varptr) {
+    sigset_t *mask = (sigset_t *)varptr;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        if (sigwait(mask, &sig) == 0) {
+            cache_report(cache, stderr);
+            refresh_report(stderr);
+            neg_report(stderr);
+            trace_report(stderr);
+            alog_report(stderr);
+            acceptor_report(stderr);
+            node_report(stderr);
+            admit_report(stderr);
+            rl_report(stderr);
+            pool_report(stderr);
+            timeout_report(stderr);
+            buf_report(stderr);
+            tunnel_report(stderr);
+            memctl_report(stderr);
+            shm_cache_report(stderr);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * on a miss, copy a fresh response of key from the cache shared by
+ * the workers into this worker's cache and look it up there
+ */
+CACHE_B *shared_lookup(char *key, char *hdrs, int *state) {
+    CACHE_FILL fill;
+    unsigned head_len;
+    long ttl_ms;
+    char *head;
+
+    if (!shm_cache_on()) {
+        return NULL;
+    }
+    head = buf_get(MAXBUF);
+    cache_fill_init(&fill);
+    if (shm_cache_get(key, head, MAXBUF, &head_len, &fill, &ttl_ms) < 0) {
+        buf_put(head);
+        return NULL;
+    }
+    fill.compress = response_compressible(head, head_len);
+    cache_update(cache, key, hdrs, head, head_len, &fill, ttl_ms);
+    buf_put(head);
+    return cache_lookup(cache, key, hdrs, state);
+}
+
 /*
  * help function: to get client's header
  */
@@ -274,6 +1382,7 @@ void get_header(char *header, char *key) {
     char *ptr = key_buf;
 
     strcpy(key_buf, header);
+    *key = '\0';
 
     while (*ptr != ':' && *ptr != '\0') {
         ptr++;
@@ -287,15 +1396,128 @@ void get_header(char *header, char *key) {
 
 /*
  * send the request information from cache when the requested 
- * information (url) is in the cache
+ * information (url) is in the cache. a Range request is answered
+ * with only the bytes asked for.
  */
-void adjust_cache(CACHE *cache, char *uri, int connfd_client) {
-    CACHE_B *cached_object =cache_get(cache, uri);
+void adjust_cache(CACHE *cache, CACHE_B *cached_object, int connfd_client,
+                  char *client_hdrs, char *version) {
+    HTTP_RANGE ranges[HTTP_MAX_RANGES];
+    char range[MAXLINE], if_range[64];
+    int hdrs_len = strlen(client_hdrs);
+    int n = -1;
+
+    if (http_header_value(client_hdrs, hdrs_len, "Range", range, MAXLINE) >= 0
+        && http_header_value(client_hdrs, hdrs_len, "If-Range",
+                             if_range, sizeof(if_range)) < 0) {
+        n = http_parse_range(range, cached_object->body->size,
+                             ranges, HTTP_MAX_RANGES);
+    }
+    if (n >= 0) {
+        send_ranges(connfd_client, cached_object, ranges, n, version);
+    }
     //write back to client
-    if (rio_writen(connfd_client, cached_object->data, cached_object->size) < 0) {
-        printf("Error occured when writing to client\n");
-        if(errno == EPIPE) {
-            Close(connfd_client);
+    else {
+        alog_status(200);
+        if (rio_writen(connfd_client, cached_object->head,
+                       cached_object->head_len) >= 0 &&
+            cache_write_range(connfd_client, cached_object, 0,
+                              cached_object->body->size) >= 0) {
+            alog_bytes(cached_object->head_len + cached_object->body->size);
         }
     }
-}                                                        
+    cache_release(cache, cached_object);
+}
+
+/*
+ * answer a Range request from a cached 200 response: 416 when no
+ * range is satisfiable, a single 206 part for one range, and a
+ * multipart/byteranges body for several. the status line is in the
+ * version of the client, not the one the response was cached in.
+ */
+void send_ranges(int fd, CACHE_B *cached_object, HTTP_RANGE *ranges, int n,
+                 char *version) {
+    static char *single_skip[] = {"Content-Length", "Content-Range",
+                                  "Transfer-Encoding", NULL};
+    static char *multi_skip[] = {"Content-Length", "Content-Range",
+                                 "Transfer-Encoding", "Content-Type", NULL};
+    char *head = cached_object->head;
+    int head_len = cached_object->head_len;
+    unsigned long body_size = cached_object->body->size, total;
+    char ctype[MAXLINE], boundary[64], part[MAXLINE];
+    char *buf = Malloc(head_len + MAXLINE);
+    char *proto = strcmp(version, "HTTP/1.1") ? "HTTP/1.0" : "HTTP/1.1";
+    int len, i;
+
+    if (n == 0) {
+        len = sprintf(buf, "%s 416 Range Not Satisfiable\r\n"
+                      "Content-Range: bytes */%lu\r\n"
+                      "Content-Length: 0\r\n\r\n", proto, body_size);
+        alog_status(416);
+        if (rio_writen(fd, buf, len) >= 0) {
+            alog_bytes(len);
+        }
+        Free(buf);
+        return;
+    }
+
+    alog_status(206);
+    len = sprintf(buf, "%s 206 Partial Content\r\n", proto);
+    if (n == 1) {
+        len += http_copy_headers(buf + len, head, head_len, single_skip);
+        len += sprintf(buf + len, "Content-Range: bytes %lu-%lu/%lu\r\n"
+                       "Content-Length: %lu\r\n\r\n",
+                       ranges[0].first, ranges[0].last, body_size,
+                       ranges[0].last - ranges[0].first + 1);
+        if (rio_writen(fd, buf, len) >= 0 &&
+            cache_write_range(fd, cached_object, ranges[0].first,
+                              ranges[0].last - ranges[0].first + 1) >= 0) {
+            alog_bytes(len + ranges[0].last - ranges[0].first + 1);
+        }
+        Free(buf);
+        return;
+    }
+
+    if (http_header_value(head, head_len, "Content-Type", ctype,
+                          MAXLINE / 2) < 0) {
+        strcpy(ctype, "application/octet-stream");
+    }
+    sprintf(boundary, "PROXY_BYTERANGES_%lx", (unsigned long)cached_object);
+    total = strlen(boundary) + 8;  /* "\r\n--" boundary "--\r\n" */
+    for (i = 0; i < n; i++) {
+        total += snprintf(NULL, 0, "\r\n--%s\r\nContent-Type: %s\r\n"
+                          "Content-Range: bytes %lu-%lu/%lu\r\n\r\n",
+                          boundary, ctype, ranges[i].first, ranges[i].last,
+                          body_size);
+        total += ranges[i].last - ranges[i].first + 1;
+    }
+    len += http_copy_headers(buf + len, head, head_len, multi_skip);
+    len += sprintf(buf + len, "Content-Type: multipart/byteranges; "
+                   "boundary=%s\r\nContent-Length: %lu\r\n\r\n",
+                   boundary, total);
+    if (rio_writen(fd, buf, len) < 0) {
+        Free(buf);
+        return;
+    }
+    alog_bytes(len);
+    for (i = 0; i < n; i++) {
+        /* ctype is at most MAXLINE / 2, so a part line always fits */
+        len = snprintf(part, sizeof(part), "\r\n--%s\r\nContent-Type: %s"
+                       "\r\nContent-Range: bytes %lu-%lu/%lu\r\n\r\n",
+                       boundary, ctype, ranges[i].first, ranges[i].last,
+                       body_size);
+        if (len >= (int)sizeof(part)) {
+            len = sizeof(part) - 1;
+        }
+        if (rio_writen(fd, part, len) < 0 ||
+            cache_write_range(fd, cached_object, ranges[i].first,
+                              ranges[i].last - ranges[i].first + 1) < 0) {
+            Free(buf);
+            return;
+        }
+    }
+    len = snprintf(part, sizeof(part), "\r\n--%s--\r\n", boundary);
+    if (rio_writen(fd, part, len) >= 0) {
+        alog_bytes(total);
+    }
+    Free(buf);
+}
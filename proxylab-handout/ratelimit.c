@@ -0,0 +1,148 @@
+/*
+ * token bucket rate limits for proxy.c
+ *
+ * Every client IP and every origin host:port has a bucket that
+ * fills at conf.client_rate or conf.origin_rate tokens a second up to
+ * conf.client_burst or conf.origin_burst; a request takes one token.
+ * A rate of 0 turns that limit off.
+ *
+ * With rate_queue_ms=0 a request that finds its bucket empty is
+ * rejected. Otherwise it may take a token ahead of time, driving the
+ * bucket negative, as long as its turn comes within rate_queue_ms;
+ * the caller then sleeps until then, so requests over the rate are
+ * queued in arrival order and only those that would wait longer are
+ * rejected.
+ *
+ * Buckets live in one hash table whose chains are guarded by
+ * RL_STRIPES locks, so threads checking different keys rarely meet.
+ * A bucket idle long enough to be full again is no different from a
+ * new one and is freed when its chain is next walked.
+ */
+
+#include "csapp.h"
+#include "config.h"
+#include "stats.h"
+#include "ratelimit.h"
+
+typedef struct RL_B {
+    char *key;
+    double tokens;            /* below 0 when requests are queued */
+    unsigned long last_us;    /* when tokens was brought up to date */
+    struct RL_B *next;
+} RL_B;
+
+static struct {
+    RL_B *table[RL_NKINDS][RL_BUCKETS];
+    sem_t mutex[RL_STRIPES];
+    unsigned long cnt[RL_NKINDS];   /* buckets, updated atomically */
+} rl;
+
+static unsigned rl_hash(char *key) {
+    unsigned h = 2166136261U;
+    while (*key) {
+        h = (h ^ (unsigned char)*key++) * 16777619U;
+    }
+    return h & (RL_BUCKETS - 1);
+}
+
+void rl_init(void) {
+    int i;
+
+    memset(&rl, 0, sizeof(rl));
+    for (i = 0; i < RL_STRIPES; i++) {
+        Sem_init(&rl.mutex[i], 0, 1);
+    }
+}
+
+/* microseconds from last to now, 0 if now is the earlier */
+static unsigned long rl_elapsed(unsigned long now, unsigned long last) {
+    return now > last ? now - last : 0;
+}
+
+/* bring the tokens of b up to now */
+static void rl_fill(RL_B *b, unsigned long now, double rate, double burst) {
+    b->tokens += rl_elapsed(now, b->last_us) * rate / 1e6;
+    if (b->tokens > burst) {
+        b->tokens = burst;
+    }
+    if (now > b->last_us) {
+        b->last_us = now;
+    }
+}
+
+/*
+ * take a token for key from the buckets of kind
+ * returns 0 to go on now, the microseconds to sleep before going on
+ * when it was queued, or -1 when it is over the limit
+ */
+long rl_acquire(int kind, char *key) {
+    double rate = kind == RL_CLIENT ? conf.client_rate : conf.origin_rate;
+    double burst = kind == RL_CLIENT ? conf.client_burst : conf.origin_burst;
+    double lowest = -conf.rate_queue_ms * rate / 1000;
+    unsigned long now;
+    unsigned h;
+    RL_B **pp, *b, *found = NULL;
+    long wait = 0;
+
+    if (rate <= 0) {
+        return 0;
+    }
+    h = rl_hash(key);
+    P(&rl.mutex[h & (RL_STRIPES - 1)]);
+    /* after the lock, so no bucket was filled to a later time */
+    now = stats_now_us();
+    for (pp = &rl.table[kind][h]; (b = *pp) != NULL; ) {
+        if (!strcmp(b->key, key)) {
+            found = b;
+        }
+        else if (rl_elapsed(now, b->last_us) * rate / 1e6 + b->tokens >=
+                 burst) {
+            /* full again: forget it */
+            *pp = b->next;
+            Free(b->key);
+            Free(b);
+            __atomic_sub_fetch(&rl.cnt[kind], 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        pp = &b->next;
+    }
+    if ((b = found) == NULL) {
+        b = Malloc(sizeof(RL_B));
+        b->key = Malloc(strlen(key) + 1);
+        strcpy(b->key, key);
+        b->tokens = burst;
+        b->last_us = now;
+        b->next = rl.table[kind][h];
+        rl.table[kind][h] = b;
+        __atomic_add_fetch(&rl.cnt[kind], 1, __ATOMIC_RELAXED);
+    }
+    rl_fill(b, now, rate, burst);
+    if (b->tokens >= 1) {
+        b->tokens -= 1;
+    }
+    else if (b->tokens - 1 >= lowest) {
+        b->tokens -= 1;
+        wait = (long)(-b->tokens * 1e6 / rate);
+    }
+    else {
+        wait = -1;
+    }
+    V(&rl.mutex[h & (RL_STRIPES - 1)]);
+
+    if (wait != 0) {
+        stats_add(wait > 0 ? STAT_RATE_QUEUED : kind == RL_CLIENT ?
+                  STAT_RATE_LIMITED_CLIENT : STAT_RATE_LIMITED_ORIGIN, 1);
+    }
+    return wait;
+}
+
+/* print how many keys are tracked and what was limited */
+void rl_report(FILE *fp) {
+    fprintf(fp, "ratelimit: %lu clients, %lu origins, %lu queued, "
+            "%lu clients and %lu origins over the limit\n",
+            __atomic_load_n(&rl.cnt[RL_CLIENT], __ATOMIC_RELAXED),
+            __atomic_load_n(&rl.cnt[RL_ORIGIN], __ATOMIC_RELAXED),
+            stats_counter(STAT_RATE_QUEUED),
+            stats_counter(STAT_RATE_LIMITED_CLIENT),
+            stats_counter(STAT_RATE_LIMITED_ORIGIN));
+}
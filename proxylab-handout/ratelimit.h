@@ -0,0 +1,21 @@
+/*
+ * token bucket rate limits for proxy.c
+ */
+
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+/* what a limit is keyed by */
+#define RL_CLIENT 0   /* client IP address */
+#define RL_ORIGIN 1   /* origin host:port */
+#define RL_NKINDS 2
+
+/* hash buckets and the lock stripes over them, powers of 2 */
+#define RL_BUCKETS 4096
+#define RL_STRIPES 64
+
+void rl_init(void);
+long rl_acquire(int kind, char *key);
+void rl_report(FILE *fp);
+
+#endif /* __RATELIMIT_H__ */
@@ -0,0 +1,106 @@
+/*
+ * background refresh of cached objects for proxy.c
+ *
+ * Uris to refresh are put in a bounded queue (the sbuf package from
+ * the textbook) that a small pool of worker threads takes them from.
+ * A client thread never waits on the queue: when it is full the job
+ * is dropped and counted, and the block simply refreshes on a later
+ * hit or on its next miss.
+ */
+
+#include "csapp.h"
+#include "refresh.h"
+
+/* bounded queue of uris waiting for a worker */
+static struct {
+    char **buf;          /* malloc'd uri strings */
+    int n;               /* maximum number of slots */
+    int front;           /* buf[(front+1)%n] is the first item */
+    int rear;            /* buf[rear%n] is the last item */
+    sem_t mutex;         /* protects accesses to buf */
+    sem_t slots;         /* counts available slots */
+    sem_t items;         /* counts available items */
+} rq;
+
+static refresh_fn refresh_fetch;
+static int refresh_workers;
+
+/* counters, protected by rq.mutex */
+static unsigned long queued_cnt, done_cnt, failed_cnt, dropped_cnt;
+
+/* worker thread: refresh uris until the process exits */
+static void *refresh_thread(void *vargp) {
+    char *uri;
+    int rc;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        P(&rq.items);
+        P(&rq.mutex);
+        uri = rq.buf[(++rq.front) % rq.n];
+        V(&rq.mutex);
+        V(&rq.slots);
+
+        rc = refresh_fetch(uri);
+
+        P(&rq.mutex);
+        if (rc == 0) {
+            done_cnt++;
+        }
+        else {
+            failed_cnt++;
+        }
+        V(&rq.mutex);
+        Free(uri);
+    }
+    return NULL;
+}
+
+/* start nthreads workers that call fn on each submitted uri */
+void refresh_init(int nthreads, int qsize, refresh_fn fn) {
+    pthread_t tid;
+    int i;
+
+    rq.buf = Calloc(qsize, sizeof(char *));
+    rq.n = qsize;
+    rq.front = rq.rear = 0;
+    Sem_init(&rq.mutex, 0, 1);
+    Sem_init(&rq.slots, 0, qsize);
+    Sem_init(&rq.items, 0, 0);
+    refresh_fetch = fn;
+    refresh_workers = nthreads;
+    for (i = 0; i < nthreads; i++) {
+        Pthread_create(&tid, NULL, refresh_thread, NULL);
+    }
+}
+
+/*
+ * queue uri for a background refresh without blocking
+ * returns 0 if it was queued, -1 if it was dropped
+ */
+int refresh_submit(char *uri) {
+    char *copy;
+
+    if (refresh_workers == 0 || sem_trywait(&rq.slots) < 0) {
+        P(&rq.mutex);
+        dropped_cnt++;
+        V(&rq.mutex);
+        return -1;
+    }
+    copy = Malloc(strlen(uri) + 1);
+    strcpy(copy, uri);
+    P(&rq.mutex);
+    rq.buf[(++rq.rear) % rq.n] = copy;
+    queued_cnt++;
+    V(&rq.mutex);
+    V(&rq.items);
+    return 0;
+}
+
+/* print the refresh counters */
+void refresh_report(FILE *fp) {
+    P(&rq.mutex);
+    fprintf(fp, "refresh: %lu queued, %lu done, %lu failed, %lu dropped\n",
+            queued_cnt, done_cnt, failed_cnt, dropped_cnt);
+    V(&rq.mutex);
+}
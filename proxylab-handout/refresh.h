@@ -0,0 +1,15 @@
+/*
+ * background refresh of cached objects for proxy.c
+ */
+
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+/* refetches uri from the origin, returns 0 on success */
+typedef int (*refresh_fn)(char *uri);
+
+void refresh_init(int nthreads, int qsize, refresh_fn fn);
+int  refresh_submit(char *uri);
+void refresh_report(FILE *fp);
+
+#endif /* __REFRESH_H__ */
@@ -0,0 +1,575 @@
+/*
+ * cache shared by the worker processes of proxy.c
+ *
+ * With conf.workers the proxy runs as worker processes (prefork.c),
+ * each with its own cache (cache.c) in front of this one, which lives
+ * in a POSIX shared memory segment of conf.shm_cache_bytes made by
+ * the master before it forks. A worker that misses its own cache
+ * looks here, and copies what it finds into its own; what it fetches
+ * from an origin it stores in both. Since the master keeps the
+ * segment, a worker that crashes or is restarted loses only its own
+ * cache, and the new one gets its hits from here.
+ *
+ * The segment is a header, a hash index of SHM_BYTES_PER_BUCKET
+ * bytes of ring per bucket, and a ring of records, each the key, the
+ * plain head and the body of one response. Processes map it at
+ * different addresses, so nothing in it is a pointer: buckets and
+ * hash chains hold offsets from the start of the segment, 0 ending a
+ * chain. Records are written at the head of the ring and evicted from
+ * its tail, oldest first, which keeps allocation a pointer bump with
+ * no free lists to corrupt; the ring goes on at its start when a
+ * record does not fit before its end. Responses with Vary stay in
+ * the workers' own caches.
+ *
+ * Every purge, by PURGE or by a write to a uri, is also logged with
+ * a generation number in the header. Before it looks in its own
+ * cache a worker compares the generation with the last one it saw
+ * and, when it moved, applies the purges it missed to its own cache
+ * (shm_cache_sync()), or empties it if it fell more than
+ * SHM_PURGE_LOG purges behind. A key too long for the log is logged
+ * as a prefix of itself, which purges more than needed, never less.
+ *
+ * One robust, process-shared mutex guards the segment. If a worker
+ * dies holding it, the next process to lock it gets EOWNERDEAD and
+ * rebuilds the index by walking the ring from tail to head, linking
+ * the records that were complete: a record is written before the
+ * head moves past it and is marked live before it is linked, and it
+ * is marked dead before it is unlinked. If the ring itself does not
+ * add up, the cache is emptied rather than trusted.
+ */
+
+#include <sys/mman.h>
+#include "csapp.h"
+#include "config.h"
+#include "http.h"
+#include "shmcache.h"
+
+#define SHM_MAGIC  0x5052585943414348UL   /* the segment is set up */
+#define ENT_MAGIC  0x5052585952454355UL   /* a record */
+#define WRAP_MAGIC 0x5052585957524150UL   /* the ring goes on at its start */
+
+/* one response in the ring */
+typedef struct SHM_ENT {
+    unsigned long magic;
+    unsigned long size;       /* bytes of the record, aligned */
+    unsigned long next;       /* next record in the bucket, 0 ends it */
+    unsigned long long hash;
+    long expire_ms;           /* on CLOCK_MONOTONIC, as in every process */
+    unsigned key_len;
+    unsigned head_len;
+    unsigned long body_len;
+    int live;                 /* in the index */
+    char data[];              /* the key, a NUL, the head, the body */
+} SHM_ENT;
+
+/* a purge the workers have to apply to their own caches */
+typedef struct SHM_PURGE {
+    unsigned long gen;
+    int prefix;               /* key is a prefix */
+    char key[SHM_PURGE_KEY];
+} SHM_PURGE;
+
+/* the start of the segment */
+typedef struct SHM_HDR {
+    unsigned long magic;
+    unsigned long size;       /* of the segment */
+    pthread_mutex_t lock;     /* robust and process-shared */
+    unsigned long nbuckets;   /* a power of 2 */
+    unsigned long buckets;    /* offset of the bucket array */
+    unsigned long ring_start;
+    unsigned long ring_end;
+    unsigned long head;       /* where the next record goes */
+    unsigned long tail;       /* the oldest record */
+    unsigned long used;       /* bytes from tail to head */
+    unsigned long entries;    /* live records */
+    unsigned long live_bytes; /* bytes of them */
+    unsigned long hits, misses, inserts, evictions, purges;
+    unsigned long recoveries; /* locks taken over from a dead process */
+    unsigned long resets;     /* recoveries that emptied the cache */
+    unsigned long purge_gen;  /* purges so far, read without the lock */
+    SHM_PURGE purge_log[SHM_PURGE_LOG];
+} SHM_HDR;
+
+static SHM_HDR *shm;
+static char shm_name[64];
+
+/* the last purge this worker applied to its own cache */
+static unsigned long seen_gen;
+static sem_t sync_mutex;
+
+/* monotonic clock in milliseconds */
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* 64-bit FNV-1a of a key */
+static unsigned long long key_hash(char *key) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static SHM_ENT *ent_at(unsigned long off) {
+    return (SHM_ENT *)((char *)shm + off);
+}
+
+static unsigned long *bucket_of(unsigned long long hash) {
+    return (unsigned long *)((char *)shm + shm->buckets) +
+           (hash & (shm->nbuckets - 1));
+}
+
+/* the offset of the live record of key, 0 if there is none */
+static unsigned long ent_find(char *key, unsigned long long hash) {
+    unsigned long off = *bucket_of(hash);
+    SHM_ENT *ent;
+
+    while (off != 0) {
+        ent = ent_at(off);
+        if (ent->hash == hash && !strcmp(ent->data, key)) {
+            return off;
+        }
+        off = ent->next;
+    }
+    return 0;
+}
+
+/* put a record into the index */
+static void ent_link(unsigned long off) {
+    SHM_ENT *ent = ent_at(off);
+    unsigned long *bucket = bucket_of(ent->hash);
+
+    ent->live = 1;
+    ent->next = *bucket;
+    *bucket = off;
+    shm->entries++;
+    shm->live_bytes += ent->size;
+}
+
+/* take a record out of the index, its bytes stay until the tail */
+static void ent_unlink(unsigned long off) {
+    SHM_ENT *ent = ent_at(off);
+    unsigned long *p = bucket_of(ent->hash);
+
+    ent->live = 0;
+    while (*p != 0 && *p != off) {
+        p = &ent_at(*p)->next;
+    }
+    if (*p == off) {
+        *p = ent->next;
+    }
+    shm->entries--;
+    shm->live_bytes -= ent->size;
+}
+
+/* empty the ring and the index */
+static void shm_reset(void) {
+    memset((char *)shm + shm->buckets, 0,
+           shm->nbuckets * sizeof(unsigned long));
+    shm->head = shm->tail = shm->ring_start;
+    shm->used = 0;
+    shm->entries = 0;
+    shm->live_bytes = 0;
+}
+
+/* drop the oldest record, or the unused end of the ring */
+static void ring_evict(void) {
+    SHM_ENT *ent = ent_at(shm->tail);
+
+    if (shm->ring_end - shm->tail < sizeof(SHM_ENT) ||
+        ent->magic == WRAP_MAGIC) {
+        shm->used -= shm->ring_end - shm->tail;
+        shm->tail = shm->ring_start;
+        return;
+    }
+    if (ent->live) {
+        ent_unlink(shm->tail);
+        shm->evictions++;
+    }
+    shm->used -= ent->size;
+    shm->tail += ent->size;
+    if (shm->tail == shm->ring_end) {
+        shm->tail = shm->ring_start;
+    }
+}
+
+/*
+ * make room for a record of need bytes at the head of the ring,
+ * evicting from the tail. need must be well under the ring size.
+ * returns its offset, with its magic and size already written.
+ */
+static unsigned long ring_alloc(unsigned long need) {
+    SHM_ENT *ent;
+    unsigned long off;
+
+    while (1) {
+        if (shm->used == 0) {
+            shm->head = shm->tail = shm->ring_start;
+        }
+        /* free is [head, ring_end) and [ring_start, tail) */
+        if (shm->head > shm->tail || shm->used == 0) {
+            if (shm->ring_end - shm->head >= need) {
+                break;
+            }
+            if (shm->ring_end - shm->head >= sizeof(SHM_ENT)) {
+                ent_at(shm->head)->magic = WRAP_MAGIC;
+            }
+            shm->used += shm->ring_end - shm->head;
+            shm->head = shm->ring_start;
+            continue;
+        }
+        /* free is [head, tail) */
+        if (shm->tail - shm->head >= need) {
+            break;
+        }
+        ring_evict();
+    }
+    off = shm->head;
+    ent = ent_at(off);
+    ent->magic = ENT_MAGIC;
+    ent->size = need;
+    ent->live = 0;
+    shm->used += need;
+    shm->head += need;
+    return off;
+}
+
+/*
+ * relink every complete record after a process died holding the
+ * lock, walking the ring from tail to head. empties the cache if
+ * the ring does not add up.
+ */
+static void shm_rebuild(void) {
+    unsigned long pos = shm->tail, walked = 0, total;
+    SHM_ENT *ent;
+
+    memset((char *)shm + shm->buckets, 0,
+           shm->nbuckets * sizeof(unsigned long));
+    shm->entries = 0;
+    shm->live_bytes = 0;
+    if (shm->head < shm->ring_start || shm->head > shm->ring_end ||
+        shm->tail < shm->ring_start || shm->tail >= shm->ring_end) {
+        shm_reset();
+        shm->resets++;
+        return;
+    }
+    if (shm->head > shm->tail) {
+        total = shm->head - shm->tail;
+    }
+    else if (shm->head == shm->tail && shm->used == 0) {
+        total = 0;
+    }
+    else {
+        total = shm->ring_end - shm->tail + shm->head - shm->ring_start;
+    }
+    while (walked < total) {
+        if (pos == shm->ring_end) {
+            pos = shm->ring_start;
+            continue;
+        }
+        ent = ent_at(pos);
+        if (shm->ring_end - pos < sizeof(SHM_ENT) ||
+            ent->magic == WRAP_MAGIC) {
+            walked += shm->ring_end - pos;
+            pos = shm->ring_start;
+            continue;
+        }
+        if (ent->magic != ENT_MAGIC || ent->size < sizeof(SHM_ENT) ||
+            ent->size % SHM_ALIGN || ent->size > shm->ring_end - pos) {
+            break;
+        }
+        if (ent->live) {
+            ent_link(pos);
+        }
+        walked += ent->size;
+        pos += ent->size;
+    }
+    if (walked != total) {
+        shm_reset();
+        shm->resets++;
+        return;
+    }
+    shm->used = total;
+}
+
+/* log a purge for the other workers. the lock must be held. */
+static void log_purge(char *key, int prefix) {
+    unsigned long gen = shm->purge_gen + 1;
+    SHM_PURGE *p = &shm->purge_log[gen % SHM_PURGE_LOG];
+
+    p->gen = gen;
+    p->prefix = prefix || strlen(key) >= SHM_PURGE_KEY;
+    snprintf(p->key, SHM_PURGE_KEY, "%s", key);
+    __atomic_store_n(&shm->purge_gen, gen, __ATOMIC_RELEASE);
+}
+
+/* lock the segment, taking it over from a process that died with it */
+static void shm_lock(void) {
+    int rc;
+
+    if ((rc = pthread_mutex_lock(&shm->lock)) == EOWNERDEAD) {
+        shm_rebuild();
+        shm->recoveries++;
+        pthread_mutex_consistent(&shm->lock);
+    }
+    else if (rc) {
+        posix_error(rc, "shm_cache lock error");
+    }
+}
+
+static void shm_unlock(void) {
+    pthread_mutex_unlock(&shm->lock);
+}
+
+/*
+ * create and map the segment for the proxy on port, before any
+ * worker is forked. returns 0, or -1 if it cannot be made.
+ */
+int shm_cache_init(int port) {
+    pthread_mutexattr_t attr;
+    unsigned long size = conf.shm_cache_bytes & ~(SHM_ALIGN - 1), nb;
+    void *p;
+    int fd;
+
+    snprintf(shm_name, sizeof(shm_name), SHM_NAME_FMT, port);
+    /* left behind by a proxy on this port that was killed */
+    shm_unlink(shm_name);
+    if ((fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        fprintf(stderr, "shm_open %s: %s\n", shm_name, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, size) < 0 ||
+        (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                  0)) == MAP_FAILED) {
+        fprintf(stderr, "shm_cache %s: %s\n", shm_name, strerror(errno));
+        close(fd);
+        shm_unlink(shm_name);
+        return -1;
+    }
+    close(fd);
+    shm = p;
+
+    for (nb = 1024; nb * SHM_BYTES_PER_BUCKET < size; nb <<= 1)
+        ;
+    shm->size = size;
+    shm->nbuckets = nb;
+    shm->buckets = (sizeof(SHM_HDR) + SHM_ALIGN - 1) & ~(SHM_ALIGN - 1);
+    shm->ring_start = shm->buckets + nb * sizeof(unsigned long);
+    shm->ring_end = size;
+    shm_reset();
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shm->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    Sem_init(&sync_mutex, 0, 1);
+    shm->magic = SHM_MAGIC;
+    return 0;
+}
+
+/* remove the segment, called by the master on its way out */
+void shm_cache_destroy(void) {
+    if (shm != NULL) {
+        shm_unlink(shm_name);
+    }
+}
+
+/* is there a shared cache */
+int shm_cache_on(void) {
+    return shm != NULL;
+}
+
+/*
+ * copy the fresh response of key into head (at most head_max bytes)
+ * and fill, with the ttl it has left. returns 0, or -1 on a miss.
+ */
+int shm_cache_get(char *key, char *head, unsigned head_max,
+                  unsigned *head_len, CACHE_FILL *fill, long *ttl_ms) {
+    unsigned long long hash;
+    unsigned long off;
+    SHM_ENT *ent;
+    long now;
+    int rc = -1;
+
+    if (shm == NULL) {
+        return -1;
+    }
+    hash = key_hash(key);
+    now = now_ms();
+    shm_lock();
+    if ((off = ent_find(key, hash)) != 0 &&
+        (ent = ent_at(off))->expire_ms > now && ent->head_len <= head_max) {
+        memcpy(head, ent->data + ent->key_len + 1, ent->head_len);
+        *head_len = ent->head_len;
+        cache_fill_append(fill, ent->data + ent->key_len + 1 + ent->head_len,
+                          ent->body_len);
+        *ttl_ms = ent->expire_ms - now;
+        shm->hits++;
+        rc = 0;
+    }
+    else {
+        shm->misses++;
+    }
+    shm_unlock();
+    return rc;
+}
+
+/*
+ * store the response of key, a plain head and the body in fill, for
+ * ttl_ms. fill is left as it was, for cache_update().
+ */
+void shm_cache_put(char *key, char *head, unsigned head_len,
+                   CACHE_FILL *fill, long ttl_ms) {
+    char vary[MAXLINE], *p;
+    unsigned long long hash;
+    unsigned long need, off;
+    unsigned key_len;
+    SHM_ENT *ent;
+    CACHE_C *chunk;
+
+    if (shm == NULL || fill->too_big ||
+        http_header_value(head, head_len, "Vary", vary, MAXLINE) > 0) {
+        return;
+    }
+    key_len = strlen(key);
+    need = (sizeof(SHM_ENT) + key_len + 1 + head_len + fill->size +
+            SHM_ALIGN - 1) & ~(SHM_ALIGN - 1);
+    /* a record must leave room for others */
+    if (need > (shm->ring_end - shm->ring_start) / 4) {
+        return;
+    }
+    hash = key_hash(key);
+    shm_lock();
+    if ((off = ent_find(key, hash)) != 0) {
+        ent_unlink(off);
+    }
+    off = ring_alloc(need);
+    ent = ent_at(off);
+    ent->hash = hash;
+    ent->expire_ms = now_ms() + ttl_ms;
+    ent->key_len = key_len;
+    ent->head_len = head_len;
+    ent->body_len = fill->size;
+    memcpy(ent->data, key, key_len + 1);
+    p = ent->data + key_len + 1;
+    memcpy(p, head, head_len);
+    p += head_len;
+    /* fill is not compressed until cache_update() */
+    for (chunk = fill->first; chunk != NULL; chunk = chunk->next) {
+        memcpy(p, chunk->data, chunk->len);
+        p += chunk->len;
+    }
+    ent_link(off);
+    shm->inserts++;
+    shm_unlock();
+}
+
+/* drop the response of key, returns 1 if there was one */
+int shm_cache_purge(char *key) {
+    unsigned long off;
+
+    if (shm == NULL) {
+        return 0;
+    }
+    shm_lock();
+    if ((off = ent_find(key, key_hash(key))) != 0) {
+        ent_unlink(off);
+        shm->purges++;
+    }
+    log_purge(key, 0);
+    shm_unlock();
+    return off != 0;
+}
+
+/* drop the responses of every key starting with prefix, returns how many */
+int shm_cache_purge_prefix(char *prefix) {
+    size_t len = strlen(prefix);
+    unsigned long i, *p;
+    SHM_ENT *ent;
+    int n = 0;
+
+    if (shm == NULL) {
+        return 0;
+    }
+    shm_lock();
+    for (i = 0; i < shm->nbuckets; i++) {
+        p = (unsigned long *)((char *)shm + shm->buckets) + i;
+        while (*p != 0) {
+            ent = ent_at(*p);
+            if (strncmp(ent->data, prefix, len)) {
+                p = &ent->next;
+                continue;
+            }
+            ent->live = 0;
+            *p = ent->next;
+            shm->entries--;
+            shm->live_bytes -= ent->size;
+            n++;
+        }
+    }
+    shm->purges += n;
+    log_purge(prefix, 1);
+    shm_unlock();
+    return n;
+}
+
+/*
+ * apply to cache, this worker's own, the purges other workers made
+ * since the last call. cheap when there were none.
+ */
+void shm_cache_sync(CACHE *cache) {
+    SHM_PURGE *missed;
+    unsigned long gen, g;
+    int n = 0, i;
+
+    if (shm == NULL || __atomic_load_n(&shm->purge_gen, __ATOMIC_ACQUIRE) ==
+                       __atomic_load_n(&seen_gen, __ATOMIC_RELAXED)) {
+        return;
+    }
+    missed = Malloc(SHM_PURGE_LOG * sizeof(SHM_PURGE));
+    P(&sync_mutex);
+    shm_lock();
+    gen = shm->purge_gen;
+    if (gen - seen_gen <= SHM_PURGE_LOG) {
+        for (g = seen_gen + 1; g <= gen; g++) {
+            missed[n++] = shm->purge_log[g % SHM_PURGE_LOG];
+        }
+    }
+    shm_unlock();
+    /* the cache lock is never taken under the segment lock */
+    if (gen - seen_gen > SHM_PURGE_LOG) {
+        cache_purge_prefix(cache, "");
+    }
+    for (i = 0; i < n; i++) {
+        if (missed[i].prefix) {
+            cache_purge_prefix(cache, missed[i].key);
+        }
+        else {
+            cache_purge(cache, missed[i].key);
+        }
+    }
+    __atomic_store_n(&seen_gen, gen, __ATOMIC_RELAXED);
+    V(&sync_mutex);
+    Free(missed);
+}
+
+/* print the size and the counters of the shared cache */
+void shm_cache_report(FILE *fp) {
+    if (shm == NULL) {
+        return;
+    }
+    shm_lock();
+    fprintf(fp, "shmcache %s: %lu bytes in %lu entries, %lu of %lu ring "
+            "bytes used; %lu hits, %lu misses, %lu inserts, %lu evictions, "
+            "%lu purged; %lu locks recovered, %lu resets\n", shm_name,
+            shm->live_bytes, shm->entries, shm->used,
+            shm->ring_end - shm->ring_start, shm->hits, shm->misses,
+            shm->inserts, shm->evictions, shm->purges, shm->recoveries,
+            shm->resets);
+    shm_unlock();
+}
@@ -0,0 +1,35 @@
+/*
+ * cache shared by the worker processes of proxy.c
+ */
+
+#ifndef __SHMCACHE_H__
+#define __SHMCACHE_H__
+
+#include "cache.h"
+
+/* the segment is called SHM_NAME_FMT with the port */
+#define SHM_NAME_FMT "/proxy.%d"
+
+/* bytes of ring for each bucket of the index */
+#define SHM_BYTES_PER_BUCKET 4096
+
+/* records are aligned to this */
+#define SHM_ALIGN 8
+
+/* purges the workers can catch up on, and the longest key logged */
+#define SHM_PURGE_LOG 64
+#define SHM_PURGE_KEY 1024
+
+int  shm_cache_init(int port);
+void shm_cache_destroy(void);
+int  shm_cache_on(void);
+int  shm_cache_get(char *key, char *head, unsigned head_max,
+                   unsigned *head_len, CACHE_FILL *fill, long *ttl_ms);
+void shm_cache_put(char *key, char *head, unsigned head_len,
+                   CACHE_FILL *fill, long ttl_ms);
+int  shm_cache_purge(char *key);
+int  shm_cache_purge_prefix(char *prefix);
+void shm_cache_sync(CACHE *cache);
+void shm_cache_report(FILE *fp);
+
+#endif /* __SHMCACHE_H__ */
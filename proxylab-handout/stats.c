@@ -0,0 +1,238 @@
+/*
+ * runtime statistics for proxy.c
+ *
+ * Every thread counts into a slot of its own, so the request path
+ * never takes a lock or bounces a cache line to count something.
+ * A slot is cache-line aligned and only written by its thread; the
+ * totals are summed over all slots when someone asks for them.
+ * Connection threads come and go, so a slot is handed back to a free
+ * list when its thread exits and reused by the next one; its counts
+ * stay in the totals.
+ *
+ * Latencies go into HDR-style histograms: STAT_SUB linear buckets
+ * per power of two of microseconds, which keeps the relative error
+ * of every percentile within about 3% from 1us to over an hour.
+ */
+
+#include "csapp.h"
+#include "stats.h"
+
+typedef struct STATS_SLOT {
+    unsigned long cnt[STAT_NCOUNTERS];
+    unsigned long sum_us[STAT_NPHASES];
+    unsigned long max_us[STAT_NPHASES];
+    unsigned long hist[STAT_NPHASES][STAT_BUCKETS];
+    struct STATS_SLOT *next;       /* list of every slot */
+    struct STATS_SLOT *next_free;  /* list of unused slots */
+} __attribute__((aligned(64))) STATS_SLOT;
+
+static STATS_SLOT *slots, *free_slots;
+static sem_t slots_mutex;
+static pthread_key_t slot_key;
+static __thread STATS_SLOT *self;
+
+static char *counter_names[STAT_NCOUNTERS] = {
+    "proxy_requests_total", "proxy_cache_hits_total",
+    "proxy_cache_stale_hits_total", "proxy_cache_misses_total",
+    "proxy_cache_inserts_total", "proxy_cache_evictions_total",
+    "proxy_bytes_from_cache_total", "proxy_bytes_from_origin_total",
+    "proxy_cache_lock_waits_total", "proxy_cache_lock_wait_ns_total",
+    "proxy_shed_connections_total", "proxy_shed_misses_total",
+    "proxy_shed_hits_total", "proxy_rate_queued_total",
+    "proxy_rate_limited_clients_total", "proxy_rate_limited_origins_total",
+    "proxy_reaped_idle_total", "proxy_reaped_read_total",
+    "proxy_reaped_write_total", "proxy_tunnels_total",
+    "proxy_tunnel_bytes_total"
+};
+
+char *stats_phase_names[STAT_NPHASES] = {
+    "read", "lookup", "dns", "connect", "first_byte", "transfer", "total"
+};
+
+/* give the slot of an exiting thread back */
+static void slot_put(void *varptr) {
+    STATS_SLOT *slot = varptr;
+
+    P(&slots_mutex);
+    slot->next_free = free_slots;
+    free_slots = slot;
+    V(&slots_mutex);
+}
+
+/* the slot of the calling thread, taken on its first use */
+static STATS_SLOT *stats_self() {
+    STATS_SLOT *slot;
+    int rc;
+
+    if (self) {
+        return self;
+    }
+    P(&slots_mutex);
+    if ((slot = free_slots) != NULL) {
+        free_slots = slot->next_free;
+    }
+    V(&slots_mutex);
+    if (slot == NULL) {
+        if ((rc = posix_memalign((void **)&slot, 64, sizeof(STATS_SLOT)))) {
+            posix_error(rc, "posix_memalign error");
+        }
+        memset(slot, 0, sizeof(STATS_SLOT));
+        P(&slots_mutex);
+        slot->next = slots;
+        slots = slot;
+        V(&slots_mutex);
+    }
+    pthread_setspecific(slot_key, slot);
+    self = slot;
+    return slot;
+}
+
+void stats_init(void) {
+    int rc;
+
+    Sem_init(&slots_mutex, 0, 1);
+    if ((rc = pthread_key_create(&slot_key, slot_put))) {
+        posix_error(rc, "pthread_key_create error");
+    }
+}
+
+/* monotonic clock in microseconds */
+unsigned long stats_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* only the owner writes a slot, relaxed stores are enough */
+#define SLOT_ADD(field, n) \
+    __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+void stats_add(int counter, unsigned long n) {
+    STATS_SLOT *slot = stats_self();
+    SLOT_ADD(slot->cnt[counter], n);
+}
+
+/* bucket of a value: linear below STAT_SUB, log-linear above */
+static int bucket_of(unsigned long v) {
+    int shift;
+
+    if (v < STAT_SUB) {
+        return v;
+    }
+    shift = 63 - __builtin_clzl(v) - STAT_SUB_BITS;
+    if (shift >= STAT_BUCKETS / STAT_SUB - 1) {
+        return STAT_BUCKETS - 1;
+    }
+    return (shift + 1) * STAT_SUB + (int)(v >> shift) - STAT_SUB;
+}
+
+/* largest value that falls into bucket b */
+static unsigned long bucket_top(int b) {
+    int shift = b / STAT_SUB - 1;
+
+    if (shift < 0) {
+        return b;
+    }
+    return ((unsigned long)(b % STAT_SUB + STAT_SUB + 1) << shift) - 1;
+}
+
+void stats_record(int phase, unsigned long us) {
+    STATS_SLOT *slot = stats_self();
+
+    SLOT_ADD(slot->hist[phase][bucket_of(us)], 1);
+    SLOT_ADD(slot->sum_us[phase], us);
+    if (us > slot->max_us[phase]) {
+        __atomic_store_n(&slot->max_us[phase], us, __ATOMIC_RELAXED);
+    }
+}
+
+#define SLOT_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/* a counter summed over every thread */
+unsigned long stats_counter(int counter) {
+    STATS_SLOT *slot;
+    unsigned long n = 0;
+
+    P(&slots_mutex);
+    for (slot = slots; slot; slot = slot->next) {
+        n += SLOT_READ(slot->cnt[counter]);
+    }
+    V(&slots_mutex);
+    return n;
+}
+
+/* smallest bucket top below which a fraction q of the count lies */
+static unsigned long percentile(unsigned long *hist, unsigned long count,
+                                double q) {
+    unsigned long seen = 0, want = (unsigned long)(q * count + 0.5);
+    int b;
+
+    if (want == 0) {
+        want = 1;
+    }
+    for (b = 0; b < STAT_BUCKETS; b++) {
+        if ((seen += hist[b]) >= want) {
+            return bucket_top(b);
+        }
+    }
+    return bucket_top(STAT_BUCKETS - 1);
+}
+
+/*
+ * write every counter and a latency summary per phase into buf in
+ * the Prometheus text format, returns the length written
+ */
+int stats_format(char *buf, int size) {
+    static double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    unsigned long cnt[STAT_NCOUNTERS], hist[STAT_BUCKETS];
+    unsigned long sum, max, count, q;
+    STATS_SLOT *slot;
+    int len = 0, i, b, ph;
+
+    memset(cnt, 0, sizeof(cnt));
+    P(&slots_mutex);
+    for (slot = slots; slot; slot = slot->next) {
+        for (i = 0; i < STAT_NCOUNTERS; i++) {
+            cnt[i] += SLOT_READ(slot->cnt[i]);
+        }
+    }
+    for (i = 0; i < STAT_NCOUNTERS && len < size; i++) {
+        len += snprintf(buf + len, size - len, "%s %lu\n",
+                        counter_names[i], cnt[i]);
+    }
+    for (ph = 0; ph < STAT_NPHASES && len < size; ph++) {
+        memset(hist, 0, sizeof(hist));
+        sum = max = count = 0;
+        for (slot = slots; slot; slot = slot->next) {
+            for (b = 0; b < STAT_BUCKETS; b++) {
+                hist[b] += SLOT_READ(slot->hist[ph][b]);
+            }
+            sum += SLOT_READ(slot->sum_us[ph]);
+            if (SLOT_READ(slot->max_us[ph]) > max) {
+                max = SLOT_READ(slot->max_us[ph]);
+            }
+        }
+        for (b = 0; b < STAT_BUCKETS; b++) {
+            count += hist[b];
+        }
+        for (i = 0; i < 4 && count && len < size; i++) {
+            /* a bucket top may lie past the largest value seen */
+            q = percentile(hist, count, quantiles[i]);
+            len += snprintf(buf + len, size - len,
+                            "proxy_phase_us{phase=\"%s\",quantile=\"%g\"} "
+                            "%lu\n", stats_phase_names[ph],
+                            quantiles[i], q < max ? q : max);
+        }
+        if (len < size) {
+            len += snprintf(buf + len, size - len,
+                            "proxy_phase_us_max{phase=\"%s\"} %lu\n"
+                            "proxy_phase_us_sum{phase=\"%s\"} %lu\n"
+                            "proxy_phase_us_count{phase=\"%s\"} %lu\n",
+                            stats_phase_names[ph], max,
+                            stats_phase_names[ph], sum,
+                            stats_phase_names[ph], count);
+        }
+    }
+    V(&slots_mutex);
+    return len < size ? len : size - 1;
+}
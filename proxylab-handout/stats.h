@@ -0,0 +1,66 @@
+/*
+ * runtime statistics for proxy.c
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/* local clients get the statistics with "GET /stats" sent to the proxy */
+#define STATS_URI "/stats"
+
+/* counters */
+enum {
+    STAT_REQUESTS,      /* requests of any method but CONNECT, PURGE, /stats */
+    STAT_HITS,          /* answered from the cache */
+    STAT_STALE_HITS,    /* of which past their ttl */
+    STAT_MISSES,
+    STAT_INSERTS,       /* responses stored in the cache */
+    STAT_EVICTIONS,
+    STAT_BYTES_CACHE,   /* body bytes sent to clients from the cache */
+    STAT_BYTES_ORIGIN,  /* body bytes received from origins */
+    STAT_LOCK_WAITS,    /* cache lock acquisitions that had to wait */
+    STAT_LOCK_WAIT_NS,  /* time spent waiting for it */
+    STAT_SHED_CONNS,    /* connections refused over conf.max_conns */
+    STAT_SHED_MISSES,   /* requests refused over conf.max_inflight */
+    STAT_SHED_HITS,
+    STAT_RATE_QUEUED,   /* requests delayed by a rate limit */
+    STAT_RATE_LIMITED_CLIENT,   /* refused over a client's rate limit */
+    STAT_RATE_LIMITED_ORIGIN,   /* refused over an origin's rate limit */
+    STAT_REAPED_IDLE,   /* connections cut by a deadline (timeout.c) */
+    STAT_REAPED_READ,
+    STAT_REAPED_WRITE,
+    STAT_TUNNELS,       /* CONNECT tunnels opened (tunnel.c) */
+    STAT_TUNNEL_BYTES,  /* bytes relayed through them */
+    STAT_NCOUNTERS
+};
+
+/* request phases with a latency histogram */
+enum {
+    STAT_PH_READ,       /* reading the client request */
+    STAT_PH_LOOKUP,     /* cache lookup */
+    STAT_PH_DNS,        /* resolving the origin host */
+    STAT_PH_CONNECT,    /* connecting to the origin */
+    STAT_PH_FIRST_BYTE, /* request sent until the origin's head is read */
+    STAT_PH_TRANSFER,   /* sending the body */
+    STAT_PH_TOTAL,      /* whole request */
+    STAT_NPHASES
+};
+
+/*
+ * log-linear buckets in microseconds: STAT_SUB per power of two,
+ * so a recorded value is off by at most 1/STAT_SUB (about 3%)
+ */
+#define STAT_SUB_BITS 5
+#define STAT_SUB (1 << STAT_SUB_BITS)
+#define STAT_BUCKETS (32 * STAT_SUB)
+
+extern char *stats_phase_names[STAT_NPHASES];
+
+void stats_init(void);
+void stats_add(int counter, unsigned long n);
+void stats_record(int phase, unsigned long us);
+unsigned long stats_now_us(void);
+unsigned long stats_counter(int counter);
+int  stats_format(char *buf, int size);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,235 @@
+/*
+ * read, write and idle deadlines of connections for proxy.c
+ *
+ * Every thread has a timer for its client and one for its origin
+ * connection. Before it blocks on a socket it arms the timer with the
+ * deadline for what it is waiting for: conf.idle_timeout_ms for the
+ * request line, conf.read_timeout_ms for the rest of the request and
+ * for each read from the origin, conf.write_timeout_ms for each write.
+ * 0 turns a deadline off. When a deadline passes, the socket is shut
+ * down, which wakes the blocked thread with an error or EOF, and the
+ * connection is counted as reaped for that reason.
+ *
+ * The timers live in a hierarchical timing wheel: TIMEOUT_LEVELS
+ * levels of 64 slots, level l holding timers due within 64^(l+1)
+ * ticks of TIMEOUT_TICK_MS. Arming and disarming unlink and link a
+ * list node, O(1); a timer thread moves timers one level down as
+ * their slot comes up and shuts down the sockets of those due. Since
+ * the timer thread shuts a socket down under the wheel lock, and a
+ * thread disarms under the same lock before it closes the socket,
+ * a reaped fd can never be one that was closed and reused.
+ *
+ * With timer_wheel=0 there is no timer thread; arming sets
+ * SO_RCVTIMEO or SO_SNDTIMEO on the socket instead, and timeout_note()
+ * counts the reads and writes that failed with EAGAIN.
+ */
+
+#include "csapp.h"
+#include "config.h"
+#include "stats.h"
+#include "timeout.h"
+
+#define WHEEL_SIZE (1 << TIMEOUT_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+
+typedef struct TIMER {
+    struct TIMER *next;
+    struct TIMER *prev;
+    unsigned long expire;     /* tick it is due at */
+    int fd;
+    int reason;
+    int armed;
+} TIMER;
+
+static struct {
+    TIMER slots[TIMEOUT_LEVELS][WHEEL_SIZE];  /* list heads */
+    unsigned long cur;        /* next tick to run */
+    sem_t mutex;
+} wheel;
+
+static __thread TIMER timers[TIMER_NTIMERS];
+
+static int reap_stat[TO_NREASONS] = {
+    STAT_REAPED_IDLE, STAT_REAPED_READ, STAT_REAPED_WRITE
+};
+
+static long *timeout_ms[TO_NREASONS] = {
+    &conf.idle_timeout_ms, &conf.read_timeout_ms, &conf.write_timeout_ms
+};
+
+static unsigned long now_tick(void) {
+    return stats_now_us() / (TIMEOUT_TICK_MS * 1000);
+}
+
+/* put t in the slot for its expire tick. mutex must be held. */
+static void wheel_link(TIMER *t) {
+    unsigned long delta;
+    TIMER *head;
+    int lvl;
+
+    if (t->expire < wheel.cur) {
+        t->expire = wheel.cur;
+    }
+    delta = t->expire - wheel.cur;
+    for (lvl = 0; lvl < TIMEOUT_LEVELS - 1; lvl++) {
+        if (delta < 1UL << ((lvl + 1) * TIMEOUT_BITS)) {
+            break;
+        }
+    }
+    if (delta >= 1UL << (TIMEOUT_LEVELS * TIMEOUT_BITS)) {
+        /* farther out than the wheel reaches, wait in its last slot */
+        t->expire = wheel.cur + (1UL << (TIMEOUT_LEVELS * TIMEOUT_BITS)) - 1;
+    }
+    head = &wheel.slots[lvl][(t->expire >> (lvl * TIMEOUT_BITS)) & WHEEL_MASK];
+    t->next = head->next;
+    t->prev = head;
+    head->next->prev = t;
+    head->next = t;
+}
+
+static void wheel_unlink(TIMER *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+}
+
+/* run one tick: cascade the upper levels, then fire what is due */
+static void wheel_tick(void) {
+    unsigned long idx = wheel.cur & WHEEL_MASK;
+    TIMER *head, *t;
+    int lvl;
+
+    for (lvl = 1; idx == 0 && lvl < TIMEOUT_LEVELS; lvl++) {
+        idx = (wheel.cur >> (lvl * TIMEOUT_BITS)) & WHEEL_MASK;
+        head = &wheel.slots[lvl][idx];
+        while ((t = head->next) != head) {
+            wheel_unlink(t);
+            wheel_link(t);
+        }
+    }
+    head = &wheel.slots[0][wheel.cur & WHEEL_MASK];
+    while ((t = head->next) != head) {
+        wheel_unlink(t);
+        __atomic_store_n(&t->armed, 0, __ATOMIC_RELAXED);
+        shutdown(t->fd, SHUT_RDWR);
+        stats_add(reap_stat[t->reason], 1);
+    }
+    wheel.cur++;
+}
+
+static void *timeout_thread(void *varptr) {
+    unsigned long now;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        usleep(TIMEOUT_TICK_MS * 1000);
+        now = now_tick();
+        P(&wheel.mutex);
+        while (wheel.cur <= now) {
+            wheel_tick();
+        }
+        V(&wheel.mutex);
+    }
+    return NULL;
+}
+
+void timeout_init(void) {
+    pthread_t tid;
+    int lvl, i;
+
+    for (lvl = 0; lvl < TIMEOUT_LEVELS; lvl++) {
+        for (i = 0; i < WHEEL_SIZE; i++) {
+            wheel.slots[lvl][i].next = &wheel.slots[lvl][i];
+            wheel.slots[lvl][i].prev = &wheel.slots[lvl][i];
+        }
+    }
+    wheel.cur = now_tick();
+    Sem_init(&wheel.mutex, 0, 1);
+    if (conf.timer_wheel) {
+        Pthread_create(&tid, NULL, timeout_thread, NULL);
+    }
+}
+
+/* set the SO_RCVTIMEO or SO_SNDTIMEO of fd for reason */
+static void sock_timeout(int fd, int reason) {
+    struct timeval tv;
+    long ms = *timeout_ms[reason];
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = ms % 1000 * 1000;
+    setsockopt(fd, SOL_SOCKET, reason == TO_WRITE ? SO_SNDTIMEO : SO_RCVTIMEO,
+               &tv, sizeof(tv));
+}
+
+/*
+ * give fd, the socket which (TIMER_CLIENT or TIMER_ORIGIN) of the
+ * calling thread, the deadline for reason from now on
+ */
+void timeout_arm(int which, int fd, int reason) {
+    TIMER *t = &timers[which];
+    long ms = *timeout_ms[reason];
+
+    if (!conf.timer_wheel) {
+        /* the socket keeps its setting, only change it when it differs */
+        if (!t->armed || t->fd != fd || t->reason != reason) {
+            sock_timeout(fd, reason);
+            t->fd = fd;
+            t->reason = reason;
+            t->armed = 1;
+        }
+        return;
+    }
+    P(&wheel.mutex);
+    if (t->armed) {
+        wheel_unlink(t);
+        t->armed = 0;
+    }
+    if (ms > 0) {
+        t->fd = fd;
+        t->reason = reason;
+        t->expire = now_tick() + (ms + TIMEOUT_TICK_MS - 1) / TIMEOUT_TICK_MS;
+        wheel_link(t);
+        t->armed = 1;
+    }
+    V(&wheel.mutex);
+}
+
+/* drop the deadline of which; needed before its socket is closed */
+void timeout_disarm(int which) {
+    TIMER *t = &timers[which];
+
+    if (!conf.timer_wheel) {
+        t->armed = 0;
+        return;
+    }
+    /* only the timer thread clears it behind our back */
+    if (!__atomic_load_n(&t->armed, __ATOMIC_RELAXED)) {
+        return;
+    }
+    P(&wheel.mutex);
+    if (t->armed) {
+        wheel_unlink(t);
+        t->armed = 0;
+    }
+    V(&wheel.mutex);
+}
+
+/*
+ * a read or write on the socket of which just failed: without the
+ * wheel, count it as reaped when it was the socket timeout
+ */
+void timeout_note(int which) {
+    if (!conf.timer_wheel && timers[which].armed &&
+        (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        stats_add(reap_stat[timers[which].reason], 1);
+    }
+}
+
+/* print the deadlines and how many connections each reaped */
+void timeout_report(FILE *fp) {
+    fprintf(fp, "timeouts (%s): idle %ld ms, %lu reaped; read %ld ms, "
+            "%lu reaped; write %ld ms, %lu reaped\n",
+            conf.timer_wheel ? "wheel" : "socket",
+            conf.idle_timeout_ms, stats_counter(STAT_REAPED_IDLE),
+            conf.read_timeout_ms, stats_counter(STAT_REAPED_READ),
+            conf.write_timeout_ms, stats_counter(STAT_REAPED_WRITE));
+}
@@ -0,0 +1,30 @@
+/*
+ * read, write and idle deadlines of connections for proxy.c
+ */
+
+#ifndef __TIMEOUT_H__
+#define __TIMEOUT_H__
+
+/* the timers every thread has */
+#define TIMER_CLIENT 0   /* on the client connection */
+#define TIMER_ORIGIN 1   /* on the origin connection */
+#define TIMER_NTIMERS 2
+
+/* what a deadline is for, each with its conf.*_timeout_ms */
+#define TO_IDLE  0       /* waiting for the request line */
+#define TO_READ  1       /* waiting for more of a request or response */
+#define TO_WRITE 2       /* waiting for a peer to take what we send */
+#define TO_NREASONS 3
+
+/* the wheel: TIMEOUT_LEVELS levels of 2^TIMEOUT_BITS slots */
+#define TIMEOUT_TICK_MS 10
+#define TIMEOUT_BITS 6
+#define TIMEOUT_LEVELS 4
+
+void timeout_init(void);
+void timeout_arm(int which, int fd, int reason);
+void timeout_disarm(int which);
+void timeout_note(int which);
+void timeout_report(FILE *fp);
+
+#endif /* __TIMEOUT_H__ */
@@ -0,0 +1,222 @@
+/*
+ * tracing of slow requests for proxy.c
+ *
+ * While a request runs, the time of each phase (the phases of
+ * stats.h: read, lookup, dns, connect, first byte, transfer) is
+ * added up in a thread-local record; that costs a few stores on
+ * top of the clock reads stats.c needs anyway. When the request
+ * took at least conf.trace_slow_ms, the record is copied into a ring
+ * owned by the thread. Nothing on that path takes a lock: the owner
+ * is the only writer, and each record carries a sequence number that
+ * is odd while it is being written, so the exporter can tell a torn
+ * copy from a good one.
+ *
+ * The exporter thread wakes every conf.trace_interval_ms, copies what
+ * is new in every ring and prints one line per slow request to
+ * stderr. Records a thread wrote faster than the exporter could read
+ * them are counted as lost. Rings are reused by later threads the
+ * same way as the stats.c slots.
+ */
+
+#include "csapp.h"
+#include "config.h"
+#include "trace.h"
+
+typedef struct TRACE_REC {
+    unsigned long seq;           /* odd while the owner writes it */
+    time_t when;                 /* wall clock at the start */
+    int how;                     /* TRACE_HIT, TRACE_MISS or TRACE_ERROR */
+    unsigned us[STAT_NPHASES];   /* time spent in each phase */
+    char uri[TRACE_URI_LEN];
+} TRACE_REC;
+
+typedef struct TRACE_RING {
+    TRACE_REC rec[TRACE_RING_SIZE];
+    unsigned long head;          /* records written, set by the owner */
+    unsigned long read;          /* records seen, set by the exporter */
+    struct TRACE_RING *next;     /* list of every ring */
+    struct TRACE_RING *next_free;
+} __attribute__((aligned(64))) TRACE_RING;
+
+static TRACE_RING *rings, *free_rings;
+static sem_t rings_mutex;
+static pthread_key_t ring_key;
+static __thread TRACE_RING *self;
+
+/* the request the calling thread is working on */
+static __thread TRACE_REC cur;
+static __thread int active;
+
+/* counters, only the exporter writes them */
+static unsigned long exported_cnt, lost_cnt;
+
+/* give the ring of an exiting thread back */
+static void ring_put(void *varptr) {
+    TRACE_RING *ring = varptr;
+
+    P(&rings_mutex);
+    ring->next_free = free_rings;
+    free_rings = ring;
+    V(&rings_mutex);
+}
+
+/* the ring of the calling thread, taken on its first slow request */
+static TRACE_RING *trace_self() {
+    TRACE_RING *ring;
+
+    if (self) {
+        return self;
+    }
+    P(&rings_mutex);
+    if ((ring = free_rings) != NULL) {
+        free_rings = ring->next_free;
+    }
+    V(&rings_mutex);
+    if (ring == NULL) {
+        ring = Calloc(1, sizeof(TRACE_RING));
+        P(&rings_mutex);
+        ring->next = rings;
+        rings = ring;
+        V(&rings_mutex);
+    }
+    pthread_setspecific(ring_key, ring);
+    self = ring;
+    return ring;
+}
+
+/* start tracing the request of the calling thread */
+void trace_begin(void) {
+    if (conf.trace_slow_ms <= 0) {
+        return;
+    }
+    memset(&cur, 0, sizeof(cur));
+    cur.when = time(NULL);
+    active = 1;
+}
+
+/* add us to the time of a phase of the current request */
+void trace_phase(int phase, unsigned long us) {
+    if (active) {
+        cur.us[phase] += us;
+    }
+}
+
+/* finish the current request, keeping it if it was slow */
+void trace_end(char *uri, int how, unsigned long total_us) {
+    TRACE_RING *ring;
+    TRACE_REC *rec;
+    unsigned long seq;
+
+    if (!active) {
+        return;
+    }
+    active = 0;
+    if (total_us < conf.trace_slow_ms * 1000UL) {
+        return;
+    }
+    cur.us[STAT_PH_TOTAL] = total_us;
+    cur.how = how;
+    strncpy(cur.uri, uri, TRACE_URI_LEN - 1);
+
+    ring = trace_self();
+    rec = &ring->rec[ring->head % TRACE_RING_SIZE];
+    seq = rec->seq;
+    __atomic_store_n(&rec->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    cur.seq = seq + 1;
+    memcpy(rec, &cur, sizeof(cur));
+    __atomic_store_n(&rec->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* copy the unseen records of a ring into out, returns how many */
+static int ring_drain(TRACE_RING *ring, TRACE_REC *out) {
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long seq;
+    TRACE_REC *rec;
+    int n = 0;
+
+    if (head - ring->read > TRACE_RING_SIZE) {
+        lost_cnt += head - ring->read - TRACE_RING_SIZE;
+        ring->read = head - TRACE_RING_SIZE;
+    }
+    for (; ring->read < head; ring->read++) {
+        rec = &ring->rec[ring->read % TRACE_RING_SIZE];
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        memcpy(&out[n], rec, sizeof(TRACE_REC));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((seq & 1) || __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq) {
+            /* the owner came round and is overwriting it */
+            lost_cnt++;
+            continue;
+        }
+        n++;
+    }
+    return n;
+}
+
+/* print one slow request */
+static void trace_print(FILE *fp, TRACE_REC *rec) {
+    char when[32];
+    int ph;
+
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&rec->when));
+    fprintf(fp, "trace: %s %s %.3fms", when, rec->how == TRACE_HIT ? "hit" :
+            rec->how == TRACE_MISS ? "miss" : "error",
+            rec->us[STAT_PH_TOTAL] / 1e3);
+    for (ph = 0; ph < STAT_PH_TOTAL; ph++) {
+        if (rec->us[ph]) {
+            fprintf(fp, " %s=%.3f", stats_phase_names[ph], rec->us[ph] / 1e3);
+        }
+    }
+    fprintf(fp, " %s\n", rec->uri);
+}
+
+/* export the slow requests of every ring until the process exits */
+static void *trace_thread(void *vargp) {
+    TRACE_REC *out = NULL;
+    TRACE_RING *ring;
+    int cap = 0, n, i;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        usleep(conf.trace_interval_ms * 1000);
+        P(&rings_mutex);
+        for (n = 0, ring = rings; ring; ring = ring->next) {
+            n += TRACE_RING_SIZE;
+        }
+        if (n > cap) {
+            cap = n;
+            out = Realloc(out, cap * sizeof(TRACE_REC));
+        }
+        for (n = 0, ring = rings; ring; ring = ring->next) {
+            n += ring_drain(ring, out + n);
+        }
+        V(&rings_mutex);
+        for (i = 0; i < n; i++) {
+            trace_print(stderr, &out[i]);
+        }
+        exported_cnt += n;
+    }
+    return NULL;
+}
+
+/* set up the rings and start the exporter when tracing is on */
+void trace_init(void) {
+    pthread_t tid;
+    int rc;
+
+    Sem_init(&rings_mutex, 0, 1);
+    if ((rc = pthread_key_create(&ring_key, ring_put))) {
+        posix_error(rc, "pthread_key_create error");
+    }
+    if (conf.trace_slow_ms > 0) {
+        Pthread_create(&tid, NULL, trace_thread, NULL);
+    }
+}
+
+/* print the trace counters */
+void trace_report(FILE *fp) {
+    fprintf(fp, "trace: requests over %ld ms, %lu exported, %lu lost\n",
+            conf.trace_slow_ms, exported_cnt, lost_cnt);
+}
@@ -0,0 +1,27 @@
+/*
+ * tracing of slow requests for proxy.c
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "stats.h"
+
+/* slow requests kept per thread until the exporter picks them up */
+#define TRACE_RING_SIZE 64
+
+/* bytes of the uri kept in a trace */
+#define TRACE_URI_LEN 128
+
+/* how a traced request was answered */
+#define TRACE_HIT   'h'
+#define TRACE_MISS  'm'
+#define TRACE_ERROR 'e'
+
+void trace_init(void);
+void trace_begin(void);
+void trace_phase(int phase, unsigned long us);
+void trace_end(char *uri, int how, unsigned long total_us);
+void trace_report(FILE *fp);
+
+#endif /* __TRACE_H__ */
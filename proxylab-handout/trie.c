@@ -0,0 +1,206 @@
+/*
+ * radix tree over cache keys
+ *
+ * Each edge carries a run of bytes, so a chain of nodes with one
+ * child each is kept as a single node. Exact lookups cost the length
+ * of the key, and collecting every key under a prefix costs the size
+ * of the subtree below it, not the number of keys in the tree.
+ * The tree does no locking; the cache mutex protects it.
+ */
+
+#include "csapp.h"
+#include "trie.h"
+
+/* allocate a node for the first len bytes of label */
+static TRIE_N *node_new(char *label, int len, void *val) {
+    TRIE_N *node = Malloc(sizeof(TRIE_N));
+    node->label = Malloc(len + 1);
+    memcpy(node->label, label, len);
+    node->label[len] = '\0';
+    node->label_len = len;
+    node->val = val;
+    node->child = NULL;
+    node->sibling = NULL;
+    return node;
+}
+
+static void node_free(TRIE_N *node) {
+    Free(node->label);
+    Free(node);
+}
+
+/* the child of node whose label starts with c, and its link in *ppp */
+static TRIE_N *child_find(TRIE_N *node, char c, TRIE_N ***ppp) {
+    TRIE_N **pp = &node->child;
+    while (*pp && (*pp)->label[0] != c) {
+        pp = &(*pp)->sibling;
+    }
+    if (ppp) {
+        *ppp = pp;
+    }
+    return *pp;
+}
+
+void trie_init(TRIE *trie) {
+    memset(trie, 0, sizeof(TRIE));
+    trie->root.label = "";
+}
+
+/* value stored under key, NULL if there is none */
+void *trie_get(TRIE *trie, char *key) {
+    TRIE_N *node = &trie->root, *c;
+
+    while (*key) {
+        c = child_find(node, *key, NULL);
+        if (c == NULL || strncmp(c->label, key, c->label_len)) {
+            return NULL;
+        }
+        key += c->label_len;
+        node = c;
+    }
+    return node->val;
+}
+
+/* store val under key, replacing any value already there */
+void trie_put(TRIE *trie, char *key, void *val) {
+    TRIE_N *node = &trie->root, *c, *rest;
+    int n;
+
+    while (*key) {
+        if ((c = child_find(node, *key, NULL)) == NULL) {
+            c = node_new(key, strlen(key), val);
+            c->sibling = node->child;
+            node->child = c;
+            trie->cnt++;
+            return;
+        }
+        for (n = 0; n < c->label_len && c->label[n] == key[n]; n++)
+            ;
+        if (n < c->label_len) {
+            /* split c: it keeps the common part, rest takes the tail */
+            rest = node_new(c->label + n, c->label_len - n, c->val);
+            rest->child = c->child;
+            c->child = rest;
+            c->val = NULL;
+            c->label[n] = '\0';
+            c->label_len = n;
+        }
+        key += n;
+        node = c;
+    }
+    if (node->val == NULL) {
+        trie->cnt++;
+    }
+    node->val = val;
+}
+
+/*
+ * after a value below c went away, drop c if it is now useless or
+ * merge it with its only child. *pp is the link pointing to c.
+ */
+static void node_tidy(TRIE_N **pp, TRIE_N *c) {
+    TRIE_N *child = c->child;
+    char *label;
+
+    if (c->val) {
+        return;
+    }
+    if (child == NULL) {
+        *pp = c->sibling;
+        node_free(c);
+    }
+    else if (child->sibling == NULL) {
+        label = Malloc(c->label_len + child->label_len + 1);
+        memcpy(label, c->label, c->label_len);
+        strcpy(label + c->label_len, child->label);
+        Free(child->label);
+        child->label = label;
+        child->label_len += c->label_len;
+        child->sibling = c->sibling;
+        *pp = child;
+        node_free(c);
+    }
+}
+
+static void *node_del(TRIE_N *node, char *key) {
+    TRIE_N **pp, *c;
+    void *val;
+
+    c = child_find(node, *key, &pp);
+    if (c == NULL || strncmp(c->label, key, c->label_len)) {
+        return NULL;
+    }
+    key += c->label_len;
+    if (*key == '\0') {
+        val = c->val;
+        c->val = NULL;
+    }
+    else {
+        val = node_del(c, key);
+    }
+    if (val) {
+        node_tidy(pp, c);
+    }
+    return val;
+}
+
+/* remove key, returns the value it had or NULL */
+void *trie_del(TRIE *trie, char *key) {
+    void *val;
+
+    if (*key == '\0') {
+        val = trie->root.val;
+        trie->root.val = NULL;
+    }
+    else {
+        val = node_del(&trie->root, key);
+    }
+    if (val) {
+        trie->cnt--;
+    }
+    return val;
+}
+
+/* append every value in the subtree of node to a growing array */
+static void collect(TRIE_N *node, void ***valsp, int *n, int *cap) {
+    TRIE_N *c;
+
+    if (node->val) {
+        if (*n == *cap) {
+            *cap = *cap ? *cap * 2 : 16;
+            *valsp = Realloc(*valsp, *cap * sizeof(void *));
+        }
+        (*valsp)[(*n)++] = node->val;
+    }
+    for (c = node->child; c; c = c->sibling) {
+        collect(c, valsp, n, cap);
+    }
+}
+
+/*
+ * gather the values of every key that starts with prefix into a
+ * malloc'd array *valsp, to be freed by the caller
+ * returns the number of values found
+ */
+int trie_prefix(TRIE *trie, char *prefix, void ***valsp) {
+    TRIE_N *node = &trie->root, *c;
+    int n = 0, cap = 0, len;
+
+    *valsp = NULL;
+    while (*prefix) {
+        if ((c = child_find(node, *prefix, NULL)) == NULL) {
+            return 0;
+        }
+        len = strlen(prefix);
+        if (len > c->label_len) {
+            len = c->label_len;
+        }
+        if (strncmp(c->label, prefix, len)) {
+            return 0;
+        }
+        prefix += len;
+        node = c;
+    }
+    collect(node, valsp, &n, &cap);
+    return n;
+}
@@ -0,0 +1,28 @@
+/*
+ * radix tree over cache keys
+ */
+
+#ifndef __TRIE_H__
+#define __TRIE_H__
+
+/* a node, reached from its parent over the bytes of label */
+typedef struct TRIE_N {
+    char *label;
+    int label_len;
+    void *val;               /* value of the key ending here, or NULL */
+    struct TRIE_N *child;    /* first child */
+    struct TRIE_N *sibling;  /* next child of the same parent */
+} TRIE_N;
+
+typedef struct TRIE {
+    TRIE_N root;
+    unsigned cnt;            /* keys in the tree */
+} TRIE;
+
+void  trie_init(TRIE *trie);
+void *trie_get(TRIE *trie, char *key);
+void  trie_put(TRIE *trie, char *key, void *val);
+void *trie_del(TRIE *trie, char *key);
+int   trie_prefix(TRIE *trie, char *prefix, void ***valsp);
+
+#endif /* __TRIE_H__ */
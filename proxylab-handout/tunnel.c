@@ -0,0 +1,349 @@
+/*
+ * CONNECT tunnels for proxy.c
+ *
+ * Once a CONNECT is answered, its two sockets are handed over to one
+ * of conf.tunnel_threads relay threads and the connection thread
+ * returns, so an idle tunnel costs a TUNNEL and two descriptors in
+ * an epoll set instead of a blocked thread.
+ *
+ * Each tunnel has two directions, client to server and back. A
+ * direction reads into its buffer when the buffer is empty and writes
+ * it out when the other side can take it; both sockets are
+ * non-blocking and the epoll interest of each follows what its
+ * directions wait for. Buffers come from bufpool.c and go back as soon
+ * as they are drained, so idle tunnels hold none. When a side reaches
+ * EOF, what is buffered is flushed and the other side is shut down
+ * for writing (half-close); the tunnel is gone when both directions
+ * are, on an error, or after conf.tunnel_idle_ms without traffic.
+ * tunnel_add() only queues a tunnel and wakes its relay thread, so
+ * the epoll set and the tunnels in it are the relay thread's alone.
+ *
+ * splice() through a pipe would save the copy, but needs two more
+ * descriptors per direction, four per tunnel, which is what runs out
+ * first with thousands of tunnels.
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "csapp.h"
+#include "config.h"
+#include "stats.h"
+#include "bufpool.h"
+#include "tunnel.h"
+
+/* one way through a tunnel */
+typedef struct TUN_DIR {
+    char *buf;                /* NULL while empty */
+    int len;                  /* bytes in buf */
+    int off;                  /* of which written */
+    int eof;                  /* the reading side is done */
+    int shut;                 /* the writing side was shut down */
+} TUN_DIR;
+
+/* the epoll data of one socket of a tunnel */
+typedef struct TUN_END {
+    struct TUNNEL *t;
+    int side;                 /* 0 client, 1 server */
+    unsigned events;          /* registered interest */
+} TUN_END;
+
+typedef struct TUNNEL {
+    int fd[2];
+    TUN_DIR dir[2];           /* dir[s] reads fd[s] and writes fd[1 - s] */
+    TUN_END end[2];
+    unsigned long last_us;    /* last traffic */
+    int dead;
+    struct TUNNEL *next;      /* pending, then list of its relay thread */
+    struct TUNNEL *prev;
+} TUNNEL;
+
+typedef struct RELAY {
+    int epfd;
+    int wakefd;               /* eventfd, tells it of pending tunnels */
+    TUNNEL *pending;          /* handed over, not yet in the epoll set */
+    sem_t mutex;              /* guards pending */
+    TUNNEL head;              /* list of its tunnels, for the idle sweep */
+    long cnt;                 /* tunnels in the list */
+} RELAY;
+
+static RELAY relays[TUNNEL_MAX_THREADS];
+static int nrelays;
+static unsigned long next_relay;
+static long open_cnt;
+static unsigned long idle_closed;
+
+/* move what dir can of its bytes, returns -1 on an error */
+static int tun_pump(TUNNEL *t, int s) {
+    TUN_DIR *d = &t->dir[s];
+    int from = t->fd[s], to = t->fd[1 - s], n, rounds;
+
+    /* a bounded number of rounds keeps one busy tunnel from hogging */
+    for (rounds = 0; rounds < 16; rounds++) {
+        if (d->off == d->len && !d->eof) {
+            if (d->buf == NULL) {
+                d->buf = buf_get(TUNNEL_BUF);
+            }
+            if ((n = read(from, d->buf, TUNNEL_BUF)) > 0) {
+                d->len = n;
+                d->off = 0;
+                stats_add(STAT_TUNNEL_BYTES, n);
+            }
+            else if (n == 0) {
+                d->eof = 1;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            else if (errno != EINTR) {
+                return -1;
+            }
+        }
+        if (d->off < d->len) {
+            n = send(to, d->buf + d->off, d->len - d->off, MSG_NOSIGNAL);
+            if (n > 0) {
+                d->off += n;
+                if (d->off == d->len) {
+                    d->off = d->len = 0;
+                }
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            else if (errno != EINTR) {
+                return -1;
+            }
+        }
+        if (d->eof && d->off == d->len) {
+            if (!d->shut) {
+                shutdown(to, SHUT_WR);
+                d->shut = 1;
+            }
+            break;
+        }
+    }
+    if (d->buf != NULL && d->off == d->len) {
+        buf_put(d->buf);
+        d->buf = NULL;
+        d->off = d->len = 0;
+    }
+    return 0;
+}
+
+/* the epoll events side s waits for */
+static unsigned tun_want(TUNNEL *t, int s) {
+    unsigned want = 0;
+
+    if (!t->dir[s].eof && t->dir[s].off == t->dir[s].len) {
+        want |= EPOLLIN;
+    }
+    if (t->dir[1 - s].off < t->dir[1 - s].len) {
+        want |= EPOLLOUT;
+    }
+    return want;
+}
+
+/* make the epoll interest of side s follow what its directions need */
+static void tun_watch(RELAY *r, TUNNEL *t, int s) {
+    struct epoll_event ev;
+    unsigned want = tun_want(t, s);
+
+    if (want != t->end[s].events) {
+        ev.events = want;
+        ev.data.ptr = &t->end[s];
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, t->fd[s], &ev);
+        t->end[s].events = want;
+    }
+}
+
+/* close t; it is freed after the events of this round are handled */
+static void tun_close(RELAY *r, TUNNEL *t) {
+    int s;
+
+    if (t->dead) {
+        return;
+    }
+    t->dead = 1;
+    for (s = 0; s < 2; s++) {
+        close(t->fd[s]);
+        if (t->dir[s].buf != NULL) {
+            buf_put(t->dir[s].buf);
+            t->dir[s].buf = NULL;
+        }
+    }
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    __atomic_sub_fetch(&r->cnt, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&open_cnt, 1, __ATOMIC_RELAXED);
+}
+
+/* put the tunnels handed over by tunnel_add() in the epoll set */
+static void tun_adopt(RELAY *r) {
+    struct epoll_event ev;
+    uint64_t cnt;
+    TUNNEL *t, *next;
+    int s;
+
+    if (read(r->wakefd, &cnt, sizeof(cnt)) < 0) {
+        return;
+    }
+    P(&r->mutex);
+    t = r->pending;
+    r->pending = NULL;
+    V(&r->mutex);
+    for (; t != NULL; t = next) {
+        next = t->next;
+        t->next = r->head.next;
+        t->prev = &r->head;
+        r->head.next->prev = t;
+        r->head.next = t;
+        __atomic_add_fetch(&r->cnt, 1, __ATOMIC_RELAXED);
+        for (s = 0; s < 2; s++) {
+            t->end[s].t = t;
+            t->end[s].side = s;
+            t->end[s].events = tun_want(t, s);
+            ev.events = t->end[s].events;
+            ev.data.ptr = &t->end[s];
+            epoll_ctl(r->epfd, EPOLL_CTL_ADD, t->fd[s], &ev);
+        }
+    }
+}
+
+static void *relay_thread(void *varptr) {
+    RELAY *r = varptr;
+    struct epoll_event ev[TUNNEL_EVENTS];
+    TUNNEL *t, *dead[TUNNEL_EVENTS], *next;
+    TUN_END *end;
+    unsigned long now, sweep_us = 0;
+    int n, i, ndead, s;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        n = epoll_wait(r->epfd, ev, TUNNEL_EVENTS, 1000);
+        now = stats_now_us();
+        ndead = 0;
+        for (i = 0; i < n; i++) {
+            if (ev[i].data.ptr == NULL) {
+                tun_adopt(r);
+                continue;
+            }
+            end = ev[i].data.ptr;
+            t = end->t;
+            if (t->dead) {
+                continue;
+            }
+            t->last_us = now;
+            /* a reset, or a hang-up once nothing is left to read */
+            if (tun_pump(t, 0) < 0 || tun_pump(t, 1) < 0 ||
+                (t->dir[0].shut && t->dir[1].shut) ||
+                (ev[i].events & EPOLLERR) ||
+                ((ev[i].events & EPOLLHUP) && t->dir[end->side].eof)) {
+                tun_close(r, t);
+                dead[ndead++] = t;
+                continue;
+            }
+            for (s = 0; s < 2; s++) {
+                tun_watch(r, t, s);
+            }
+        }
+        /* nothing of this round can point at them any more */
+        for (i = 0; i < ndead; i++) {
+            Free(dead[i]);
+        }
+        if (conf.tunnel_idle_ms > 0 && now - sweep_us >= 1000000) {
+            sweep_us = now;
+            for (t = r->head.next; t != &r->head; t = next) {
+                next = t->next;
+                if (now - t->last_us >= conf.tunnel_idle_ms * 1000UL) {
+                    tun_close(r, t);
+                    Free(t);
+                    __atomic_add_fetch(&idle_closed, 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+void tunnel_init(void) {
+    struct epoll_event ev;
+    pthread_t tid;
+    int i;
+
+    nrelays = conf.tunnel_threads < TUNNEL_MAX_THREADS ?
+              conf.tunnel_threads : TUNNEL_MAX_THREADS;
+    for (i = 0; i < nrelays; i++) {
+        if ((relays[i].epfd = epoll_create1(0)) < 0 ||
+            (relays[i].wakefd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            unix_error("tunnel_init error");
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(relays[i].epfd, EPOLL_CTL_ADD, relays[i].wakefd, &ev);
+        relays[i].head.next = relays[i].head.prev = &relays[i].head;
+        Sem_init(&relays[i].mutex, 0, 1);
+        Pthread_create(&tid, NULL, relay_thread, &relays[i]);
+    }
+}
+
+/*
+ * relay between client_fd and server_fd from now on; both are closed
+ * when the tunnel ends. the len[0] bytes of head[0] are sent to the
+ * server first and the len[1] of head[1] to the client, each at most
+ * TUNNEL_BUF. returns 0, or -1 if there is no room for the tunnel
+ * (the sockets are then left to the caller)
+ */
+int tunnel_add(int client_fd, int server_fd, char *head[2], int len[2]) {
+    uint64_t one = 1;
+    RELAY *r;
+    TUNNEL *t;
+    int s;
+
+    if (nrelays == 0) {
+        return -1;
+    }
+    if (__atomic_add_fetch(&open_cnt, 1, __ATOMIC_RELAXED) >
+        conf.max_tunnels && conf.max_tunnels > 0) {
+        __atomic_sub_fetch(&open_cnt, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    stats_add(STAT_TUNNELS, 1);
+    r = &relays[__atomic_fetch_add(&next_relay, 1, __ATOMIC_RELAXED) %
+                nrelays];
+    t = Calloc(1, sizeof(TUNNEL));
+    t->fd[0] = client_fd;
+    t->fd[1] = server_fd;
+    t->last_us = stats_now_us();
+    for (s = 0; s < 2; s++) {
+        if (len[s] > 0) {
+            t->dir[s].buf = buf_get(TUNNEL_BUF);
+            memcpy(t->dir[s].buf, head[s], len[s]);
+            t->dir[s].len = len[s];
+        }
+        fcntl(t->fd[s], F_SETFL, fcntl(t->fd[s], F_GETFL) | O_NONBLOCK);
+    }
+    P(&r->mutex);
+    t->next = r->pending;
+    r->pending = t;
+    V(&r->mutex);
+    /* from here on only the relay thread touches t */
+    if (write(r->wakefd, &one, sizeof(one)) < 0) {
+        unix_error("tunnel_add error");
+    }
+    return 0;
+}
+
+/* print the tunnels open on each relay thread */
+void tunnel_report(FILE *fp) {
+    int i;
+
+    fprintf(fp, "tunnels: %ld open (",
+            __atomic_load_n(&open_cnt, __ATOMIC_RELAXED));
+    for (i = 0; i < nrelays; i++) {
+        fprintf(fp, "%s%ld", i ? " " : "",
+                __atomic_load_n(&relays[i].cnt, __ATOMIC_RELAXED));
+    }
+    fprintf(fp, "), %lu opened, %lu closed idle, %lu bytes relayed\n",
+            stats_counter(STAT_TUNNELS),
+            __atomic_load_n(&idle_closed, __ATOMIC_RELAXED),
+            stats_counter(STAT_TUNNEL_BYTES));
+}
@@ -0,0 +1,21 @@
+/*
+ * CONNECT tunnels for proxy.c
+ */
+
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+/* most relay threads */
+#define TUNNEL_MAX_THREADS 64
+
+/* bytes a direction of a tunnel holds while it waits to write them */
+#define TUNNEL_BUF 16384
+
+/* events handled per epoll_wait() */
+#define TUNNEL_EVENTS 256
+
+void tunnel_init(void);
+int  tunnel_add(int client_fd, int server_fd, char *head[2], int len[2]);
+void tunnel_report(FILE *fp);
+
+#endif /* __TUNNEL_H__ */